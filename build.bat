@@ -2,10 +2,15 @@
 
 set EXE_NAME=sdl_main.exe
 set DLL_NAME=game.dll
+set BENCHMARK_NAME=benchmark.exe
+set PACKER_NAME=asset_packer.exe
 
 set SDL_DIR=C:\SDL2-2.0.10
 
 :: Debug messages etc
+:: Optional: /DPREFAULT_BUFFERS to touch and lock the render and audio buffers at startup
+:: Optional: /DINPUT_HISTORY_FRAMES=N for frames of input history passed to the game (default 8)
+:: Optional: /DPROFILER for timed blocks in platform and game code, collated per frame (press p for a report)
 set ADDITIONAL_FLAGS=/DSTDOUT_DEBUG /DFIXED_GAME_MEMORY
 
 
@@ -30,14 +35,17 @@ set DISABLED_WARNINGS=/wd4100 /wd4189
 set COMMON_COMPILER_FLAGS=/Oi /GR- /EHa- /nologo /W4 /MT /Gm- /Z7 /Fm %DISABLED_WARNINGS%
 set PLATFORM_COMPILER_FLAGS=%COMMON_COMPILER_FLAGS% /I %SDL_DIR%\include
 set GAME_COMPILER_FLAGS=%COMMON_COMPILER_FLAGS% /LD
+:: /O2      benchmarks are meaningless unoptimized
+set BENCHMARK_COMPILER_FLAGS=%COMMON_COMPILER_FLAGS% /O2
+set PACKER_COMPILER_FLAGS=%COMMON_COMPILER_FLAGS% /O2
 
 :: Linker flags
 :: /opt:ref         remove unneeded stuff from .map file
 :: /LIBPATH:        sdl library path, libraries to include, and additional arguments (enable console subsystem for debugging)
 :: /INCREMENTAL:NO  perform a full link
 set COMMON_LINKER_FLAGS=/INCREMENTAL:NO
-set PLATFORM_LINKER_FLAGS=%COMMON_LINKER_FLAGS% /LIBPATH:%SDL_DIR%\lib\x64 SDL2.lib SDL2main.lib /SUBSYSTEM:CONSOLE
-set GAME_LINKER_FLAGS=%COMMON_LINKER_FLAGS% /DLL /EXPORT:game_init_memory /EXPORT:game_update_and_render
+set PLATFORM_LINKER_FLAGS=%COMMON_LINKER_FLAGS% /LIBPATH:%SDL_DIR%\lib\x64 SDL2.lib SDL2main.lib psapi.lib winmm.lib /SUBSYSTEM:CONSOLE
+set GAME_LINKER_FLAGS=%COMMON_LINKER_FLAGS% /DLL /EXPORT:game_init_memory /EXPORT:game_update /EXPORT:game_render /EXPORT:game_get_sound_samples
 
 :: Create build directory and copy SDL2.dll in case it isn't there
 IF NOT EXIST build mkdir build
@@ -46,10 +54,16 @@ IF NOT EXIST SDL2.dll copy %SDL_DIR%\lib\x64\SDL2.dll .
 
 IF EXIST %EXE_NAME% del %EXE_NAME%
 IF EXIST %DLL_NAME% del %DLL_NAME%
+IF EXIST %BENCHMARK_NAME% del %BENCHMARK_NAME%
+IF EXIST %PACKER_NAME% del %PACKER_NAME%
 
 :: Build platform executable
 cl ..\src\sdl_main.cpp %PLATFORM_COMPILER_FLAGS% %ADDITIONAL_FLAGS% /link %PLATFORM_LINKER_FLAGS%
 :: Build game code dll
 cl ..\src\game.cpp %GAME_COMPILER_FLAGS% %ADDITIONAL_FLAGS% /link %GAME_LINKER_FLAGS%
+:: Build benchmarks
+cl ..\src\benchmark.cpp %BENCHMARK_COMPILER_FLAGS% %ADDITIONAL_FLAGS% /link %COMMON_LINKER_FLAGS%
+:: Build asset packer
+cl ..\src\asset_packer.cpp %PACKER_COMPILER_FLAGS% %ADDITIONAL_FLAGS% /link %COMMON_LINKER_FLAGS%
 
 cd ..
\ No newline at end of file
@@ -3,22 +3,38 @@ rm -rf build
 mkdir -p build
 cd build
 
-EXECUTABLE_NAME=sdl_game_starter
-SO_NAME=game_starter.so
+EXECUTABLE_NAME=sdl_main
+SO_NAME=game.so
+BENCHMARK_NAME=benchmark
+PACKER_NAME=asset_packer
 
-GAME_SOURCES="../src/game_starter.cpp"
-GAME_OBJS="game_starter.o"
-PLATFORM_SOURCES="../src/sdl_game_starter.cpp"
-PLATFORM_OBJS="sdl_game_starter.o"
+GAME_SOURCES="../src/game.cpp"
+GAME_OBJS="game.o"
+PLATFORM_SOURCES="../src/sdl_main.cpp"
+PLATFORM_OBJS="sdl_main.o"
+BENCHMARK_SOURCES="../src/benchmark.cpp"
+BENCHMARK_OBJS="benchmark.o"
+PACKER_SOURCES="../src/asset_packer.cpp"
+PACKER_OBJS="asset_packer.o"
 
+# Optional:
+#   -DHUGE_PAGE_GAME_MEMORY  back game memory with huge pages (MAP_HUGETLB, falling back to transparent huge pages)
+#   -DPREFAULT_BUFFERS       touch and lock the render and audio buffers at startup so they never fault during a frame
+#   -DINPUT_HISTORY_FRAMES=N frames of input history passed to the game (default 8)
+#   -DPROFILER               timed blocks in platform and game code, collated per frame; press p for a report
 OTHER_FLAGS="-DSTDOUT_DEBUG -DFIXED_GAME_MEMORY"
 COMMON_COMPILER_FLAGS="-c -Wall"
 PLATFORM_COMPILER_FLAGS="${COMMON_COMPILER_FLAGS}"
 GAME_COMPILER_FLAGS="${COMMON_COMPILER_FLAGS} -fPIC"
+# benchmarks are meaningless unoptimized
+BENCHMARK_COMPILER_FLAGS="${COMMON_COMPILER_FLAGS} -O2"
+PACKER_COMPILER_FLAGS="${COMMON_COMPILER_FLAGS} -O2"
 
 COMMON_LINKER_FLAGS=""
 PLATFORM_LINKER_FLAGS="${COMMON_LINKER_FLAGS} -lSDL2"
 GAME_LINKER_FLAGS="${COMMON_LINKER_FLAGS} -shared"
+BENCHMARK_LINKER_FLAGS="${COMMON_LINKER_FLAGS}"
+PACKER_LINKER_FLAGS="${COMMON_LINKER_FLAGS}"
 
 echo "compiling platform"
 for src in ${PLATFORM_SOURCES}; do
@@ -32,12 +48,28 @@ for src in ${GAME_SOURCES}; do
     g++ ${src} ${GAME_COMPILER_FLAGS} ${OTHER_FLAGS} || exit 1
 done
 
+echo "compiling benchmark"
+for src in ${BENCHMARK_SOURCES}; do
+    echo "  $src"
+    g++ ${src} ${BENCHMARK_COMPILER_FLAGS} ${OTHER_FLAGS} || exit 1
+done
+
+echo "compiling asset packer"
+for src in ${PACKER_SOURCES}; do
+    echo "  $src"
+    g++ ${src} ${PACKER_COMPILER_FLAGS} ${OTHER_FLAGS} || exit 1
+done
+
 echo "linking"
 g++ ${PLATFORM_OBJS} ${PLATFORM_LINKER_FLAGS} -o ${EXECUTABLE_NAME}
 g++ ${GAME_OBJS} ${GAME_LINKER_FLAGS} -o ${SO_NAME}
+g++ ${BENCHMARK_OBJS} ${BENCHMARK_LINKER_FLAGS} -o ${BENCHMARK_NAME}
+g++ ${PACKER_OBJS} ${PACKER_LINKER_FLAGS} -o ${PACKER_NAME}
 echo "done"
 
 
 cd ..
 mv build/${EXECUTABLE_NAME} .
 mv build/${SO_NAME} .
+mv build/${BENCHMARK_NAME} .
+mv build/${PACKER_NAME} .
@@ -1,10 +1,52 @@
+#include"memory_arena.h"
+#include"oscillator.h"
+#include"spsc_queue.h"
+#include"game_platform_interface.h"
 
+// Sent from game_update to whichever thread is making the sound
+struct SoundMessage
+{
+    int wave_hz;
+    int wave_amplitude;
+    AudioStream music;  // 0 for none
+};
+
+// Only touched by the thread making the sound (the audio thread, unless the platform is pushing sound)
+struct SoundState
+{
+    SineOscillator tone;
+    int wave_hz;
+    int wave_amplitude;
+    AudioStream music;
+};
 
 struct GameState
 {
+    // permanent_arena holds everything that lives as long as the game; transient_arena is reset every frame
+    MemoryArena permanent_arena;
+    MemoryArena transient_arena;
+
+    SoundState sound;
+    SPSCQueue<SoundMessage, 64> sound_messages;
+    int dropped_sound_messages;     // since game_update last reported them
+
     int wave_hz;
     int wave_amplitude;
-    int x_offset;
-    int y_offset;
+    // scroll position after the last update, and before it; game_render draws in between
+    float x_offset;
+    float y_offset;
+    float last_x_offset;
+    float last_y_offset;
+    // offsets of the last frame drawn; when the next one would be the same, it isn't drawn at all
+    int drawn_x_offset;
+    int drawn_y_offset;
+
+    // file I/O test (A writes, B reads); a request is 0 when nothing is in flight
+    FileRequest test_write_request;
+    FileRequest test_read_request;
+    char test_write_buffer[8];
+    char test_read_buffer[8];
+    // streamed music test (X starts and stops it); opened and closed here, read by the thread making the sound
+    AudioStream music;
     bool running;
 };
\ No newline at end of file
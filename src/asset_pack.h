@@ -0,0 +1,155 @@
+#ifndef ASSET_PACK_H
+/*
+ * Packed asset archive format, shared by the packer (asset_packer.cpp), the platform and game code
+ *
+ * [AssetPackHeader][AssetPackGroup x num_groups][AssetPackEntry x num_index_slots][asset data...]
+ * The index is an open addressed hash table keyed by asset id, probed linearly from (id & mask); id 0 is an
+ * empty slot. Asset data is aligned to ASSET_PACK_ALIGNMENT and stored group by group, so each group is one
+ * contiguous range of the file that can be prefetched in one go.
+ * Everything is little endian, and the file is used in place; nothing is copied or fixed up on load.
+ */
+
+#include"util.h"
+
+static const uint32_t ASSET_PACK_MAGIC = 0x4b415041;   // "APAK"
+static const uint32_t ASSET_PACK_VERSION = 1;
+static const uint64_t ASSET_PACK_ALIGNMENT = 64;        // cache line, and enough for any SIMD load
+
+struct AssetPackHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_assets;
+    uint32_t num_index_slots;   // power of 2, at least twice num_assets
+    uint32_t num_groups;
+    uint32_t reserved;
+    uint64_t groups_offset;     // AssetPackGroup[num_groups], sorted by id
+    uint64_t index_offset;      // AssetPackEntry[num_index_slots]
+    uint64_t file_size;
+};
+
+struct AssetPackGroup
+{
+    uint32_t id;
+    uint32_t num_assets;
+    uint64_t offset;    // of the group's first asset; the group runs to offset + size
+    uint64_t size;
+};
+
+struct AssetPackEntry
+{
+    uint64_t id;        // 0 for an empty slot
+    uint64_t offset;    // from the start of the file
+    uint64_t size;
+    uint32_t group;
+    uint32_t reserved;
+};
+
+// 64 bit FNV-1a of the asset's name; what the packer stores and game code looks assets up by
+static inline uint64_t asset_id(const char* name)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const char* c = name; *c; ++c)
+    {
+        hash ^= (uint8_t)*c;
+        hash *= 0x100000001b3ULL;
+    }
+    // 0 marks an empty slot
+    return hash ? hash : 1;
+}
+
+static inline bool asset_pack_range_ok(uint64_t offset, uint64_t size, uint64_t file_size)
+{
+    return offset <= file_size && size <= file_size - offset;
+}
+
+// Check a whole file before trusting anything in it; every offset the lookups use is inside the file afterwards
+static inline bool validate_asset_pack(const void* data, uint64_t size)
+{
+    const AssetPackHeader* header = (const AssetPackHeader*)data;
+    if (size < sizeof(AssetPackHeader) || header->magic != ASSET_PACK_MAGIC || header->version != ASSET_PACK_VERSION ||
+        header->file_size != size)
+    {
+        return false;
+    }
+    uint32_t slots = header->num_index_slots;
+    if (!IS_POWER_OF_2(slots) || header->num_assets > slots / 2 ||
+        !asset_pack_range_ok(header->groups_offset, (uint64_t)header->num_groups * sizeof(AssetPackGroup), size) ||
+        !asset_pack_range_ok(header->index_offset, (uint64_t)slots * sizeof(AssetPackEntry), size) ||
+        header->groups_offset % 8 || header->index_offset % 8)
+    {
+        return false;
+    }
+
+    const AssetPackGroup* groups = (const AssetPackGroup*)((const uint8_t*)data + header->groups_offset);
+    for (uint32_t i = 0; i < header->num_groups; ++i)
+    {
+        if (!asset_pack_range_ok(groups[i].offset, groups[i].size, size) || (i && groups[i].id <= groups[i - 1].id))
+        {
+            return false;
+        }
+    }
+
+    const AssetPackEntry* index = (const AssetPackEntry*)((const uint8_t*)data + header->index_offset);
+    uint32_t num_assets = 0;
+    for (uint32_t i = 0; i < slots; ++i)
+    {
+        if (index[i].id)
+        {
+            if (!asset_pack_range_ok(index[i].offset, index[i].size, size))
+            {
+                return false;
+            }
+            ++num_assets;
+        }
+    }
+    return num_assets == header->num_assets;
+}
+
+// NULL if there's no such asset; the pack must have been validated
+static inline const AssetPackEntry* find_asset_pack_entry(const void* data, uint64_t id)
+{
+    const AssetPackHeader* header = (const AssetPackHeader*)data;
+    const AssetPackEntry* index = (const AssetPackEntry*)((const uint8_t*)data + header->index_offset);
+    uint32_t mask = header->num_index_slots - 1;
+    uint32_t slot = (uint32_t)id & mask;
+    // never full, so this always reaches the id or an empty slot
+    for (;;)
+    {
+        if (index[slot].id == id)
+        {
+            return &index[slot];
+        }
+        if (!index[slot].id)
+        {
+            return NULL;
+        }
+        slot = (slot + 1) & mask;
+    }
+}
+
+// NULL if there's no such group; groups are sorted, so this is a binary search
+static inline const AssetPackGroup* find_asset_pack_group(const void* data, uint32_t id)
+{
+    const AssetPackHeader* header = (const AssetPackHeader*)data;
+    const AssetPackGroup* groups = (const AssetPackGroup*)((const uint8_t*)data + header->groups_offset);
+    uint32_t low = 0;
+    uint32_t high = header->num_groups;
+    while (low < high)
+    {
+        uint32_t middle = low + (high - low) / 2;
+        if (groups[middle].id < id)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return low < header->num_groups && groups[low].id == id ? &groups[low] : NULL;
+}
+
+
+#define ASSET_PACK_H
+#endif
@@ -0,0 +1,309 @@
+/*
+ * Builds an asset pack (asset_pack.h) from a manifest
+ *
+ *   asset_packer <manifest> <output.pack>
+ *
+ * Each manifest line is "<group> <name> <file>": group is a number, name is what game code passes to asset_id,
+ * and file is read relative to the working directory. Lines starting with # are skipped.
+ * Assets are laid out group by group, in manifest order within a group.
+ * Built next to the game by build.sh/build.bat
+ */
+#include<string.h>
+#include<stdio.h>
+
+#include"util.h"
+#include"asset_pack.h"
+
+#ifdef _WIN32
+#define FSEEK64 _fseeki64
+#define FTELL64 _ftelli64
+#else
+#define FSEEK64 fseeko
+#define FTELL64 ftello
+#endif
+
+static const int ASSET_NAME_LENGTH = 256;
+static const int ASSET_PATH_LENGTH = 1024;
+static const size_t COPY_CHUNK_SIZE = MEBIBYTES(1);
+
+#define PACKER_ERROR(...)               \
+    do                                  \
+    {                                   \
+        fprintf(stderr, __VA_ARGS__);   \
+        exit(1);                        \
+    } while(false)
+
+struct PackerAsset
+{
+    uint32_t group;
+    int order;          // line in the manifest, so sorting by group keeps manifest order
+    uint64_t id;
+    uint64_t size;
+    uint64_t offset;
+    char name[ASSET_NAME_LENGTH];
+    char path[ASSET_PATH_LENGTH];
+};
+
+static inline uint64_t align_up(uint64_t value, uint64_t alignment)
+{
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+static int compare_assets(const void* a, const void* b)
+{
+    const PackerAsset* asset_a = (const PackerAsset*)a;
+    const PackerAsset* asset_b = (const PackerAsset*)b;
+    if (asset_a->group != asset_b->group)
+    {
+        return asset_a->group < asset_b->group ? -1 : 1;
+    }
+    return asset_a->order - asset_b->order;
+}
+
+static int compare_ids(const void* a, const void* b)
+{
+    uint64_t id_a = ((const PackerAsset*)a)->id;
+    uint64_t id_b = ((const PackerAsset*)b)->id;
+    return id_a < id_b ? -1 : (id_a > id_b ? 1 : 0);
+}
+
+static uint64_t get_file_size(const char* path)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file || FSEEK64(file, 0, SEEK_END))
+    {
+        PACKER_ERROR("Couldn't open %s\n", path);
+    }
+    int64_t size = FTELL64(file);
+    fclose(file);
+    if (size < 0)
+    {
+        PACKER_ERROR("Couldn't get the size of %s\n", path);
+    }
+    return (uint64_t)size;
+}
+
+static PackerAsset* read_manifest(const char* path, int* num_assets)
+{
+    FILE* manifest = fopen(path, "r");
+    if (!manifest)
+    {
+        PACKER_ERROR("Couldn't open manifest %s\n", path);
+    }
+
+    int capacity = 64;
+    int count = 0;
+    PackerAsset* assets = (PackerAsset*)malloc(sizeof(PackerAsset) * capacity);
+    char line[2048];
+    int line_number = 0;
+    while (fgets(line, sizeof(line), manifest))
+    {
+        ++line_number;
+        line[strcspn(line, "\r\n")] = 0;
+        if (line[0] == '#' || line[strspn(line, " \t")] == 0)
+        {
+            continue;
+        }
+
+        if (count == capacity)
+        {
+            capacity *= 2;
+            assets = (PackerAsset*)realloc(assets, sizeof(PackerAsset) * capacity);
+        }
+        if (!assets)
+        {
+            PACKER_ERROR("Out of memory\n");
+        }
+        PackerAsset* asset = &assets[count];
+        unsigned group;
+        // file is the rest of the line, so it can have spaces in it
+        if (sscanf(line, "%u %255s %1023[^\n]", &group, asset->name, asset->path) != 3)
+        {
+            PACKER_ERROR("%s:%d: expected \"<group> <name> <file>\"\n", path, line_number);
+        }
+        asset->group = (uint32_t)group;
+        asset->order = count;
+        asset->id = asset_id(asset->name);
+        asset->size = get_file_size(asset->path);
+        ++count;
+    }
+    fclose(manifest);
+
+    *num_assets = count;
+    return assets;
+}
+
+static void write_bytes(FILE* file, const void* data, uint64_t size, const char* output_path)
+{
+    if (size && fwrite(data, 1, (size_t)size, file) != size)
+    {
+        PACKER_ERROR("Couldn't write to %s\n", output_path);
+    }
+}
+
+static void write_padding(FILE* file, uint64_t* position, uint64_t target, const char* output_path)
+{
+    static const uint8_t zeros[ASSET_PACK_ALIGNMENT] = {};
+    DEBUG_ASSERT(target - *position <= ASSET_PACK_ALIGNMENT);
+    write_bytes(file, zeros, target - *position, output_path);
+    *position = target;
+}
+
+// Read the finished pack back and look every asset up, the same way the platform will
+static void verify_pack(const char* output_path, const PackerAsset* assets, int num_assets)
+{
+    uint64_t size = get_file_size(output_path);
+    void* data = malloc((size_t)size);
+    FILE* file = fopen(output_path, "rb");
+    if (!data || !file || fread(data, 1, (size_t)size, file) != size)
+    {
+        PACKER_ERROR("Couldn't read back %s\n", output_path);
+    }
+    fclose(file);
+
+    if (!validate_asset_pack(data, size))
+    {
+        PACKER_ERROR("%s doesn't validate\n", output_path);
+    }
+    for (int i = 0; i < num_assets; ++i)
+    {
+        const AssetPackEntry* entry = find_asset_pack_entry(data, assets[i].id);
+        if (!entry || entry->offset != assets[i].offset || entry->size != assets[i].size || !find_asset_pack_group(data, entry->group))
+        {
+            PACKER_ERROR("%s: lookup of %s failed\n", output_path, assets[i].name);
+        }
+    }
+    free(data);
+}
+
+int main(int argc, char* args[])
+{
+    if (argc != 3)
+    {
+        PACKER_ERROR("Usage: %s <manifest> <output.pack>\n", args[0]);
+    }
+    const char* output_path = args[2];
+
+    int num_assets;
+    PackerAsset* assets = read_manifest(args[1], &num_assets);
+
+    // ids are hashes of names; two names with the same hash (or the same name twice) can't both be found
+    qsort(assets, num_assets, sizeof(PackerAsset), compare_ids);
+    for (int i = 1; i < num_assets; ++i)
+    {
+        if (assets[i].id == assets[i - 1].id)
+        {
+            PACKER_ERROR("%s and %s have the same id; rename one\n", assets[i - 1].name, assets[i].name);
+        }
+    }
+    qsort(assets, num_assets, sizeof(PackerAsset), compare_assets);
+
+    int num_groups = 0;
+    for (int i = 0; i < num_assets; ++i)
+    {
+        num_groups += (i == 0 || assets[i].group != assets[i - 1].group);
+    }
+    uint32_t num_index_slots = 1;
+    while (num_index_slots < 2 * (uint32_t)num_assets)
+    {
+        num_index_slots *= 2;
+    }
+
+    AssetPackHeader header = {};
+    header.magic = ASSET_PACK_MAGIC;
+    header.version = ASSET_PACK_VERSION;
+    header.num_assets = (uint32_t)num_assets;
+    header.num_index_slots = num_index_slots;
+    header.num_groups = (uint32_t)num_groups;
+    header.groups_offset = align_up(sizeof(AssetPackHeader), 8);
+    header.index_offset = align_up(header.groups_offset + sizeof(AssetPackGroup) * num_groups, 8);
+
+    // lay out the data, and the groups and index that point into it
+    AssetPackGroup* groups = (AssetPackGroup*)calloc(MAX(num_groups, 1), sizeof(AssetPackGroup));
+    AssetPackEntry* index = (AssetPackEntry*)calloc(num_index_slots, sizeof(AssetPackEntry));
+    if (!groups || !index)
+    {
+        PACKER_ERROR("Out of memory\n");
+    }
+    uint64_t position = header.index_offset + sizeof(AssetPackEntry) * num_index_slots;
+    int group = -1;
+    for (int i = 0; i < num_assets; ++i)
+    {
+        PackerAsset* asset = &assets[i];
+        asset->offset = align_up(position, ASSET_PACK_ALIGNMENT);
+        position = asset->offset + asset->size;
+
+        if (i == 0 || asset->group != assets[i - 1].group)
+        {
+            ++group;
+            groups[group].id = asset->group;
+            groups[group].offset = asset->offset;
+        }
+        groups[group].num_assets++;
+        groups[group].size = position - groups[group].offset;
+
+        uint32_t slot = (uint32_t)asset->id & (num_index_slots - 1);
+        while (index[slot].id)
+        {
+            slot = (slot + 1) & (num_index_slots - 1);
+        }
+        index[slot].id = asset->id;
+        index[slot].offset = asset->offset;
+        index[slot].size = asset->size;
+        index[slot].group = asset->group;
+    }
+    header.file_size = position;
+
+    FILE* output = fopen(output_path, "wb");
+    if (!output)
+    {
+        PACKER_ERROR("Couldn't create %s\n", output_path);
+    }
+    write_bytes(output, &header, sizeof(header), output_path);
+    position = sizeof(header);
+    write_padding(output, &position, header.groups_offset, output_path);
+    write_bytes(output, groups, sizeof(AssetPackGroup) * num_groups, output_path);
+    position += sizeof(AssetPackGroup) * num_groups;
+    write_padding(output, &position, header.index_offset, output_path);
+    write_bytes(output, index, sizeof(AssetPackEntry) * num_index_slots, output_path);
+    position += sizeof(AssetPackEntry) * num_index_slots;
+
+    void* chunk = malloc(COPY_CHUNK_SIZE);
+    for (int i = 0; i < num_assets; ++i)
+    {
+        PackerAsset* asset = &assets[i];
+        write_padding(output, &position, asset->offset, output_path);
+
+        FILE* input = fopen(asset->path, "rb");
+        if (!input || !chunk)
+        {
+            PACKER_ERROR("Couldn't open %s\n", asset->path);
+        }
+        uint64_t remaining = asset->size;
+        while (remaining)
+        {
+            size_t length = (size_t)MIN(remaining, (uint64_t)COPY_CHUNK_SIZE);
+            if (fread(chunk, 1, length, input) != length)
+            {
+                PACKER_ERROR("%s changed size while packing\n", asset->path);
+            }
+            write_bytes(output, chunk, length, output_path);
+            remaining -= length;
+        }
+        fclose(input);
+        position += asset->size;
+    }
+    free(chunk);
+    if (fclose(output))
+    {
+        PACKER_ERROR("Couldn't write to %s\n", output_path);
+    }
+
+    verify_pack(output_path, assets, num_assets);
+    printf("Packed %d assets in %d groups into %s (%llu bytes)\n", num_assets, num_groups, output_path, (unsigned long long)header.file_size);
+
+    free(index);
+    free(groups);
+    free(assets);
+    return 0;
+}
@@ -0,0 +1,81 @@
+#ifndef AUDIO_RING_BUFFER_H
+/*
+ * Ring buffer between the main loop (push mode) and the audio callback, and the copies in and out of it
+ * No SDL in here, so the benchmarks can time exactly what the platform layer runs
+ */
+
+#include<string.h>
+#include<atomic>
+
+#include"util.h"
+
+// ~1.3ms at 48kHz; short enough to not sound like a fade, long enough to not click
+static const int AUDIO_FADE_SAMPLES = 64;
+
+// Single producer (main thread), single consumer (audio callback); neither ever blocks the other
+// Cursors count bytes since the start and wrap naturally at 2^32; index into data with (cursor & mask)
+// Bytes in [play_cursor, write_cursor) are written but not yet played
+struct AudioRingBuffer
+{
+    int size;   // power of 2
+    uint32_t mask;
+    uint8_t silence;
+    void* data;
+
+    // written by the main thread only
+    alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> write_cursor;
+    // written by the audio callback only; always advances by the full callback length, even when there wasn't enough data
+    alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> play_cursor;
+    std::atomic<uint32_t> underrun_count;   // callbacks that ran out of data
+    bool faded_out;     // callback only; the last block ended in a fade out, so the next data fades back in
+};
+
+// Copy length bytes into the ring starting at cursor (2 pieces if it wraps); doesn't move any cursors
+static inline void ring_buffer_write(AudioRingBuffer* ring_buffer, uint32_t cursor, const void* source, int length)
+{
+    DEBUG_ASSERT(length <= ring_buffer->size);
+    uint32_t index = cursor & ring_buffer->mask;
+    int region_size_1 = MIN(length, ring_buffer->size - (int)index);
+    int region_size_2 = length - region_size_1;
+
+    memcpy(&((uint8_t*)ring_buffer->data)[index], source, region_size_1);
+    if (region_size_2)
+    {
+        memcpy(ring_buffer->data, &((const uint8_t*)source)[region_size_1], region_size_2);
+    }
+}
+
+// Copy length bytes out of the ring starting at cursor (2 pieces if it wraps); doesn't move any cursors
+static inline void ring_buffer_read(AudioRingBuffer* ring_buffer, uint32_t cursor, void* dest, int length)
+{
+    DEBUG_ASSERT(length <= ring_buffer->size);
+    uint32_t index = cursor & ring_buffer->mask;
+    int region_size_1 = MIN(length, ring_buffer->size - (int)index);
+    int region_size_2 = length - region_size_1;
+
+    memcpy(dest, &((uint8_t*)ring_buffer->data)[index], region_size_1);
+    if (region_size_2)
+    {
+        memcpy(&((uint8_t*)dest)[region_size_1], ring_buffer->data, region_size_2);
+    }
+}
+
+// Linear ramp over the first (fade in) or last (fade out) samples of a block of interleaved 16 bit audio
+static void fade_audio(int16_t* samples, int num_samples, int num_channels, bool fade_in)
+{
+    int fade_samples = MIN(num_samples, AUDIO_FADE_SAMPLES);
+    int16_t* start = fade_in ? samples : samples + (num_samples - fade_samples) * num_channels;
+    for (int i = 0; i < fade_samples; ++i)
+    {
+        // fade out reaches 0 on the last sample, so the silence after it joins up
+        float gain = fade_in ? (float)i / (float)fade_samples : (float)(fade_samples - 1 - i) / (float)fade_samples;
+        for (int ch = 0; ch < num_channels; ++ch)
+        {
+            start[i * num_channels + ch] = (int16_t)((float)start[i * num_channels + ch] * gain);
+        }
+    }
+}
+
+
+#define AUDIO_RING_BUFFER_H
+#endif
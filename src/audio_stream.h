@@ -0,0 +1,175 @@
+#ifndef AUDIO_STREAM_H
+/*
+ * Decoding streamed sound files, and mixing decoded sound into the game's sound buffer
+ * No SDL in here; the platform's stream thread (sdl_audio_stream.h) parses and decodes, game code mixes,
+ * and the benchmarks time both
+ *
+ * Streams always decode to interleaved 16 bit stereo at the output rate; a "frame" is one sample per channel.
+ */
+
+#include<string.h>
+
+#include"util.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define AUDIO_STREAM_SSE2
+#include<emmintrin.h>
+#endif
+
+// How a stream's file stores its samples
+// A new codec needs a case in parse_wav_header (or its own container parser) and in decode_audio_blocks;
+// block based codecs (QOA, IMA ADPCM) decode a whole block at a time, so frames_per_block > 1
+enum AudioCodec
+{
+    AUDIO_CODEC_NONE,
+    AUDIO_CODEC_PCM16,
+};
+
+struct AudioStreamFormat
+{
+    AudioCodec codec;
+    int num_channels;           // in the file; decoding turns it into stereo
+    int samples_per_second;
+    int bytes_per_block;        // smallest piece of the data that decodes on its own
+    int frames_per_block;
+    uint64_t data_offset;       // in the file
+    uint64_t data_size;         // whole blocks
+};
+
+static inline uint16_t read_le16(const uint8_t* p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static inline uint32_t read_le32(const uint8_t* p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Find the fmt and data chunks of a RIFF WAVE file, given its first header_size bytes
+// The data chunk's header has to be in there (it nearly always follows fmt, and any metadata is usually at the end)
+// False if it isn't a WAV, or it's a codec we can't decode
+static inline bool parse_wav_header(const uint8_t* header, size_t header_size, AudioStreamFormat* format)
+{
+    memset(format, 0, sizeof(*format));
+    if (header_size < 12 || memcmp(header, "RIFF", 4) || memcmp(header + 8, "WAVE", 4))
+    {
+        return false;
+    }
+
+    bool found_fmt = false;
+    size_t position = 12;
+    while (position + 8 <= header_size)
+    {
+        const uint8_t* chunk = header + position;
+        uint32_t chunk_size = read_le32(chunk + 4);
+        if (!memcmp(chunk, "fmt ", 4) && chunk_size >= 16 && position + 8 + 16 <= header_size)
+        {
+            uint16_t tag = read_le16(chunk + 8);
+            int bits = read_le16(chunk + 22);
+            // WAVE_FORMAT_EXTENSIBLE keeps the real tag at the start of its subformat GUID
+            if (tag == 0xFFFE && chunk_size >= 40 && position + 8 + 40 <= header_size)
+            {
+                tag = read_le16(chunk + 32);
+            }
+            format->num_channels = read_le16(chunk + 10);
+            format->samples_per_second = (int)read_le32(chunk + 12);
+            format->bytes_per_block = read_le16(chunk + 20);
+            if (tag == 1 && bits == 16 && format->bytes_per_block == 2 * format->num_channels)
+            {
+                format->codec = AUDIO_CODEC_PCM16;
+                format->frames_per_block = 1;
+            }
+            found_fmt = true;
+        }
+        else if (!memcmp(chunk, "data", 4))
+        {
+            format->data_offset = position + 8;
+            format->data_size = chunk_size;
+            break;
+        }
+        // chunks are padded to an even size
+        position += 8 + (size_t)chunk_size + (chunk_size & 1);
+    }
+
+    if (!found_fmt || !format->data_offset || format->codec == AUDIO_CODEC_NONE ||
+        format->num_channels < 1 || format->num_channels > 2)
+    {
+        return false;
+    }
+    format->data_size -= format->data_size % (uint64_t)format->bytes_per_block;
+    return true;
+}
+
+static inline void decode_pcm16(const int16_t* source, int num_frames, int num_channels, int16_t* stereo)
+{
+    if (num_channels == 2)
+    {
+        memcpy(stereo, source, (size_t)num_frames * 2 * sizeof(int16_t));
+        return;
+    }
+
+    int i = 0;
+#ifdef AUDIO_STREAM_SSE2
+    for (; i + 8 <= num_frames; i += 8)
+    {
+        __m128i m = _mm_loadu_si128((const __m128i*)&source[i]);
+        _mm_storeu_si128((__m128i*)&stereo[2 * i], _mm_unpacklo_epi16(m, m));
+        _mm_storeu_si128((__m128i*)&stereo[2 * i + 8], _mm_unpackhi_epi16(m, m));
+    }
+#endif
+    for (; i < num_frames; ++i)
+    {
+        stereo[2 * i] = source[i];
+        stereo[2 * i + 1] = source[i];
+    }
+}
+
+// Decode whole blocks straight from the file's bytes into stereo frames; returns the frames written
+static inline int decode_audio_blocks(const AudioStreamFormat* format, const uint8_t* source, int num_blocks, int16_t* stereo)
+{
+    switch (format->codec)
+    {
+        case AUDIO_CODEC_PCM16:
+        {
+            decode_pcm16((const int16_t*)source, num_blocks, format->num_channels, stereo);
+            return num_blocks;
+        }
+        default:
+        {
+            return 0;
+        }
+    }
+}
+
+// dest += source * volume, saturating; volume is clamped to [0, 1]
+// Both are interleaved; num_samples counts every channel's samples
+static inline void mix_audio_samples(int16_t* dest, const int16_t* source, int num_samples, float volume)
+{
+    // Q15, so scaling is (s * v) >> 15
+    int16_t v = (int16_t)(MIN(MAX(volume, 0.0F), 1.0F) * 32767.0F);
+
+    int i = 0;
+#ifdef AUDIO_STREAM_SSE2
+    const __m128i volume_x8 = _mm_set1_epi16(v);
+    for (; i + 8 <= num_samples; i += 8)
+    {
+        __m128i s = _mm_loadu_si128((const __m128i*)&source[i]);
+        // the high and low halves of the 32 bit products, put back together shifted down by 15
+        __m128i high = _mm_mulhi_epi16(s, volume_x8);
+        __m128i low = _mm_mullo_epi16(s, volume_x8);
+        __m128i scaled = _mm_or_si128(_mm_slli_epi16(high, 1), _mm_srli_epi16(low, 15));
+        __m128i d = _mm_loadu_si128((const __m128i*)&dest[i]);
+        _mm_storeu_si128((__m128i*)&dest[i], _mm_adds_epi16(d, scaled));
+    }
+#endif
+    for (; i < num_samples; ++i)
+    {
+        int32_t mixed = (int32_t)dest[i] + (((int32_t)source[i] * v) >> 15);
+        dest[i] = (int16_t)MIN(MAX(mixed, -32768), 32767);
+    }
+}
+
+
+#define AUDIO_STREAM_H
+#endif
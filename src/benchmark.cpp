@@ -0,0 +1,467 @@
+/*
+ * Standalone microbenchmarks for hot paths in game and platform code
+ * Built next to the game by build.sh/build.bat; run it before and after optimizing something
+ */
+#include<string.h>
+
+#ifdef _WIN32
+#include<windows.h>
+#else
+#include<time.h>
+#endif
+
+#include"util.h"
+#include"game_platform_interface.h"
+#include"oscillator.h"
+#include"render_kernels.h"
+#include"audio_ring_buffer.h"
+#include"audio_stream.h"
+#include"controller_input.h"
+
+static const int WARMUP_REPETITIONS = 3;
+static const int REPETITIONS = 20;
+
+static int64_t get_time_ns()
+{
+#ifdef _WIN32
+    static LARGE_INTEGER frequency;
+    if (!frequency.QuadPart)
+    {
+        QueryPerformanceFrequency(&frequency);
+    }
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return (int64_t)((double)counter.QuadPart * 1e9 / (double)frequency.QuadPart);
+#else
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (int64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+#endif
+}
+
+// Runs func WARMUP_REPETITIONS times untimed, then REPETITIONS times timed, and returns the fastest run in ns
+// Fastest rather than average, so noise from the rest of the system mostly drops out
+#define FUNC_BENCHMARK(name) void name(void* data)
+typedef FUNC_BENCHMARK(Benchmark);
+
+static int64_t run_benchmark(Benchmark* func, void* data)
+{
+    for (int i = 0; i < WARMUP_REPETITIONS; ++i)
+    {
+        func(data);
+    }
+    int64_t best = INT64_MAX;
+    for (int i = 0; i < REPETITIONS; ++i)
+    {
+        int64_t start = get_time_ns();
+        func(data);
+        best = MIN(best, get_time_ns() - start);
+    }
+    return best;
+}
+
+// Benchmarks that are only a few hundred ns do OPS_PER_RUN operations per timed run, so the timer isn't most of what's measured
+static const int OPS_PER_RUN = 1000;
+
+
+/*
+ * Rendering
+ */
+
+struct RenderBenchmark
+{
+    GameRenderBuffer buffer;
+    int x_offset;
+};
+
+static FUNC_BENCHMARK(bench_render_gradient)
+{
+    RenderBenchmark* b = (RenderBenchmark*)data;
+    render_gradient_to_buffer(&b->buffer, b->x_offset, 0);
+    // move every frame, like the game does
+    b->x_offset++;
+}
+
+// Every kernel the CPU supports, from below the non-temporal threshold up to 4K
+static void benchmark_render()
+{
+    static const int BYTES_PER_PIXEL = 4;
+    static const struct { const char* name; int width; int height; } RESOLUTIONS[] = {
+        {"800x600", 800, 600},
+        {"1080p", 1920, 1080},
+        {"1440p", 2560, 1440},
+        {"4K", 3840, 2160},
+    };
+
+#ifdef STDOUT_DEBUG
+    // a fast kernel that draws the wrong thing isn't worth timing
+    if (!verify_render_kernels())
+    {
+        fprintf(stderr, "Render kernels don't match the scalar kernel\n");
+        exit(1);
+    }
+#endif
+
+    RenderKernelLevel cpu_level = get_cpu_render_kernel_level();
+    printf("%-24s %10s %14s %14s %10s\n", "gradient", "", "ms/frame", "pixels/us", "streamed");
+    for (int level = 0; level <= (int)cpu_level; ++level)
+    {
+        // render_gradient_to_buffer always goes through the selected level
+        render_kernel_level = (RenderKernelLevel)level;
+        for (int r = 0; r < (int)SIZE_OF_ARRAY(RESOLUTIONS); ++r)
+        {
+            RenderBenchmark b{};
+            b.buffer.width = RESOLUTIONS[r].width;
+            b.buffer.height = RESOLUTIONS[r].height;
+            b.buffer.pitch = b.buffer.width * BYTES_PER_PIXEL;
+            b.buffer.pixels = malloc((size_t)b.buffer.pitch * b.buffer.height);
+            memset(b.buffer.pixels, 0, (size_t)b.buffer.pitch * b.buffer.height);
+
+            int64_t pixels = (int64_t)b.buffer.width * b.buffer.height;
+            double ns = (double)run_benchmark(bench_render_gradient, &b);
+            char label[64];
+            snprintf(label, sizeof(label), "%s %s", RENDER_KERNEL_NAMES[level], RESOLUTIONS[r].name);
+            printf("%-24s %10s %14.3f %14.1f %10s\n", label, "", ns / 1e6, (double)pixels / (ns / 1000.0),
+                   use_non_temporal_stores(&b.buffer) ? "yes" : "no");
+
+            free(b.buffer.pixels);
+        }
+    }
+    render_kernel_level = cpu_level;
+}
+
+
+/*
+ * Sound
+ */
+
+// The original loop, kept as a baseline: sin() per sample per channel, float phase that's never wrapped
+static void output_sine_wave_reference(GameSoundBuffer* sound_buffer, float* t_sine, int wave_hz, int wave_amplitude)
+{
+    int wave_period = sound_buffer->samples_per_second / wave_hz;
+    int num_samples = sound_buffer->buffer_size / sound_buffer->bytes_per_sample;
+    float t_sine_inc = 2.0F * (float)M_PI * 1.0F / (float)wave_period;
+
+    int16_t* curr_sample = (int16_t*)sound_buffer->buffer;
+
+    for (int i = 0; i < num_samples; ++i) {
+
+        for (int ch = 0; ch < sound_buffer->num_channels; ++ch)
+        {
+            *curr_sample = (int16_t)((float)wave_amplitude * sin(*t_sine));
+            curr_sample++;
+        }
+
+        *t_sine += t_sine_inc;
+    }
+}
+
+struct SineWaveBenchmark
+{
+    GameSoundBuffer sound_buffer;
+    SineOscillator oscillator;
+    float t_sine;
+};
+
+static FUNC_BENCHMARK(bench_sine_wave_reference)
+{
+    SineWaveBenchmark* b = (SineWaveBenchmark*)data;
+    output_sine_wave_reference(&b->sound_buffer, &b->t_sine, 440, 3000);
+}
+
+static FUNC_BENCHMARK(bench_sine_wave)
+{
+    SineWaveBenchmark* b = (SineWaveBenchmark*)data;
+    output_sine_wave(&b->sound_buffer, &b->oscillator, 440, 3000);
+}
+
+static void benchmark_sound()
+{
+    static const int NUM_CHANNELS = 2;
+    static const int SAMPLE_COUNTS[] = {256, 1024, 4096, 48000};
+
+    printf("%-24s %10s %14s %14s %10s\n", "sine wave", "samples", "ref samples/us", "samples/us", "speedup");
+    for (int s = 0; s < (int)SIZE_OF_ARRAY(SAMPLE_COUNTS); ++s)
+    {
+        int num_samples = SAMPLE_COUNTS[s];
+        SineWaveBenchmark b{};
+        b.sound_buffer.bytes_per_sample = NUM_CHANNELS * (int)sizeof(int16_t);
+        b.sound_buffer.buffer_size = num_samples * b.sound_buffer.bytes_per_sample;
+        b.sound_buffer.buffer = malloc(b.sound_buffer.buffer_size);
+        b.sound_buffer.samples_per_second = 48000;
+        b.sound_buffer.num_channels = NUM_CHANNELS;
+
+        double ref_rate = (double)num_samples / ((double)run_benchmark(bench_sine_wave_reference, &b) / 1000.0);
+        double rate = (double)num_samples / ((double)run_benchmark(bench_sine_wave, &b) / 1000.0);
+        printf("%-24s %10d %14.1f %14.1f %9.1fx\n", "", num_samples, ref_rate, rate, rate / ref_rate);
+
+        free(b.sound_buffer.buffer);
+    }
+}
+
+
+// What the platform layer does with the game's sound: write_audio_frame copies it into the ring buffer,
+// and audio_callback copies it back out (fading in after an underrun)
+struct RingBufferBenchmark
+{
+    AudioRingBuffer ring_buffer;
+    void* block;
+    int block_size;
+    uint32_t cursor;    // every op uses the same cursor, so either all of them wrap or none do
+};
+
+static FUNC_BENCHMARK(bench_ring_buffer_write)
+{
+    RingBufferBenchmark* b = (RingBufferBenchmark*)data;
+    for (int i = 0; i < OPS_PER_RUN; ++i)
+    {
+        ring_buffer_write(&b->ring_buffer, b->cursor, b->block, b->block_size);
+    }
+}
+
+static FUNC_BENCHMARK(bench_ring_buffer_read)
+{
+    RingBufferBenchmark* b = (RingBufferBenchmark*)data;
+    for (int i = 0; i < OPS_PER_RUN; ++i)
+    {
+        ring_buffer_read(&b->ring_buffer, b->cursor, b->block, b->block_size);
+    }
+}
+
+static FUNC_BENCHMARK(bench_ring_buffer_read_fade)
+{
+    RingBufferBenchmark* b = (RingBufferBenchmark*)data;
+    for (int i = 0; i < OPS_PER_RUN; ++i)
+    {
+        ring_buffer_read(&b->ring_buffer, b->cursor, b->block, b->block_size);
+        fade_audio((int16_t*)b->block, b->block_size / (2 * (int)sizeof(int16_t)), 2, true);
+    }
+}
+
+static void benchmark_audio_ring_buffer()
+{
+    static const int BYTES_PER_SAMPLE = 2 * (int)sizeof(int16_t);
+    static const int RING_BUFFER_SAMPLES = 65536;   // same as the platform layer
+    // a small device buffer, a typical one, and about a frame's worth of writing ahead
+    static const int BLOCK_SAMPLES[] = {256, 1024, 2048};
+    static const struct { const char* name; Benchmark* func; } OPS[] = {
+        {"write", bench_ring_buffer_write},
+        {"read", bench_ring_buffer_read},
+        {"read + fade in", bench_ring_buffer_read_fade},
+    };
+
+    RingBufferBenchmark b{};
+    b.ring_buffer.size = RING_BUFFER_SAMPLES * BYTES_PER_SAMPLE;
+    b.ring_buffer.mask = (uint32_t)b.ring_buffer.size - 1;
+    b.ring_buffer.data = malloc(b.ring_buffer.size);
+    memset(b.ring_buffer.data, 0x10, b.ring_buffer.size);
+
+    printf("%-24s %10s %14s %14s %10s\n", "audio ring buffer", "samples", "ns/op", "samples/us", "wraps");
+    for (int op = 0; op < (int)SIZE_OF_ARRAY(OPS); ++op)
+    {
+        for (int s = 0; s < (int)SIZE_OF_ARRAY(BLOCK_SAMPLES); ++s)
+        {
+            b.block_size = BLOCK_SAMPLES[s] * BYTES_PER_SAMPLE;
+            b.block = malloc(b.block_size);
+            memset(b.block, 0x20, b.block_size);
+
+            for (int wraps = 0; wraps <= 1; ++wraps)
+            {
+                // half the block before the end of the ring, half after
+                b.cursor = wraps ? (uint32_t)(b.ring_buffer.size - b.block_size / 2) : 0;
+                double ns = (double)run_benchmark(OPS[op].func, &b) / OPS_PER_RUN;
+                printf("%-24s %10d %14.1f %14.1f %10s\n", OPS[op].name, BLOCK_SAMPLES[s], ns,
+                       (double)BLOCK_SAMPLES[s] / (ns / 1000.0), wraps ? "yes" : "no");
+            }
+
+            free(b.block);
+        }
+    }
+    free(b.ring_buffer.data);
+}
+
+
+/*
+ * Audio streams
+ */
+
+// The stream thread's decode into a ring, and the game's mix out of it
+struct AudioStreamBenchmark
+{
+    AudioStreamFormat format;
+    uint8_t* source;    // file data
+    int16_t* stereo;
+    int16_t* mix;
+    int num_frames;
+};
+
+static FUNC_BENCHMARK(bench_decode_pcm16)
+{
+    AudioStreamBenchmark* b = (AudioStreamBenchmark*)data;
+    for (int i = 0; i < OPS_PER_RUN; ++i)
+    {
+        decode_audio_blocks(&b->format, b->source, b->num_frames, b->stereo);
+    }
+}
+
+static FUNC_BENCHMARK(bench_mix_audio)
+{
+    AudioStreamBenchmark* b = (AudioStreamBenchmark*)data;
+    for (int i = 0; i < OPS_PER_RUN; ++i)
+    {
+        mix_audio_samples(b->mix, b->stereo, 2 * b->num_frames, 0.5F);
+    }
+}
+
+static void benchmark_audio_stream()
+{
+    // a small device buffer, and the stream thread's chunk (sdl_audio_stream.h)
+    static const int BLOCK_FRAMES[] = {256, 4096};
+    static const struct { const char* name; Benchmark* func; int num_channels; } OPS[] = {
+        {"decode pcm16 mono", bench_decode_pcm16, 1},
+        {"decode pcm16 stereo", bench_decode_pcm16, 2},
+        {"mix", bench_mix_audio, 2},
+    };
+
+    printf("%-24s %10s %14s %14s\n", "audio stream", "frames", "ns/op", "frames/us");
+    for (int op = 0; op < (int)SIZE_OF_ARRAY(OPS); ++op)
+    {
+        for (int s = 0; s < (int)SIZE_OF_ARRAY(BLOCK_FRAMES); ++s)
+        {
+            AudioStreamBenchmark b{};
+            b.format.codec = AUDIO_CODEC_PCM16;
+            b.format.num_channels = OPS[op].num_channels;
+            b.format.bytes_per_block = 2 * OPS[op].num_channels;
+            b.format.frames_per_block = 1;
+            b.num_frames = BLOCK_FRAMES[s];
+            b.source = (uint8_t*)malloc((size_t)b.num_frames * b.format.bytes_per_block);
+            b.stereo = (int16_t*)malloc((size_t)b.num_frames * 2 * sizeof(int16_t));
+            b.mix = (int16_t*)malloc((size_t)b.num_frames * 2 * sizeof(int16_t));
+            // loud enough that some of the mix saturates
+            for (int i = 0; i < b.num_frames * OPS[op].num_channels; ++i)
+            {
+                ((int16_t*)b.source)[i] = (int16_t)((i * 2477) % 65536 - 32768);
+            }
+            decode_audio_blocks(&b.format, b.source, b.num_frames, b.stereo);
+            memset(b.mix, 0x40, (size_t)b.num_frames * 2 * sizeof(int16_t));
+
+            double ns = (double)run_benchmark(OPS[op].func, &b) / OPS_PER_RUN;
+            printf("%-24s %10d %14.1f %14.1f\n", OPS[op].name, BLOCK_FRAMES[s], ns, (double)BLOCK_FRAMES[s] / (ns / 1000.0));
+
+            free(b.mix);
+            free(b.stereo);
+            free(b.source);
+        }
+    }
+}
+
+
+/*
+ * Input
+ */
+
+// What poll_controllers and the input thread do with every gamepad on every poll, minus the SDL calls
+struct ControllerBenchmark
+{
+    static const int NUM_STATES = 64;
+    RawControllerState raw[NUM_STATES];
+    ControllerInput controllers[MAX_CONTROLLERS];
+};
+
+static FUNC_BENCHMARK(bench_controller_input)
+{
+    ControllerBenchmark* b = (ControllerBenchmark*)data;
+    for (int i = 0; i < OPS_PER_RUN; ++i)
+    {
+        ControllerInput state{};
+        convert_controller_state(&b->raw[i % ControllerBenchmark::NUM_STATES], &state);
+        apply_controller_state(&b->controllers[i % MAX_CONTROLLERS], &state);
+    }
+}
+
+static void benchmark_input()
+{
+    ControllerBenchmark b{};
+    // fixed seed so runs are comparable; sticks land both inside and outside the deadzone
+    uint32_t seed = 12345;
+    for (int i = 0; i < ControllerBenchmark::NUM_STATES; ++i)
+    {
+        RawControllerState* raw = &b.raw[i];
+        seed = seed * 1664525 + 1013904223;
+        raw->buttons = (uint16_t)(seed >> 16);
+        seed = seed * 1664525 + 1013904223;
+        raw->left_trigger = (int16_t)(seed >> 16);
+        raw->right_trigger = (int16_t)seed;
+        seed = seed * 1664525 + 1013904223;
+        raw->left_stick_x = (int16_t)(seed >> 16);
+        raw->left_stick_y = (int16_t)seed;
+        seed = seed * 1664525 + 1013904223;
+        raw->right_stick_x = (int16_t)(seed >> 16);
+        raw->right_stick_y = (int16_t)seed;
+    }
+
+    double ns = (double)run_benchmark(bench_controller_input, &b) / OPS_PER_RUN;
+    printf("%-24s %10s %14s\n", "controller input", "", "ns/op");
+    printf("%-24s %10s %14.1f\n", "convert + apply", "", ns);
+}
+
+
+/*
+ * Presentation
+ */
+
+// What SDL_UpdateTexture has to do at least once per frame on the copy path; zero copy skips it entirely
+struct FrameCopyBenchmark
+{
+    void* source;
+    void* dest;
+    size_t size;
+};
+
+static FUNC_BENCHMARK(bench_frame_copy)
+{
+    FrameCopyBenchmark* b = (FrameCopyBenchmark*)data;
+    memcpy(b->dest, b->source, b->size);
+}
+
+static void benchmark_present()
+{
+    static const int BYTES_PER_PIXEL = 4;
+    static const int FRAME_RATE = 60;
+    static const struct { const char* name; int width; int height; } RESOLUTIONS[] = {
+        {"1080p", 1920, 1080},
+        {"4K", 3840, 2160},
+    };
+
+    printf("%-24s %10s %14s %14s %10s\n", "frame copy", "", "ms/frame", "GB/s", "saved GB/s");
+    for (int r = 0; r < (int)SIZE_OF_ARRAY(RESOLUTIONS); ++r)
+    {
+        FrameCopyBenchmark b{};
+        b.size = (size_t)RESOLUTIONS[r].width * RESOLUTIONS[r].height * BYTES_PER_PIXEL;
+        b.source = malloc(b.size);
+        b.dest = malloc(b.size);
+        // touch both so page faults aren't timed
+        memset(b.source, 0x50, b.size);
+        memset(b.dest, 0, b.size);
+
+        double ms = (double)run_benchmark(bench_frame_copy, &b) / 1e6;
+        double gb = (double)b.size / 1e9;
+        // bytes read plus bytes written, every frame at FRAME_RATE
+        printf("%-24s %10s %14.3f %14.2f %10.2f\n", "", RESOLUTIONS[r].name, ms, gb / (ms / 1000.0), 2.0 * gb * FRAME_RATE);
+
+        free(b.source);
+        free(b.dest);
+    }
+}
+
+
+int main(int argc, char* args[])
+{
+    benchmark_render();
+    benchmark_sound();
+    benchmark_audio_ring_buffer();
+    benchmark_audio_stream();
+    benchmark_input();
+    benchmark_present();
+    return 0;
+}
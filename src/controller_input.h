@@ -0,0 +1,73 @@
+#ifndef CONTROLLER_INPUT_H
+/*
+ * Turning a gamepad's raw buttons and axes into a ControllerInput
+ * No SDL in here; read_controller fills in a RawControllerState and everything after that is plain code
+ */
+
+#include<stdlib.h>
+
+#include"util.h"
+#include"game_platform_interface.h"
+
+// TODO better deadzone handling, maybe adjustable
+static const int16_t STICK_DEADZONE_LEFT = 5000;
+static const int16_t STICK_DEADZONE_RIGHT = 5000;
+// triggers are analog, but the game only sees them as buttons
+static const int16_t TRIGGER_THRESHOLD = 16383;
+
+// A gamepad exactly as the platform reports it
+struct RawControllerState
+{
+    uint16_t buttons;   // bit per ControllerButton; the trigger bits are filled in from the trigger axes
+    int16_t left_trigger;
+    int16_t left_stick_x;
+    int16_t left_stick_y;
+    int16_t right_trigger;
+    int16_t right_stick_x;
+    int16_t right_stick_y;
+};
+
+static inline float process_stick_input(int16_t input, int16_t deadzone)
+{
+    if (abs(input) < deadzone) return 0.0F;
+
+    if (input >= 0)
+    {
+        return ((float)input)/32767.0F;
+    }
+    return ((float)input)/32768.0F;
+    // TODO test this!
+}
+
+static inline void convert_controller_state(const RawControllerState* raw, ControllerInput* controller)
+{
+    controller->plugged_in = true;
+
+    uint16_t ended_down = raw->buttons;
+    ended_down |= (uint16_t)((raw->left_trigger > TRIGGER_THRESHOLD ? 1 : 0) << BUTTON_LEFT_TRIGGER);
+    ended_down |= (uint16_t)((raw->right_trigger > TRIGGER_THRESHOLD ? 1 : 0) << BUTTON_RIGHT_TRIGGER);
+    controller->ended_down = ended_down;
+
+    controller->left_stick_x = process_stick_input(raw->left_stick_x, STICK_DEADZONE_LEFT);
+    controller->left_stick_y = process_stick_input(raw->left_stick_y, STICK_DEADZONE_LEFT);
+    controller->right_stick_x = process_stick_input(raw->right_stick_x, STICK_DEADZONE_RIGHT);
+    controller->right_stick_y = process_stick_input(raw->right_stick_y, STICK_DEADZONE_RIGHT);
+}
+
+// Move controller to a freshly read state, counting every button that changed
+static void apply_controller_state(ControllerInput* controller, const ControllerInput* state)
+{
+    for (int button = 0; button < BUTTON_COUNT; ++button)
+    {
+        set_button(controller, (ControllerButton)button, button_down(state, (ControllerButton)button));
+    }
+    controller->plugged_in = state->plugged_in;
+    controller->left_stick_x = state->left_stick_x;
+    controller->left_stick_y = state->left_stick_y;
+    controller->right_stick_x = state->right_stick_x;
+    controller->right_stick_y = state->right_stick_y;
+}
+
+
+#define CONTROLLER_INPUT_H
+#endif
@@ -3,14 +3,30 @@
  */
 #include"GameState.h"
 #include"game_platform_interface.h"
+#include"render_kernels.h"
+#include"oscillator.h"
+#include"audio_stream.h"
+#include"profiler.h"
+
+// carved off the end of game memory, reset at the start of every frame
+const size_t TRANSIENT_ARENA_SIZE = MEBIBYTES(256);
 
 const int MIDDLE_C_FREQ = 256;
 const int MIDDLE_VOLUME_AMPLITUDE = 500;
 
-const int MAX_SCROLL_SPEED = 5;
+const float MAX_SCROLL_SPEED = 300.0F;  // pixels per second
 const int MIN_HZ = 20;
 const int MAX_HZ = 256 * 2;
 const int MAX_VOLUME_OFFSET = 300;
+const float MUSIC_VOLUME = 0.5F;
+// stereo frames mixed from a stream at a time, through a buffer on the stack
+const int MUSIC_MIX_FRAMES = 256;
+
+// the render buffer is split into horizontal bands which are rendered in parallel on the work queue
+// more bands than threads so the work balances out if some threads are busy
+const int RENDER_BANDS_PER_THREAD = 4;
+const int MAX_RENDER_BANDS = 256;
+const int MIN_RENDER_BAND_ROWS = 16;
 
 
 // TODO move to util functions
@@ -20,88 +36,144 @@ int clamp(int val, int lo, int hi) {
     return val;
 }
 
-// return the modified new wave offset
-static void output_sine_wave(GameSoundBuffer* sound_buffer, int wave_hz, int wave_amplitude)
+struct RenderBandWork
 {
-    static float t_sine = 0.0F;
+    GameRenderBuffer* buffer;
+    int first_row;
+    int num_rows;
+    int x_offset;
+    int y_offset;
+};
 
-    DEBUG_ASSERT(sound_buffer->buffer_size % sound_buffer->bytes_per_sample == 0);
-    // how many samples per full wave
-    int wave_period = sound_buffer->samples_per_second / wave_hz;
-    int num_samples = sound_buffer->buffer_size / sound_buffer->bytes_per_sample;
-    // one sample's worth for this period
-    // I DONT HAVE GREAT INTUITION ON THIS
-    float t_sine_inc = 2.0F * (float)M_PI * 1.0F / (float)wave_period;
+static FUNC_PLATFORM_WORK_QUEUE_CALLBACK(render_band_work)
+{
+    TIMED_FUNCTION();
+    RenderBandWork* work = (RenderBandWork*)data;
+    render_gradient_rows(work->buffer, work->first_row, work->num_rows, work->x_offset, work->y_offset);
+}
 
-    int16_t* curr_sample = (int16_t*)sound_buffer->buffer;
+static void render_gradient_parallel(GameMemory* game_memory, MemoryArena* arena, GameRenderBuffer* buffer, int x_offset, int y_offset)
+{
+    TIMED_FUNCTION();
+    if (game_memory->num_work_threads <= 1)
+    {
+        render_gradient_to_buffer(buffer, x_offset, y_offset);
+        return;
+    }
 
-    for (int i = 0; i < num_samples; ++i) {
+    TemporaryMemory temp = begin_temporary_memory(arena);
 
-        for (int ch = 0; ch < sound_buffer->num_channels; ++ch)
-        {
-            *curr_sample = (int16_t)((float)wave_amplitude * sin(t_sine));
-            curr_sample++;
-        }
+    int num_bands = clamp(game_memory->num_work_threads * RENDER_BANDS_PER_THREAD, 1, MAX_RENDER_BANDS);
+    num_bands = clamp(buffer->height / MIN_RENDER_BAND_ROWS, 1, num_bands);
+    int rows_per_band = buffer->height / num_bands;
+    RenderBandWork* bands = PUSH_ARRAY(arena, num_bands, RenderBandWork);
 
-        t_sine += t_sine_inc;
+    for (int i = 0; i < num_bands; ++i)
+    {
+        RenderBandWork* work = &bands[i];
+        work->buffer = buffer;
+        work->first_row = i * rows_per_band;
+        // last band picks up the remainder
+        work->num_rows = (i == num_bands - 1) ? buffer->height - work->first_row : rows_per_band;
+        work->x_offset = x_offset;
+        work->y_offset = y_offset;
+        game_memory->platform_add_work_entry(game_memory->work_queue, render_band_work, work);
     }
+
+    // bands is in temporary memory, so we have to wait here
+    game_memory->platform_complete_all_work(game_memory->work_queue);
+    end_temporary_memory(temp);
 }
 
-static void render_gradient_to_buffer(GameRenderBuffer* buffer, int x_offset, int y_offset)
+// Apply any new parameters from game_update, then fill the buffer
+// Runs on the audio thread in pull mode, or on the main thread from game_render in push mode; never both
+static void make_sound(GameMemory* game_memory, GameState* game_state, GameSoundBuffer* sound_buffer)
 {
-    DEBUG_ASSERT(buffer->pixels);
+    TIMED_FUNCTION();
+    SoundState* sound = &game_state->sound;
+    SoundMessage message;
+    while (spsc_pop(&game_state->sound_messages, &message))
+    {
+        sound->wave_hz = message.wave_hz;
+        sound->wave_amplitude = message.wave_amplitude;
+        sound->music = message.music;
+    }
 
-    int width = buffer->width;
-    int height = buffer->height;
-    int pitch = buffer->pitch;
-    uint8_t* row = (uint8_t*)buffer->pixels;
+    output_sine_wave(sound_buffer, &sound->tone, sound->wave_hz, sound->wave_amplitude);
 
-    for (int r = 0; r < height; ++r)
+    // mix in whatever music is decoded; if the stream falls behind, that part is just the tone
+    DEBUG_ASSERT(sound_buffer->num_channels == 2);
+    int16_t* samples = (int16_t*)sound_buffer->buffer;
+    int num_frames = sound_buffer->buffer_size / sound_buffer->bytes_per_sample;
+    int16_t music[MUSIC_MIX_FRAMES * 2];
+    for (int start = 0; sound->music && start < num_frames; start += MUSIC_MIX_FRAMES)
     {
-        uint8_t * byte = row;
-        for (int c = 0; c < width; ++c)
+        int count = MIN(MUSIC_MIX_FRAMES, num_frames - start);
+        int read = game_memory->platform_read_audio_stream(game_memory->audio_streams, sound->music, music, count);
+        if (read <= 0)
         {
-            // little endian
-            // B
-            *byte = (uint8_t)(c + x_offset);
-            byte++;
-
-            // G
-            *byte = (uint8_t)(r + y_offset);
-            byte++;
-
-            // R
-            *byte = 0x00;
-            byte++;
-
-            // padding byte
-            //*byte = 0x00;
-            byte++;
+            break;
         }
-        row += pitch;
+        mix_audio_samples(&samples[2 * start], music, 2 * read, MUSIC_VOLUME);
     }
 }
 
 extern "C" FUNC_GAME_INIT_MEMORY(game_init_memory)
 {
-    DEBUG_ASSERT(game_memory.memory_size >= sizeof(GameState));
+    SET_PROFILER(game_memory.profiler);
+    DEBUG_ASSERT(game_memory.memory_size >= sizeof(GameState) + TRANSIENT_ARENA_SIZE);
 
-    // TODO partition memory etc
+    // Partition memory
+    // | GameState | permanent arena ... | transient arena |
     GameState* game_state = (GameState*)game_memory.memory;
+    uint8_t* permanent_base = (uint8_t*)game_memory.memory + sizeof(GameState);
+    size_t permanent_size = game_memory.memory_size - sizeof(GameState) - TRANSIENT_ARENA_SIZE;
+    init_arena(&game_state->permanent_arena, permanent_base, permanent_size);
+    init_arena(&game_state->transient_arena, permanent_base + permanent_size, TRANSIENT_ARENA_SIZE);
 
     // initialize game state etc
+    game_state->sound.tone.phase = 0.0;
+    game_state->sound.wave_hz = 0;
+    game_state->sound.wave_amplitude = 0;
+    game_state->sound.music = 0;
+    init_spsc_queue(&game_state->sound_messages);
+    game_state->dropped_sound_messages = 0;
     game_state->wave_amplitude = 0;
     game_state->wave_hz = 0;
+    game_state->music = 0;
     game_state->x_offset = 0;
     game_state->y_offset = 0;
+    game_state->last_x_offset = 0;
+    game_state->last_y_offset = 0;
+    game_state->drawn_x_offset = 0;
+    game_state->drawn_y_offset = 0;
+
+#ifdef STDOUT_DEBUG
+    if (!verify_render_kernels())
+    {
+        FATAL_PRINTF("Render kernels don't match scalar output\n");
+    }
+#endif
+}
+
+// Move one scroll axis by delta, wrapping to the gradient's 256 pixel period
+// last is moved by the same amount as the wrap, so interpolating between the two never jumps across it
+static void scroll(float* offset, float* last, float delta)
+{
+    float moved = *offset + delta;
+    float wrapped = fmodf(moved, 256.0F);
+    *last = *offset + (wrapped - moved);
+    *offset = wrapped;
 }
 
-extern "C" FUNC_GAME_UPDATE_AND_RENDER(game_update_and_render)
+extern "C" FUNC_GAME_UPDATE(game_update)
 {
+    SET_PROFILER(game_memory.profiler);
+    TIMED_FUNCTION();
     GameState* game_state = (GameState*)game_memory.memory;
 
-    int x_vel = 0;
-    int y_vel = 0;
+    float x_vel = 0.0F;
+    float y_vel = 0.0F;
 
     GameInput* game_input = &(input_buffer->buffer[input_buffer->last]);
     // find a plugged in controller
@@ -122,15 +194,15 @@ extern "C" FUNC_GAME_UPDATE_AND_RENDER(game_update_and_render)
         {
             controller->left_stick_x = 0;
             controller->left_stick_y = 0;
-            controller->left_stick_x += (controller->right ? 1.0F : 0);
-            controller->left_stick_x += (controller->left ? -1.0F : 0);
-            controller->left_stick_y += (controller->up ? 1.0F : 0);
-            controller->left_stick_y += (controller->down ? -1.0F : 0);
+            controller->left_stick_x += (button_down(controller, BUTTON_RIGHT) ? 1.0F : 0);
+            controller->left_stick_x += (button_down(controller, BUTTON_LEFT) ? -1.0F : 0);
+            controller->left_stick_y += (button_down(controller, BUTTON_UP) ? 1.0F : 0);
+            controller->left_stick_y += (button_down(controller, BUTTON_DOWN) ? -1.0F : 0);
         }
 
         // TODO replace with Vector2; this doesn't work properly because the vector length must be clamped, not x and y individually
-        x_vel = clamp((int)(controller->left_stick_x * (float)MAX_SCROLL_SPEED) + x_vel, -MAX_SCROLL_SPEED, MAX_SCROLL_SPEED);
-        y_vel = clamp((int)(controller->left_stick_y * (float)MAX_SCROLL_SPEED) + y_vel, -MAX_SCROLL_SPEED, MAX_SCROLL_SPEED);
+        x_vel = MIN(MAX(controller->left_stick_x * MAX_SCROLL_SPEED + x_vel, -MAX_SCROLL_SPEED), MAX_SCROLL_SPEED);
+        y_vel = MIN(MAX(controller->left_stick_y * MAX_SCROLL_SPEED + y_vel, -MAX_SCROLL_SPEED), MAX_SCROLL_SPEED);
         // change freq & volume of wave
         if (controller->left_stick_y >= 0.0)
         {
@@ -142,19 +214,37 @@ extern "C" FUNC_GAME_UPDATE_AND_RENDER(game_update_and_render)
         }
         game_state->wave_amplitude = MIDDLE_VOLUME_AMPLITUDE + (int16_t)((float)MAX_VOLUME_OFFSET * controller->left_stick_x);
 
-        // test debug IO
-        if (controller->a)
+        // test file IO; once per press, even if it was pressed and let go within a frame
+        if (button_pressed(controller, BUTTON_A) && !game_state->test_write_request)
         {
-            game_memory.DEBUG_platform_write_entire_file("test_file", (void*)"testIO\0", 7);
-            DEBUG_PRINTF("wrote a file called \"test_file\"\n");
+            // from game memory, not a literal in this module, in case the code is reloaded before the write finishes
+            memcpy(game_state->test_write_buffer, "testIO\0", 7);
+            game_state->test_write_request = game_memory.platform_write_file(game_memory.file_queue, "test_file", game_state->test_write_buffer, 7);
         }
-        if (controller->b)
+        if (button_pressed(controller, BUTTON_B) && !game_state->test_read_request)
         {
-            int64_t size;
-            void* buf = game_memory.DEBUG_platform_read_entire_file("test_file", &size);
-            DEBUG_ASSERT(size == 7);
-            DEBUG_PRINTF("read a file containing \"%s\"\n", (char*)buf);
-            game_memory.DEBUG_platform_free_file_memory(buf);
+            memset(game_state->test_read_buffer, 0, sizeof(game_state->test_read_buffer));
+            game_state->test_read_request = game_memory.platform_read_file(game_memory.file_queue, "test_file", 0,
+                                                                           game_state->test_read_buffer, sizeof(game_state->test_read_buffer) - 1);
+        }
+
+        // test streaming
+        if (button_pressed(controller, BUTTON_X))
+        {
+            if (game_state->music)
+            {
+                game_memory.platform_close_audio_stream(game_memory.audio_streams, game_state->music);
+                game_state->music = 0;
+            }
+            else
+            {
+                game_state->music = game_memory.platform_open_audio_stream(game_memory.audio_streams, "test_music.wav", true);
+                if (!game_state->music)
+                {
+                    // the file itself is only opened later, on the platform's stream thread
+                    DEBUG_PRINTF("couldn't stream \"test_music.wav\"; every stream is in use, or the name is too long\n");
+                }
+            }
         }
     }
     else
@@ -164,9 +254,88 @@ extern "C" FUNC_GAME_UPDATE_AND_RENDER(game_update_and_render)
         game_state->wave_amplitude = MIDDLE_VOLUME_AMPLITUDE;
     }
 
-    game_state->x_offset += x_vel;
-    game_state->y_offset += y_vel;
+    FileResult file_result;
+    if (game_state->test_write_request && game_memory.platform_poll_file(game_memory.file_queue, game_state->test_write_request, &file_result))
+    {
+        if (file_result.error == FILE_OK)
+        {
+            DEBUG_PRINTF("wrote a file called \"test_file\"\n");
+        }
+        else
+        {
+            DEBUG_PRINTF("couldn't write \"test_file\" (error %d)\n", file_result.error);
+        }
+        game_state->test_write_request = 0;
+    }
+    if (game_state->test_read_request && game_memory.platform_poll_file(game_memory.file_queue, game_state->test_read_request, &file_result))
+    {
+        if (file_result.error == FILE_OK)
+        {
+            DEBUG_PRINTF("read a file containing \"%s\" (%lld bytes)\n", game_state->test_read_buffer, (long long)file_result.bytes);
+        }
+        else
+        {
+            DEBUG_PRINTF("couldn't read \"test_file\" (error %d)\n", file_result.error);
+        }
+        game_state->test_read_request = 0;
+    }
+
+    // per second, so scrolling is the same speed at any tick rate
+    // wrapping keeps the float offsets precise however long we run
+    scroll(&game_state->x_offset, &game_state->last_x_offset, x_vel * game_input->dt);
+    scroll(&game_state->y_offset, &game_state->last_y_offset, y_vel * game_input->dt);
+
+    SoundMessage message{game_state->wave_hz, game_state->wave_amplitude, game_state->music};
+    if (!spsc_push(&game_state->sound_messages, &message))
+    {
+        // the sound thread isn't keeping up; it will pick up the next one
+        game_state->dropped_sound_messages++;
+    }
+    else if (game_state->dropped_sound_messages)
+    {
+        // once the queue has room again, so a long stall is one line rather than one per update
+        DEBUG_PRINTF("Dropped %d sound messages; the sound thread wasn't keeping up\n", game_state->dropped_sound_messages);
+        game_state->dropped_sound_messages = 0;
+    }
+}
+
+extern "C" FUNC_GAME_RENDER(game_render)
+{
+    SET_PROFILER(game_memory.profiler);
+    TIMED_FUNCTION();
+    GameState* game_state = (GameState*)game_memory.memory;
+
+    if (sound_buffer->buffer_size)
+    {
+        make_sound(&game_memory, game_state, sound_buffer);
+    }
+
+    float x = game_state->last_x_offset + (game_state->x_offset - game_state->last_x_offset) * alpha;
+    float y = game_state->last_y_offset + (game_state->y_offset - game_state->last_y_offset) * alpha;
+    int x_offset = (int)floorf(x);
+    int y_offset = (int)floorf(y);
+    if (!render_buffer->redraw_all && x_offset == game_state->drawn_x_offset && y_offset == game_state->drawn_y_offset)
+    {
+        // same picture as last frame; the platform keeps showing that one
+        render_buffer->num_dirty_rects = 0;
+    }
+    else
+    {
+        render_gradient_parallel(&game_memory, &game_state->transient_arena, render_buffer, x_offset, y_offset);
+        // scrolling moves every pixel
+        mark_all_dirty(render_buffer);
+        game_state->drawn_x_offset = x_offset;
+        game_state->drawn_y_offset = y_offset;
+    }
 
-    output_sine_wave(sound_buffer, game_state->wave_hz, game_state->wave_amplitude);
-    render_gradient_to_buffer(render_buffer, game_state->x_offset, game_state->y_offset);
+    // nothing in the transient arena survives past the frame it was pushed in
+    reset_arena(&game_state->transient_arena);
+}
+
+extern "C" FUNC_GAME_GET_SOUND_SAMPLES(game_get_sound_samples)
+{
+    SET_PROFILER(game_memory.profiler);
+    TIMED_FUNCTION();
+    GameState* game_state = (GameState*)game_memory.memory;
+    make_sound(&game_memory, game_state, sound_buffer);
 }
\ No newline at end of file
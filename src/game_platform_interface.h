@@ -5,14 +5,25 @@
  * This file is used by the platform executable and game shared object library.
  */
 
+#include<string.h>
+
 #include"util.h"
 
-static const int INPUT_BUFFER_SIZE = 2;
+// frames of input history kept in GameInputBuffer; both sides must be built with the same value
+#ifndef INPUT_HISTORY_FRAMES
+#define INPUT_HISTORY_FRAMES 8
+#endif
+static const int INPUT_BUFFER_SIZE = INPUT_HISTORY_FRAMES;
 
 // controllers + gamepads
 static const int MAX_CONTROLLERS = 4 + 1;
 static const int KEYBOARD_INDEX = MAX_CONTROLLERS - 1;
 
+// every change to input between two frames, up to this many; past that, stick and mouse motion is merged away first
+// so button edges are kept, and the controller state is right either way
+static const int MAX_INPUT_SAMPLES = 64;
+static const int MOUSE_SAMPLE_INDEX = -1;
+
 struct GameSoundBuffer
 {
     void* buffer;
@@ -22,52 +33,170 @@ struct GameSoundBuffer
     int num_channels;
 };
 
+struct RenderRect
+{
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
+static const int MAX_DIRTY_RECTS = 64;
+static const int DIRTY_RECTS_UNKNOWN = -1;
+
+// pixels and pitch can change from frame to frame (the platform may hand out texture memory directly),
+// and nothing from earlier frames is kept, so every pixel has to be drawn in any frame that changes anything
 struct GameRenderBuffer
 {
     void* pixels;
     int width;
     int height;
     int pitch;
+
+    // What changed since the previous frame; only these are uploaded, and with none the frame isn't presented at all
+    // The platform sets DIRTY_RECTS_UNKNOWN before game_render; left like that, it compares the frames itself
+    int num_dirty_rects;
+    RenderRect dirty_rects[MAX_DIRTY_RECTS];
+    bool redraw_all;        // set by the platform when the whole screen is needed whatever changed (first frame, window exposed...)
 };
 
+static inline void mark_all_dirty(GameRenderBuffer* buffer)
+{
+    buffer->num_dirty_rects = 1;
+    buffer->dirty_rects[0] = RenderRect{0, 0, buffer->width, buffer->height};
+}
+
+// Clipped to the buffer; past MAX_DIRTY_RECTS the whole buffer counts as changed
+static inline void add_dirty_rect(GameRenderBuffer* buffer, int x, int y, int width, int height)
+{
+    int x1 = MIN(x + width, buffer->width);
+    int y1 = MIN(y + height, buffer->height);
+    x = MAX(x, 0);
+    y = MAX(y, 0);
+    if (x1 <= x || y1 <= y)
+    {
+        return;
+    }
+
+    if (buffer->num_dirty_rects < 0)
+    {
+        buffer->num_dirty_rects = 0;
+    }
+    if (buffer->num_dirty_rects == 1 && buffer->dirty_rects[0].width == buffer->width && buffer->dirty_rects[0].height == buffer->height)
+    {
+        return;
+    }
+    if (buffer->num_dirty_rects == MAX_DIRTY_RECTS)
+    {
+        mark_all_dirty(buffer);
+        return;
+    }
+    buffer->dirty_rects[buffer->num_dirty_rects++] = RenderRect{x, y, x1 - x, y1 - y};
+}
+
+// Buttons, in the order of their bits in ControllerInput
+enum ControllerButton
+{
+    BUTTON_START,           // mapped to escape by default
+    BUTTON_BACK,            // mapped to backspace by default
+
+    BUTTON_LEFT_SHOULDER,   // mapped to left mouse button
+    BUTTON_LEFT_TRIGGER,    // interpreted as binary even if analog
+    BUTTON_LEFT_STICK,
+
+    BUTTON_RIGHT_SHOULDER,  // mapped to right mouse button
+    BUTTON_RIGHT_TRIGGER,   // interpreted as binary even if analog
+    BUTTON_RIGHT_STICK,
+
+    // on keyboard, space, q, e, r by default (for use with WASD)
+    BUTTON_A,
+    BUTTON_B,
+    BUTTON_X,
+    BUTTON_Y,
+
+    // on keyboard, mapped to WASD and arrow keys by default
+    BUTTON_UP,
+    BUTTON_DOWN,
+    BUTTON_LEFT,
+    BUTTON_RIGHT,
+
+    BUTTON_COUNT
+};
+
+// half transition counts are 4 bits per button
+static const uint32_t MAX_HALF_TRANSITIONS = 15;
+static_assert(BUTTON_COUNT <= 16, "ended_down and half_transitions have room for 16 buttons");
+
+// Small and flat, so the platform can copy and clear it every frame for free
 struct ControllerInput
 {
-    bool is_keyboard; // if this is true, analog values will not be set
-    bool plugged_in;
+    bool is_keyboard : 1; // if this is true, analog values will not be set
+    bool plugged_in : 1;
 
-    bool start; // mapped to escape by default
-    bool back;  // mapped to backspace by default
+    uint16_t ended_down;        // bit per button; held at the end of the frame
+    uint64_t half_transitions;  // 4 bits per button; times it went up or down during the frame (saturates)
 
-    bool left_shoulder;     // unmapped on keyboard for now
-    bool left_trigger; // interpreted as binary even if analog // mapped to left mouse button
-    bool left_stick;
     // TODO might be more useful as a Vector2?
     float left_stick_x;
     float left_stick_y;
-
-    bool right_shoulder;    // unmapped on keyboard for now
-    bool right_trigger; // interpreted as binary even if analog // mapped to right mouse button
-    bool right_stick;
-    // TODO might be more useful as a Vector2?
     float right_stick_x;
     float right_stick_y;
+};
 
-    // on keyboard, space, q, e, r by default (for use with WASD)
-    bool a; // space
-    bool b; // q
-    bool x; // e
-    bool y; // r
-
-    // on keyboard, mapped to ASD and arrow keys by default
-    bool up;
-    bool down;
-    bool left;
-    bool right;
+static inline bool button_down(const ControllerInput* controller, ControllerButton button)
+{
+    return (controller->ended_down >> button) & 1;
+}
+
+static inline uint32_t button_half_transitions(const ControllerInput* controller, ControllerButton button)
+{
+    return (uint32_t)(controller->half_transitions >> (button * 4)) & 0xF;
+}
+
+// Went down at least once this frame, even if it was let go again before the end of it
+static inline bool button_pressed(const ControllerInput* controller, ControllerButton button)
+{
+    uint32_t transitions = button_half_transitions(controller, button);
+    return transitions > 1 || (transitions == 1 && button_down(controller, button));
+}
+
+// Went up at least once this frame
+static inline bool button_released(const ControllerInput* controller, ControllerButton button)
+{
+    uint32_t transitions = button_half_transitions(controller, button);
+    return transitions > 1 || (transitions == 1 && !button_down(controller, button));
+}
+
+// Platform side: record a button's new state, counting a transition if it changed
+static inline void set_button(ControllerInput* controller, ControllerButton button, bool down)
+{
+    if (button_down(controller, button) == down)
+    {
+        return;
+    }
+    controller->ended_down ^= (uint16_t)(1 << button);
+    if (button_half_transitions(controller, button) < MAX_HALF_TRANSITIONS)
+    {
+        controller->half_transitions += (uint64_t)1 << (button * 4);
+    }
+}
+
+// One change to a controller (or the mouse) since the last frame
+struct InputSample
+{
+    float time;             // seconds since the previous GameInput was handed to the game
+    int controller_index;   // which of GameInput::controllers changed, or MOUSE_SAMPLE_INDEX if the mouse moved
+    int mouse_x;
+    int mouse_y;
+    ControllerInput controller; // state of the controller right after the change
 };
 
+// One per game_update; input that arrives while no update runs is kept for the next one
 struct GameInput
 {
-    // TODO pass time elapsed since last frame
+    float dt;               // seconds of simulation this update covers; always the fixed tick length
+    double time;            // simulation time at the start of this update; never goes backwards
+
     int keyboard_index;     // index of controllers which is a keyboard, -1 for no keyboard
     int num_controllers;    // total number of controllers, including keyboard
 
@@ -76,11 +205,15 @@ struct GameInput
     int mouse_y;
 
     ControllerInput controllers[MAX_CONTROLLERS];
+
+    // in time order; controllers above is the state after the last one
+    int num_samples;
+    InputSample samples[MAX_INPUT_SAMPLES];
 };
 
 struct GameInputBuffer
 {
-    // circular game input buffer;
+    // circular game input buffer, INPUT_HISTORY_FRAMES deep;
     // input_buffer[last] is input we saw at the start of this frame,
     // input_buffer[(last-1) % INPUT_BUFFER_SIZE] etc are previous inputs
     int last;
@@ -88,6 +221,103 @@ struct GameInputBuffer
 };
 
 
+// Work queue
+// Game code adds entries to a queue and they're run on the platform's worker threads
+// Any thread can add work; complete_all_work runs entries on the calling thread too, until the queue is empty
+// The platform completes all work before reloading game code, so callbacks never outlive the code they point to
+struct PlatformWorkQueue;
+
+#define FUNC_PLATFORM_WORK_QUEUE_CALLBACK(name) void name(PlatformWorkQueue* queue, void* data)
+typedef FUNC_PLATFORM_WORK_QUEUE_CALLBACK(PlatformWorkQueueCallback);
+
+#define FUNC_PLATFORM_ADD_WORK_ENTRY(name) void name(PlatformWorkQueue* queue, PlatformWorkQueueCallback* callback, void* data)
+typedef FUNC_PLATFORM_ADD_WORK_ENTRY(PlatformAddWorkEntry);
+
+#define FUNC_PLATFORM_COMPLETE_ALL_WORK(name) void name(PlatformWorkQueue* queue)
+typedef FUNC_PLATFORM_COMPLETE_ALL_WORK(PlatformCompleteAllWork);
+//
+
+
+// File I/O
+// Reads and writes run in the background; the game polls (or waits on) the request it got back
+// Buffers come from game memory and must stay put until the request is finished
+// Errors come back in the FileResult; nothing here ever blocks the frame or exits
+struct PlatformFileQueue;
+
+// 0 is never a request; reads and writes return it if too many are in flight, or the filename is too long
+typedef uint32_t FileRequest;
+
+enum FileError
+{
+    FILE_OK = 0,
+    FILE_ERROR_NOT_FOUND,
+    FILE_ERROR_ACCESS_DENIED,
+    FILE_ERROR_IO,
+    FILE_ERROR_INVALID_REQUEST,     // 0, or already finished and collected
+};
+
+struct FileResult
+{
+    FileError error;
+    int64_t bytes;      // transferred; a read comes up short at the end of the file
+};
+
+// Read up to size bytes from offset
+#define FUNC_PLATFORM_READ_FILE(name) FileRequest name(PlatformFileQueue* queue, const char* filename, uint64_t offset, void* buffer, uint64_t size)
+typedef FUNC_PLATFORM_READ_FILE(PlatformReadFile);
+
+// Create or truncate the file, and write size bytes to it
+#define FUNC_PLATFORM_WRITE_FILE(name) FileRequest name(PlatformFileQueue* queue, const char* filename, const void* buffer, uint64_t size)
+typedef FUNC_PLATFORM_WRITE_FILE(PlatformWriteFile);
+
+// True once the request has finished, with its result; the request is gone after that
+#define FUNC_PLATFORM_POLL_FILE(name) bool name(PlatformFileQueue* queue, FileRequest request, FileResult* result)
+typedef FUNC_PLATFORM_POLL_FILE(PlatformPollFile);
+
+// Block until the request has finished; only for loading screens and the like
+#define FUNC_PLATFORM_WAIT_FILE(name) void name(PlatformFileQueue* queue, FileRequest request, FileResult* result)
+typedef FUNC_PLATFORM_WAIT_FILE(PlatformWaitFile);
+//
+
+
+// Asset pack
+// One packed archive (asset_pack.h, built by asset_packer) mapped read only for the whole run
+// Assets are looked up by asset_id(name) and used in place; pointers stay valid across game code reloads
+struct PlatformAssetPack;
+
+// NULL if there's no such asset (or no pack); size can be NULL
+#define FUNC_PLATFORM_GET_ASSET(name) const void* name(PlatformAssetPack* pack, uint64_t id, uint64_t* size)
+typedef FUNC_PLATFORM_GET_ASSET(PlatformGetAsset);
+
+// Start reading a group's assets in the background, before they're needed; false if there's no such group
+#define FUNC_PLATFORM_PREFETCH_ASSET_GROUP(name) bool name(PlatformAssetPack* pack, uint32_t id)
+typedef FUNC_PLATFORM_PREFETCH_ASSET_GROUP(PlatformPrefetchAssetGroup);
+//
+
+
+// Audio streams
+// Long sounds (music, ambience) are decoded from disk a chunk at a time on a platform thread, into a bounded
+// ring per stream; the game mixes from the ring into its sound buffer (see mix_audio_samples in audio_stream.h)
+// Open and close from game_update; read only from the thread making the sound, which it never blocks
+struct PlatformAudioStreams;
+
+// 0 is never a stream; open returns it if every stream is in use, or the filename is too long
+typedef uint32_t AudioStream;
+
+// A 16 bit PCM WAV (mono or stereo) at the output rate; anything else fails on the stream thread, and reads return -1
+#define FUNC_PLATFORM_OPEN_AUDIO_STREAM(name) AudioStream name(PlatformAudioStreams* streams, const char* filename, bool loop)
+typedef FUNC_PLATFORM_OPEN_AUDIO_STREAM(PlatformOpenAudioStream);
+
+#define FUNC_PLATFORM_CLOSE_AUDIO_STREAM(name) void name(PlatformAudioStreams* streams, AudioStream stream)
+typedef FUNC_PLATFORM_CLOSE_AUDIO_STREAM(PlatformCloseAudioStream);
+
+// Copy up to num_frames interleaved stereo frames that are ready; returns how many (fewer if the stream is still
+// opening, or fell behind), or -1 once it has played to the end, failed, or been closed
+#define FUNC_PLATFORM_READ_AUDIO_STREAM(name) int name(PlatformAudioStreams* streams, AudioStream stream, int16_t* frames, int num_frames)
+typedef FUNC_PLATFORM_READ_AUDIO_STREAM(PlatformReadAudioStream);
+//
+
+
 // debug/prototyping functions only
 #define FUNC_DEBUG_PLATFORM_READ_ENTIRE_FILE(name) void* name(const char* filename, int64_t* returned_size)
 typedef FUNC_DEBUG_PLATFORM_READ_ENTIRE_FILE(DEBUGPlatformReadEntireFile);
@@ -100,14 +330,39 @@ typedef FUNC_DEBUG_PLATFORM_WRITE_ENTIRE_FILE(DEBUGPlatformWriteEntireFile);
 //
 
 
+// profiler.h; NULL unless built with PROFILER
+struct Profiler;
+
 struct GameMemory
 {
     unsigned memory_size;
     void* memory;
 
+    PlatformWorkQueue* work_queue;
+    int num_work_threads;   // threads running work_queue entries, including the one calling complete_all_work
+    PlatformAddWorkEntry* platform_add_work_entry;
+    PlatformCompleteAllWork* platform_complete_all_work;
+
+    PlatformFileQueue* file_queue;
+    PlatformReadFile* platform_read_file;
+    PlatformWriteFile* platform_write_file;
+    PlatformPollFile* platform_poll_file;
+    PlatformWaitFile* platform_wait_file;
+
+    PlatformAssetPack* asset_pack;
+    PlatformGetAsset* platform_get_asset;
+    PlatformPrefetchAssetGroup* platform_prefetch_asset_group;
+
+    PlatformAudioStreams* audio_streams;
+    PlatformOpenAudioStream* platform_open_audio_stream;
+    PlatformCloseAudioStream* platform_close_audio_stream;
+    PlatformReadAudioStream* platform_read_audio_stream;
+
     DEBUGPlatformReadEntireFile* DEBUG_platform_read_entire_file;
     DEBUGPlatformFreeFileMemory* DEBUG_platform_free_file_memory;
     DEBUGPlatformWriteEntireFile* DEBUG_platform_write_entire_file;
+
+    Profiler* profiler;
 };
 
 #define FUNC_GAME_INIT_MEMORY(name) void name(GameMemory game_memory)
@@ -117,11 +372,34 @@ FUNC_GAME_INIT_MEMORY(game_init_memory_stub)
     FATAL_PRINTF("game_init_memory not loaded\n");
 }
 
-#define FUNC_GAME_UPDATE_AND_RENDER(name) void name(GameMemory game_memory, GameInputBuffer* input_buffer, GameRenderBuffer* render_buffer, GameSoundBuffer* sound_buffer)
-typedef FUNC_GAME_UPDATE_AND_RENDER(GameUpdateAndRender);
-FUNC_GAME_UPDATE_AND_RENDER(game_update_and_render_stub)
+// Advance the simulation by one fixed tick (input_buffer->buffer[last].dt seconds)
+// Called zero or more times per displayed frame, so it shouldn't draw anything
+#define FUNC_GAME_UPDATE(name) void name(GameMemory game_memory, GameInputBuffer* input_buffer)
+typedef FUNC_GAME_UPDATE(GameUpdate);
+FUNC_GAME_UPDATE(game_update_stub)
+{
+    FATAL_PRINTF("game_update not loaded\n");
+}
+
+// Draw once per displayed frame; alpha in [0, 1) is how far real time has got from the last update towards the next,
+// so the game can interpolate between its last two states
+// sound_buffer->buffer_size is 0 if the platform is pulling sound with game_get_sound_samples instead
+#define FUNC_GAME_RENDER(name) void name(GameMemory game_memory, GameRenderBuffer* render_buffer, GameSoundBuffer* sound_buffer, float alpha)
+typedef FUNC_GAME_RENDER(GameRender);
+FUNC_GAME_RENDER(game_render_stub)
+{
+    FATAL_PRINTF("game_render not loaded\n");
+}
+
+// Called from the audio thread, just in time, to fill sound_buffer (exactly buffer_size bytes) with the next samples
+// Must not block; anything it needs from game_update should be passed through a lock-free queue
+// The platform never calls this while the game code is being swapped out
+#define FUNC_GAME_GET_SOUND_SAMPLES(name) void name(GameMemory game_memory, GameSoundBuffer* sound_buffer)
+typedef FUNC_GAME_GET_SOUND_SAMPLES(GameGetSoundSamples);
+FUNC_GAME_GET_SOUND_SAMPLES(game_get_sound_samples_stub)
 {
-    FATAL_PRINTF("game_update_and_render not loaded\n");
+    // may be called before the game code is loaded; silence
+    memset(sound_buffer->buffer, 0, sound_buffer->buffer_size);
 }
 
 
@@ -0,0 +1,118 @@
+#ifndef MEMORY_ARENA_H
+/*
+ * Linear (bump) allocators carved out of GameMemory
+ * Nothing is freed individually; arenas are reset as a whole, or rolled back with temporary memory
+ */
+
+#include<stddef.h>
+#include<string.h>
+
+#include"util.h"
+
+static const size_t DEFAULT_ARENA_ALIGNMENT = 16;
+
+struct MemoryArena
+{
+    uint8_t* base;
+    size_t size;
+    size_t used;
+
+    int temp_count;     // number of open temporary memory scopes
+};
+
+// Marker to roll an arena back to
+struct TemporaryMemory
+{
+    MemoryArena* arena;
+    size_t used;
+};
+
+
+static inline void init_arena(MemoryArena* arena, void* base, size_t size)
+{
+    arena->base = (uint8_t*)base;
+    arena->size = size;
+    arena->used = 0;
+    arena->temp_count = 0;
+}
+
+static inline size_t get_alignment_offset(MemoryArena* arena, size_t alignment)
+{
+    DEBUG_ASSERT(alignment && (alignment & (alignment - 1)) == 0);
+
+    uintptr_t next = (uintptr_t)(arena->base + arena->used);
+    return (alignment - (next & (alignment - 1))) & (alignment - 1);
+}
+
+// Returns uninitialized memory, or NULL if the arena is full
+static inline void* push_size(MemoryArena* arena, size_t size, size_t alignment = DEFAULT_ARENA_ALIGNMENT)
+{
+    size_t offset = get_alignment_offset(arena, alignment);
+    if (arena->used + offset + size > arena->size)
+    {
+        DEBUG_PRINTF("Arena out of memory: %zu used, %zu requested, %zu total\n", arena->used, size, arena->size);
+        DEBUG_ASSERT(false);
+        return NULL;
+    }
+
+    void* result = arena->base + arena->used + offset;
+    arena->used += offset + size;
+    return result;
+}
+
+static inline void* push_size_zero(MemoryArena* arena, size_t size, size_t alignment = DEFAULT_ARENA_ALIGNMENT)
+{
+    void* result = push_size(arena, size, alignment);
+    if (result)
+    {
+        memset(result, 0, size);
+    }
+    return result;
+}
+
+#define PUSH_STRUCT(arena, type) ((type*)push_size((arena), sizeof(type), alignof(type)))
+#define PUSH_ARRAY(arena, count, type) ((type*)push_size((arena), (size_t)(count) * sizeof(type), alignof(type)))
+#define PUSH_STRUCT_ZERO(arena, type) ((type*)push_size_zero((arena), sizeof(type), alignof(type)))
+#define PUSH_ARRAY_ZERO(arena, count, type) ((type*)push_size_zero((arena), (size_t)(count) * sizeof(type), alignof(type)))
+
+// Carve a child arena out of arena; it lives as long as the memory it came from
+static inline void init_sub_arena(MemoryArena* sub_arena, MemoryArena* arena, size_t size, size_t alignment = DEFAULT_ARENA_ALIGNMENT)
+{
+    init_arena(sub_arena, push_size(arena, size, alignment), size);
+}
+
+// Catch anything that's written over the arena's bookkeeping
+static inline void check_arena(MemoryArena* arena)
+{
+    DEBUG_ASSERT(arena->used <= arena->size);
+    DEBUG_ASSERT(arena->temp_count >= 0);
+}
+
+static inline void reset_arena(MemoryArena* arena)
+{
+    check_arena(arena);
+    DEBUG_ASSERT(arena->temp_count == 0);
+    arena->used = 0;
+}
+
+
+static inline TemporaryMemory begin_temporary_memory(MemoryArena* arena)
+{
+    arena->temp_count++;
+    return TemporaryMemory{arena, arena->used};
+}
+
+// Frees everything pushed since begin_temporary_memory; scopes must be ended in reverse order
+static inline void end_temporary_memory(TemporaryMemory temp)
+{
+    MemoryArena* arena = temp.arena;
+    DEBUG_ASSERT(arena->used >= temp.used);
+    DEBUG_ASSERT(arena->temp_count > 0);
+    arena->used = temp.used;
+    arena->temp_count--;
+    check_arena(arena);
+}
+
+
+#define MEMORY_ARENA_H
+#endif
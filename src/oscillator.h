@@ -0,0 +1,159 @@
+#ifndef OSCILLATOR_H
+/*
+ * Sine oscillator for the game's sound output
+ * Phase is a double-precision accumulator in cycles, wrapped to [0, 1), so it never loses precision however long it runs
+ * Each sample is computed once (4 at a time with SSE2) and then copied to every channel
+ */
+
+#include"util.h"
+#include"game_platform_interface.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define OSCILLATOR_SSE2
+#include<emmintrin.h>
+#endif
+
+struct SineOscillator
+{
+    double phase;   // cycles, [0, 1)
+};
+
+// mono samples are generated into a block on the stack, then spread over the channels
+static const int OSCILLATOR_BLOCK_SAMPLES = 256;
+
+// coefficients of the taylor series of sin(x) up to x^9, in terms of x = 2*pi*p
+// max error over the folded range [-pi/2, pi/2] is ~4e-6, well under one LSB at full 16 bit scale
+static const float SINE_C1 = (float)(2.0 * M_PI);
+static const float SINE_C3 = (float)(-(2.0 * M_PI) * (2.0 * M_PI) * (2.0 * M_PI) / 6.0);
+static const float SINE_C5 = (float)((2.0 * M_PI) * (2.0 * M_PI) * (2.0 * M_PI) * (2.0 * M_PI) * (2.0 * M_PI) / 120.0);
+static const float SINE_C7 = (float)(-(2.0 * M_PI) * (2.0 * M_PI) * (2.0 * M_PI) * (2.0 * M_PI) * (2.0 * M_PI) * (2.0 * M_PI) * (2.0 * M_PI) / 5040.0);
+static const float SINE_C9 = (float)((2.0 * M_PI) * (2.0 * M_PI) * (2.0 * M_PI) * (2.0 * M_PI) * (2.0 * M_PI) * (2.0 * M_PI) * (2.0 * M_PI) * (2.0 * M_PI) * (2.0 * M_PI) / 362880.0);
+
+// phase is never negative, so truncating is the same as floor (and doesn't end up as a libm call)
+static inline double wrap_phase(double phase)
+{
+    return phase - (double)(int64_t)phase;
+}
+
+// sin(2 * pi * p) for p in [0, 1)
+static inline float sine_of_cycles(float p)
+{
+    // shift to [-0.5, 0.5), which negates the result, then fold into [-0.25, 0.25] using sin(pi - x) = sin(x)
+    float y = p - 0.5F;
+    if (y > 0.25F) y = 0.5F - y;
+    if (y < -0.25F) y = -0.5F - y;
+    float y2 = y * y;
+    return -y * (SINE_C1 + y2 * (SINE_C3 + y2 * (SINE_C5 + y2 * (SINE_C7 + y2 * SINE_C9))));
+}
+
+static inline int16_t sine_sample(float p, float amplitude)
+{
+    float s = amplitude * sine_of_cycles(p);
+    // round to nearest and saturate, like _mm_cvtps_epi32 + _mm_packs_epi32
+    s = s >= 0.0F ? s + 0.5F : s - 0.5F;
+    if (s > 32767.0F) return 32767;
+    if (s < -32768.0F) return -32768;
+    return (int16_t)s;
+}
+
+// Write count mono samples starting at phase; returns the phase after them
+static double generate_sine_block(int16_t* out, int count, double phase, double phase_inc, float amplitude)
+{
+    int i = 0;
+#ifdef OSCILLATOR_SSE2
+    const __m128 lanes = _mm_setr_ps(0.0F, 1.0F, 2.0F, 3.0F);
+    const __m128 inc = _mm_set1_ps((float)phase_inc);
+    const __m128 amp = _mm_set1_ps(amplitude);
+    const __m128 half = _mm_set1_ps(0.5F);
+    const __m128 quarter = _mm_set1_ps(0.25F);
+    const __m128 neg_half = _mm_set1_ps(-0.5F);
+    const __m128 neg_quarter = _mm_set1_ps(-0.25F);
+
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128i packed[2];
+        for (int h = 0; h < 2; ++h)
+        {
+            // only the block's start phase comes from the double accumulator; lanes are offsets from it
+            __m128 p = _mm_add_ps(_mm_set1_ps((float)phase), _mm_mul_ps(lanes, inc));
+            // wrap lanes that crossed 1.0 (phase_inc < 0.25, so at most once)
+            p = _mm_sub_ps(p, _mm_and_ps(_mm_cmpge_ps(p, _mm_set1_ps(1.0F)), _mm_set1_ps(1.0F)));
+
+            __m128 y = _mm_sub_ps(p, half);
+            __m128 above = _mm_cmpgt_ps(y, quarter);
+            y = _mm_or_ps(_mm_and_ps(above, _mm_sub_ps(half, y)), _mm_andnot_ps(above, y));
+            __m128 below = _mm_cmplt_ps(y, neg_quarter);
+            y = _mm_or_ps(_mm_and_ps(below, _mm_sub_ps(neg_half, y)), _mm_andnot_ps(below, y));
+
+            __m128 y2 = _mm_mul_ps(y, y);
+            __m128 poly = _mm_add_ps(_mm_set1_ps(SINE_C7), _mm_mul_ps(y2, _mm_set1_ps(SINE_C9)));
+            poly = _mm_add_ps(_mm_set1_ps(SINE_C5), _mm_mul_ps(y2, poly));
+            poly = _mm_add_ps(_mm_set1_ps(SINE_C3), _mm_mul_ps(y2, poly));
+            poly = _mm_add_ps(_mm_set1_ps(SINE_C1), _mm_mul_ps(y2, poly));
+            __m128 s = _mm_mul_ps(amp, _mm_sub_ps(_mm_setzero_ps(), _mm_mul_ps(y, poly)));
+
+            // cvtps rounds to nearest even, the scalar path rounds half away from zero; for non-integer inputs they agree
+            packed[h] = _mm_cvtps_epi32(s);
+            phase = wrap_phase(phase + 4.0 * phase_inc);
+        }
+        _mm_storeu_si128((__m128i*)&out[i], _mm_packs_epi32(packed[0], packed[1]));
+    }
+#endif
+    for (; i < count; ++i)
+    {
+        out[i] = sine_sample((float)phase, amplitude);
+        phase = wrap_phase(phase + phase_inc);
+    }
+    return phase;
+}
+
+static void output_sine_wave(GameSoundBuffer* sound_buffer, SineOscillator* oscillator, int wave_hz, int wave_amplitude)
+{
+    DEBUG_ASSERT(sound_buffer->buffer_size % sound_buffer->bytes_per_sample == 0);
+    DEBUG_ASSERT(sound_buffer->bytes_per_sample == sound_buffer->num_channels * (int)sizeof(int16_t));
+
+    int num_samples = sound_buffer->buffer_size / sound_buffer->bytes_per_sample;
+    int num_channels = sound_buffer->num_channels;
+    // cycles per sample; vector lanes run up to 3 samples ahead of the block start, so keeping this under 0.25
+    // means a lane wraps past 1.0 at most once
+    double phase_inc = (double)wave_hz / (double)sound_buffer->samples_per_second;
+    DEBUG_ASSERT(phase_inc >= 0.0 && phase_inc < 0.25);
+    float amplitude = (float)wave_amplitude;
+
+    int16_t mono[OSCILLATOR_BLOCK_SAMPLES];
+    int16_t* curr_sample = (int16_t*)sound_buffer->buffer;
+    double phase = oscillator->phase;
+
+    for (int start = 0; start < num_samples; start += OSCILLATOR_BLOCK_SAMPLES)
+    {
+        int count = MIN(OSCILLATOR_BLOCK_SAMPLES, num_samples - start);
+        phase = generate_sine_block(mono, count, phase, phase_inc, amplitude);
+
+        int i = 0;
+#ifdef OSCILLATOR_SSE2
+        if (num_channels == 2)
+        {
+            for (; i + 8 <= count; i += 8)
+            {
+                __m128i m = _mm_loadu_si128((__m128i*)&mono[i]);
+                _mm_storeu_si128((__m128i*)curr_sample, _mm_unpacklo_epi16(m, m));
+                _mm_storeu_si128((__m128i*)(curr_sample + 8), _mm_unpackhi_epi16(m, m));
+                curr_sample += 16;
+            }
+        }
+#endif
+        for (; i < count; ++i)
+        {
+            for (int ch = 0; ch < num_channels; ++ch)
+            {
+                *curr_sample++ = mono[i];
+            }
+        }
+    }
+
+    oscillator->phase = phase;
+}
+
+
+#define OSCILLATOR_H
+#endif
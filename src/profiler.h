@@ -0,0 +1,261 @@
+#ifndef PROFILER_H
+/*
+ * Hierarchical timing blocks, usable from both platform and game code
+ *
+ * TIMED_BLOCK("name") times the rest of the enclosing scope, TIMED_FUNCTION() the enclosing function.
+ * PROFILE_COUNTER("name", value) records a value at a point in time (shows up in trace captures only).
+ * Each thread pushes begin/end events into its own lock-free queue; once a frame the platform collates them
+ * into a call tree per thread (sdl_profiler.h).
+ *
+ * Everything compiles to nothing unless PROFILER is defined; build the platform and game with the same setting.
+ * The profiler itself lives in platform memory and is handed to the game in GameMemory, since each module
+ * has its own copy of global_profiler.
+ */
+
+#ifdef PROFILER
+
+#include<string.h>
+#include<atomic>
+
+#ifdef _WIN32
+#include<windows.h>
+#else
+#include<pthread.h>
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64)
+#ifdef _MSC_VER
+#include<intrin.h>
+#else
+#include<x86intrin.h>
+#endif
+#else
+#include<chrono>
+#endif
+
+#include"util.h"
+#include"spsc_queue.h"
+
+static const int MAX_PROFILE_THREADS = 32;
+static const int PROFILE_EVENTS_PER_THREAD = 8192;  // power of 2; a few frames' worth for the busiest thread
+static const int MAX_PROFILE_DEPTH = 32;
+static const int MAX_PROFILE_NAMES = 256;
+// the same name can be at more than one address (a literal repeated in each module), so room for twice as many
+static const int MAX_PROFILE_NAME_POINTERS = 2 * MAX_PROFILE_NAMES;    // power of 2
+static const int PROFILE_NAME_LENGTH = 48;
+static const int MAX_PROFILE_NODES = 512;           // per frame
+static const int PROFILE_HISTORY_FRAMES = 256;
+
+enum ProfileEventType
+{
+    PROFILE_EVENT_BEGIN,
+    PROFILE_EVENT_END,
+    PROFILE_EVENT_COUNTER,
+};
+
+struct ProfileEvent
+{
+    uint64_t clock;
+    const char* name;   // string literal in whichever module pushed it; only valid until that module is unloaded
+    int64_t value;      // counters only
+    uint32_t type;
+};
+
+// Claimed by a thread the first time it times something; never given back
+struct ProfileThread
+{
+    std::atomic<uint64_t> os_thread_id;     // 0 while free
+    std::atomic<uint32_t> dropped_events;   // queue was full
+    std::atomic<bool> named;                // name is written and won't change
+    char name[PROFILE_NAME_LENGTH];
+    SPSCQueue<ProfileEvent, PROFILE_EVENTS_PER_THREAD> events;
+};
+
+// A block that has begun but not ended yet; survives across frames
+struct ProfileOpenBlock
+{
+    int name_index;
+    uint64_t begin_clock;
+};
+
+// One block at one place in the call tree, over one frame
+struct ProfileNode
+{
+    int name_index;     // -1 for a thread's root
+    int parent;
+    int first_child;
+    int next_sibling;
+    uint64_t cycles;    // inclusive, summed over hits
+    uint32_t hits;
+};
+
+struct ProfileFrame
+{
+    uint64_t begin_clock;
+    uint64_t end_clock;
+    uint32_t dropped_events;
+    int num_nodes;
+    int thread_roots[MAX_PROFILE_THREADS];  // -1 if the thread finished no blocks this frame
+    ProfileNode nodes[MAX_PROFILE_NODES];
+};
+
+struct ProfileName
+{
+    char name[PROFILE_NAME_LENGTH];
+};
+
+struct Profiler
+{
+    ProfileThread threads[MAX_PROFILE_THREADS];
+    std::atomic<uint32_t> unregistered_events;  // every thread slot was taken
+
+    // everything below is only touched by the thread collating (the main thread)
+    ProfileOpenBlock open_blocks[MAX_PROFILE_THREADS][MAX_PROFILE_DEPTH];
+    int open_depth[MAX_PROFILE_THREADS];
+
+    // names are copied, so trees outlive the module that timed them; the pointer lookup is open addressed
+    ProfileName names[MAX_PROFILE_NAMES];
+    int num_names;
+    const char* name_pointers[MAX_PROFILE_NAME_POINTERS];
+    int name_pointer_indices[MAX_PROFILE_NAME_POINTERS];
+    int num_name_pointers;
+
+    uint64_t frame_count;   // frames finished; the one being collated is frames[frame_count % PROFILE_HISTORY_FRAMES]
+    ProfileFrame frames[PROFILE_HISTORY_FRAMES];
+    double clocks_per_ms;   // set by the platform, for printing
+};
+
+// NULL until the platform (or GameMemory, in the game) sets it
+static Profiler* global_profiler = NULL;
+
+static inline uint64_t read_profile_clock()
+{
+#if defined(__x86_64__) || defined(_M_X64)
+    return __rdtsc();
+#else
+    return (uint64_t)std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+static inline uint64_t get_os_thread_id()
+{
+#ifdef _WIN32
+    return (uint64_t)GetCurrentThreadId();
+#else
+    return (uint64_t)pthread_self();
+#endif
+}
+
+// Find this thread's slot, claiming a free one the first time
+// Keyed by OS thread id rather than a thread_local alone, so platform and game code on the same thread share a slot
+static ProfileThread* get_profile_thread(Profiler* profiler)
+{
+    static thread_local ProfileThread* thread = NULL;
+    static thread_local Profiler* thread_profiler = NULL;
+    if (thread && thread_profiler == profiler)
+    {
+        return thread;
+    }
+
+    uint64_t id = get_os_thread_id();
+    for (int i = 0; i < MAX_PROFILE_THREADS; ++i)
+    {
+        uint64_t slot_id = profiler->threads[i].os_thread_id.load(std::memory_order_acquire);
+        if (slot_id == 0)
+        {
+            if (!profiler->threads[i].os_thread_id.compare_exchange_strong(slot_id, id, std::memory_order_acq_rel))
+            {
+                // another thread got it first; slot_id now holds its id
+                if (slot_id != id)
+                {
+                    continue;
+                }
+            }
+        }
+        else if (slot_id != id)
+        {
+            continue;
+        }
+        thread = &profiler->threads[i];
+        thread_profiler = profiler;
+        return thread;
+    }
+    return NULL;
+}
+
+static inline void push_profile_event(const char* name, uint32_t type, int64_t value)
+{
+    Profiler* profiler = global_profiler;
+    if (!profiler)
+    {
+        return;
+    }
+    ProfileThread* thread = get_profile_thread(profiler);
+    if (!thread)
+    {
+        profiler->unregistered_events.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    ProfileEvent event{read_profile_clock(), name, value, type};
+    if (!spsc_push(&thread->events, &event))
+    {
+        thread->dropped_events.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+struct TimedBlock
+{
+    const char* name;
+
+    TimedBlock(const char* block_name)
+    {
+        name = block_name;
+        push_profile_event(name, PROFILE_EVENT_BEGIN, 0);
+    }
+    ~TimedBlock()
+    {
+        push_profile_event(name, PROFILE_EVENT_END, 0);
+    }
+};
+
+// Label the calling thread in trace captures; only the first name sticks
+static inline void name_profile_thread(const char* name)
+{
+    Profiler* profiler = global_profiler;
+    ProfileThread* thread = profiler ? get_profile_thread(profiler) : NULL;
+    if (!thread || thread->named.load(std::memory_order_relaxed))
+    {
+        return;
+    }
+    strncpy(thread->name, name, PROFILE_NAME_LENGTH - 1);
+    thread->named.store(true, std::memory_order_release);
+}
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+// name must be a string literal (or otherwise live as long as the code that uses it)
+#define TIMED_BLOCK(name) TimedBlock PROFILE_CONCAT(timed_block_, __LINE__)(name)
+#define TIMED_FUNCTION() TIMED_BLOCK(__func__)
+// for stretches of code that aren't a scope of their own; every BEGIN needs an END with the same name
+#define BEGIN_TIMED_BLOCK(name) push_profile_event(name, PROFILE_EVENT_BEGIN, 0)
+#define END_TIMED_BLOCK(name) push_profile_event(name, PROFILE_EVENT_END, 0)
+#define PROFILE_COUNTER(name, value) push_profile_event(name, PROFILE_EVENT_COUNTER, (int64_t)(value))
+#define NAME_PROFILE_THREAD(name) name_profile_thread(name)
+// at the top of every entry point into a module that didn't set up the profiler itself
+#define SET_PROFILER(profiler) (global_profiler = (profiler))
+
+#else   // PROFILER
+
+#define TIMED_BLOCK(name)
+#define TIMED_FUNCTION()
+#define BEGIN_TIMED_BLOCK(name)
+#define END_TIMED_BLOCK(name)
+#define PROFILE_COUNTER(name, value)
+#define NAME_PROFILE_THREAD(name)
+#define SET_PROFILER(profiler)
+
+#endif  // PROFILER
+
+
+#define PROFILER_H
+#endif
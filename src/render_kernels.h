@@ -0,0 +1,333 @@
+#ifndef RENDER_KERNELS_H
+/*
+ * Full-buffer fill kernels used by the game's software renderer
+ * Each kernel has a scalar version, and SSE2/AVX2 versions on x64; the best one
+ * supported by the CPU is picked once, the first time it's needed
+ */
+
+#include<string.h>
+
+#include"util.h"
+#include"game_platform_interface.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define RENDER_KERNELS_X64
+#include<immintrin.h>
+#ifdef _MSC_VER
+#include<intrin.h>
+#define TARGET_AVX2
+#else
+// gcc/clang need to be told a function may use AVX2 (the rest of the file is built for baseline x64)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+// buffers bigger than this get written with non-temporal stores, so we don't evict everything else from cache
+// roughly the size of a typical L2; 800x600 stays cached, 1080p and up streams
+static const int64_t NON_TEMPORAL_THRESHOLD_BYTES = MEBIBYTES(4);
+
+enum RenderKernelLevel
+{
+    RENDER_KERNEL_SCALAR = 0,
+    RENDER_KERNEL_SSE2,
+    RENDER_KERNEL_AVX2,
+    RENDER_KERNEL_COUNT
+};
+
+static const char* const RENDER_KERNEL_NAMES[RENDER_KERNEL_COUNT] = {"scalar", "sse2", "avx2"};
+
+// non_temporal is decided for the whole frame by the caller, since the buffer passed in might only be a band of it
+#define FUNC_RENDER_GRADIENT(name) void name(GameRenderBuffer* buffer, int x_offset, int y_offset, bool non_temporal)
+typedef FUNC_RENDER_GRADIENT(RenderGradient);
+
+
+static RenderKernelLevel get_cpu_render_kernel_level()
+{
+#ifdef RENDER_KERNELS_X64
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    int max_leaf = info[0];
+    __cpuid(info, 1);
+    bool has_osxsave = (info[2] & (1 << 27)) != 0;
+    bool has_avx = (info[2] & (1 << 28)) != 0;
+    // the OS has to save ymm registers on context switch, or we can't use them
+    bool os_saves_ymm = has_osxsave && ((_xgetbv(0) & 0x6) == 0x6);
+    if (max_leaf >= 7 && has_avx && os_saves_ymm)
+    {
+        __cpuidex(info, 7, 0);
+        if (info[1] & (1 << 5))
+        {
+            return RENDER_KERNEL_AVX2;
+        }
+    }
+#else
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return RENDER_KERNEL_AVX2;
+    }
+#endif
+    // SSE2 is part of x64
+    return RENDER_KERNEL_SSE2;
+#else
+    return RENDER_KERNEL_SCALAR;
+#endif
+}
+
+
+/*
+ * Gradient
+ * Each pixel is 0x00RRGGBB (little endian BGRX in memory) with
+ * B = column + x_offset, G = row + y_offset, R and padding = 0
+ */
+
+static inline uint32_t gradient_pixel(int c, int r, int x_offset, int y_offset)
+{
+    return ((uint32_t)(uint8_t)(r + y_offset) << 8) | (uint32_t)(uint8_t)(c + x_offset);
+}
+
+static FUNC_RENDER_GRADIENT(render_gradient_scalar)
+{
+    uint8_t* row = (uint8_t*)buffer->pixels;
+
+    for (int r = 0; r < buffer->height; ++r)
+    {
+        uint32_t* pixel = (uint32_t*)row;
+        for (int c = 0; c < buffer->width; ++c)
+        {
+            *pixel++ = gradient_pixel(c, r, x_offset, y_offset);
+        }
+        row += buffer->pitch;
+    }
+}
+
+#ifdef RENDER_KERNELS_X64
+
+// Rows are written as: scalar pixels until the pointer is aligned for the stream store,
+// then full vectors, then a scalar tail
+// Only blue changes along a row, so each vector is just (lane index + column + x_offset) masked, OR'd with the row's green
+
+static FUNC_RENDER_GRADIENT(render_gradient_sse2)
+{
+    const __m128i lanes = _mm_setr_epi32(0, 1, 2, 3);
+    const __m128i four = _mm_set1_epi32(4);
+    const __m128i byte_mask = _mm_set1_epi32(0xFF);
+
+    uint8_t* row = (uint8_t*)buffer->pixels;
+
+    for (int r = 0; r < buffer->height; ++r)
+    {
+        uint32_t* pixel = (uint32_t*)row;
+        int c = 0;
+
+        while (c < buffer->width && ((uintptr_t)pixel & 15))
+        {
+            *pixel++ = gradient_pixel(c++, r, x_offset, y_offset);
+        }
+
+        const __m128i green = _mm_set1_epi32((int)gradient_pixel(0, r, 0, y_offset));
+        __m128i blue = _mm_add_epi32(_mm_set1_epi32(c + x_offset), lanes);
+
+        if (non_temporal)
+        {
+            for (; c + 4 <= buffer->width; c += 4)
+            {
+                _mm_stream_si128((__m128i*)pixel, _mm_or_si128(_mm_and_si128(blue, byte_mask), green));
+                blue = _mm_add_epi32(blue, four);
+                pixel += 4;
+            }
+        }
+        else
+        {
+            for (; c + 4 <= buffer->width; c += 4)
+            {
+                _mm_store_si128((__m128i*)pixel, _mm_or_si128(_mm_and_si128(blue, byte_mask), green));
+                blue = _mm_add_epi32(blue, four);
+                pixel += 4;
+            }
+        }
+
+        for (; c < buffer->width; ++c)
+        {
+            *pixel++ = gradient_pixel(c, r, x_offset, y_offset);
+        }
+        row += buffer->pitch;
+    }
+
+    if (non_temporal)
+    {
+        // make the streamed writes visible before anyone else reads the buffer
+        _mm_sfence();
+    }
+}
+
+TARGET_AVX2 static FUNC_RENDER_GRADIENT(render_gradient_avx2)
+{
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i eight = _mm256_set1_epi32(8);
+    const __m256i byte_mask = _mm256_set1_epi32(0xFF);
+
+    uint8_t* row = (uint8_t*)buffer->pixels;
+
+    for (int r = 0; r < buffer->height; ++r)
+    {
+        uint32_t* pixel = (uint32_t*)row;
+        int c = 0;
+
+        while (c < buffer->width && ((uintptr_t)pixel & 31))
+        {
+            *pixel++ = gradient_pixel(c++, r, x_offset, y_offset);
+        }
+
+        const __m256i green = _mm256_set1_epi32((int)gradient_pixel(0, r, 0, y_offset));
+        __m256i blue = _mm256_add_epi32(_mm256_set1_epi32(c + x_offset), lanes);
+
+        if (non_temporal)
+        {
+            for (; c + 8 <= buffer->width; c += 8)
+            {
+                _mm256_stream_si256((__m256i*)pixel, _mm256_or_si256(_mm256_and_si256(blue, byte_mask), green));
+                blue = _mm256_add_epi32(blue, eight);
+                pixel += 8;
+            }
+        }
+        else
+        {
+            for (; c + 8 <= buffer->width; c += 8)
+            {
+                _mm256_store_si256((__m256i*)pixel, _mm256_or_si256(_mm256_and_si256(blue, byte_mask), green));
+                blue = _mm256_add_epi32(blue, eight);
+                pixel += 8;
+            }
+        }
+
+        for (; c < buffer->width; ++c)
+        {
+            *pixel++ = gradient_pixel(c, r, x_offset, y_offset);
+        }
+        row += buffer->pitch;
+    }
+
+    if (non_temporal)
+    {
+        _mm_sfence();
+    }
+}
+
+#endif // RENDER_KERNELS_X64
+
+// index by RenderKernelLevel; NULL where the kernel isn't compiled for this architecture
+static RenderGradient* const RENDER_GRADIENT_KERNELS[RENDER_KERNEL_COUNT] = {
+    render_gradient_scalar,
+#ifdef RENDER_KERNELS_X64
+    render_gradient_sse2,
+    render_gradient_avx2,
+#else
+    NULL,
+    NULL,
+#endif
+};
+
+
+/*
+ * Dispatch
+ * Static, so it's reset (and re-detected) whenever the game code is reloaded
+ */
+
+static RenderKernelLevel render_kernel_level = RENDER_KERNEL_COUNT;
+
+static RenderKernelLevel get_render_kernel_level()
+{
+    if (render_kernel_level == RENDER_KERNEL_COUNT)
+    {
+        render_kernel_level = get_cpu_render_kernel_level();
+        DEBUG_PRINTF("Render kernels: %s\n", RENDER_KERNEL_NAMES[render_kernel_level]);
+    }
+    return render_kernel_level;
+}
+
+static inline bool use_non_temporal_stores(GameRenderBuffer* buffer)
+{
+    return (int64_t)buffer->pitch * buffer->height >= NON_TEMPORAL_THRESHOLD_BYTES;
+}
+
+// render rows [first_row, first_row + num_rows) of buffer; used to split the buffer into bands across threads
+static void render_gradient_rows(GameRenderBuffer* buffer, int first_row, int num_rows, int x_offset, int y_offset)
+{
+    DEBUG_ASSERT(buffer->pixels);
+    DEBUG_ASSERT(buffer->pitch % sizeof(uint32_t) == 0);
+    DEBUG_ASSERT(first_row >= 0 && first_row + num_rows <= buffer->height);
+
+    GameRenderBuffer band = *buffer;
+    band.pixels = &((uint8_t*)buffer->pixels)[(int64_t)first_row * buffer->pitch];
+    band.height = num_rows;
+
+    RENDER_GRADIENT_KERNELS[get_render_kernel_level()](&band, x_offset, y_offset + first_row, use_non_temporal_stores(buffer));
+}
+
+static void render_gradient_to_buffer(GameRenderBuffer* buffer, int x_offset, int y_offset)
+{
+    render_gradient_rows(buffer, 0, buffer->height, x_offset, y_offset);
+}
+
+
+#ifdef STDOUT_DEBUG
+/*
+ * Check every kernel the CPU supports produces exactly the same bytes as the scalar one
+ * Uses odd sizes, a pitch with padding and a misaligned start so the head/tail paths get exercised,
+ * and a buffer over NON_TEMPORAL_THRESHOLD_BYTES for the streaming path
+ * Returns false on the first mismatch
+ */
+static bool verify_render_kernels()
+{
+    static const int TEST_SIZES[][2] = {{1, 1}, {7, 3}, {37, 19}, {803, 601}, {1283, 1031}};
+    static const int TEST_OFFSETS[][2] = {{0, 0}, {250, -3}, {-1000, 77}};
+
+    RenderKernelLevel max_level = get_render_kernel_level();
+    bool ok = true;
+
+    for (int s = 0; s < (int)SIZE_OF_ARRAY(TEST_SIZES) && ok; ++s)
+    {
+        int width = TEST_SIZES[s][0];
+        int height = TEST_SIZES[s][1];
+        // one extra pixel of padding per row, and one pixel of slack at the front to misalign
+        int pitch = (width + 1) * (int)sizeof(uint32_t);
+        size_t size = (size_t)pitch * height + sizeof(uint32_t);
+
+        uint8_t* expected = (uint8_t*)malloc(size);
+        uint8_t* actual = (uint8_t*)malloc(size);
+        DEBUG_ASSERT(expected && actual);
+
+        for (int o = 0; o < (int)SIZE_OF_ARRAY(TEST_OFFSETS) && ok; ++o)
+        {
+            GameRenderBuffer b{expected + sizeof(uint32_t), width, height, pitch};
+            memset(expected, 0xCD, size);
+            bool non_temporal = use_non_temporal_stores(&b);
+            render_gradient_scalar(&b, TEST_OFFSETS[o][0], TEST_OFFSETS[o][1], false);
+
+            for (int level = RENDER_KERNEL_SCALAR + 1; level <= max_level && ok; ++level)
+            {
+                b.pixels = actual + sizeof(uint32_t);
+                memset(actual, 0xCD, size);
+                RENDER_GRADIENT_KERNELS[level](&b, TEST_OFFSETS[o][0], TEST_OFFSETS[o][1], non_temporal);
+                if (memcmp(expected, actual, size) != 0)
+                {
+                    DEBUG_PRINTF("Render kernel %s doesn't match scalar at %dx%d, offset (%d, %d)\n",
+                                 RENDER_KERNEL_NAMES[level], width, height, TEST_OFFSETS[o][0], TEST_OFFSETS[o][1]);
+                    ok = false;
+                }
+            }
+        }
+
+        free(expected);
+        free(actual);
+    }
+
+    return ok;
+}
+#endif // STDOUT_DEBUG
+
+
+#define RENDER_KERNELS_H
+#endif
@@ -0,0 +1,151 @@
+#ifndef SDL_ASSET_PACK_H
+/*
+ * Asset pack mapped into memory for the whole run
+ *
+ * The pack (asset_pack.h, built by asset_packer) is mapped read only, once; lookups hash into its index and
+ * hand back pointers straight into the mapping, so loading an asset is a page fault on first touch rather than
+ * an open, a read and a copy. Prefetching a group asks the kernel to start reading its pages in the background.
+ *
+ * Included by sdl_main.cpp after sdl_main.h
+ */
+
+#ifndef _WIN32
+#include<fcntl.h>
+#include<unistd.h>
+#include<sys/stat.h>
+#endif
+
+#include"asset_pack.h"
+
+struct PlatformAssetPack
+{
+    const uint8_t* data;    // the whole file, validated; NULL if there's no pack, and every lookup fails
+    uint64_t size;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
+};
+
+static void close_asset_pack(PlatformAssetPack* pack)
+{
+    if (!pack->data)
+    {
+        return;
+    }
+#ifdef _WIN32
+    UnmapViewOfFile(pack->data);
+    CloseHandle(pack->mapping);
+    CloseHandle(pack->file);
+#else
+    munmap((void*)pack->data, pack->size);
+#endif
+    pack->data = NULL;
+    pack->size = 0;
+}
+
+// Map and validate the pack; false (and an empty pack) if it's missing or broken, which isn't fatal
+static bool open_asset_pack(PlatformAssetPack* pack, const char* path)
+{
+    pack->data = NULL;
+    pack->size = 0;
+
+#ifdef _WIN32
+    pack->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (pack->file == INVALID_HANDLE_VALUE)
+    {
+        DEBUG_PRINTF("No asset pack at %s\n", path);
+        return false;
+    }
+    LARGE_INTEGER size;
+    pack->mapping = NULL;
+    if (GetFileSizeEx(pack->file, &size) && size.QuadPart > 0)
+    {
+        pack->mapping = CreateFileMappingA(pack->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    }
+    void* data = pack->mapping ? MapViewOfFile(pack->mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+    if (!data)
+    {
+        DEBUG_PRINTF("Couldn't map asset pack %s\n", path);
+        if (pack->mapping) CloseHandle(pack->mapping);
+        CloseHandle(pack->file);
+        return false;
+    }
+    uint64_t file_size = (uint64_t)size.QuadPart;
+#else
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        DEBUG_PRINTF("No asset pack at %s\n", path);
+        return false;
+    }
+    struct stat info;
+    void* data = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && info.st_size > 0)
+    {
+        data = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    // the mapping keeps the file open
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        DEBUG_PRINTF("Couldn't map asset pack %s\n", path);
+        return false;
+    }
+    uint64_t file_size = (uint64_t)info.st_size;
+#endif
+
+    pack->data = (const uint8_t*)data;
+    pack->size = file_size;
+    // touches the header and index; the asset data stays on disk until it's used
+    if (!validate_asset_pack(pack->data, pack->size))
+    {
+        DEBUG_PRINTF("%s isn't a valid asset pack (version %u expected)\n", path, ASSET_PACK_VERSION);
+        close_asset_pack(pack);
+        return false;
+    }
+
+    DEBUG_PRINTF("Asset pack %s: %u assets in %u groups, %llu bytes\n", path, ((const AssetPackHeader*)pack->data)->num_assets,
+                 ((const AssetPackHeader*)pack->data)->num_groups, (unsigned long long)pack->size);
+    return true;
+}
+
+static FUNC_PLATFORM_GET_ASSET(platform_get_asset)
+{
+    const AssetPackEntry* entry = pack->data ? find_asset_pack_entry(pack->data, id) : NULL;
+    if (!entry)
+    {
+        return NULL;
+    }
+    if (size)
+    {
+        *size = entry->size;
+    }
+    return pack->data + entry->offset;
+}
+
+static FUNC_PLATFORM_PREFETCH_ASSET_GROUP(platform_prefetch_asset_group)
+{
+    const AssetPackGroup* group = pack->data ? find_asset_pack_group(pack->data, id) : NULL;
+    if (!group || !group->size)
+    {
+        return group != NULL;
+    }
+
+#ifdef _WIN32
+    WIN32_MEMORY_RANGE_ENTRY range;
+    range.VirtualAddress = (void*)(pack->data + group->offset);
+    range.NumberOfBytes = (SIZE_T)group->size;
+    return PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0) != 0;
+#else
+    // madvise wants whole pages; the group's first and last page may be shared with its neighbours
+    uint64_t page_size = (uint64_t)sysconf(_SC_PAGESIZE);
+    uint64_t begin = group->offset & ~(page_size - 1);
+    uint64_t end = group->offset + group->size;
+    return madvise((void*)(pack->data + begin), (size_t)(end - begin), MADV_WILLNEED) == 0;
+#endif
+}
+
+
+#define SDL_ASSET_PACK_H
+#endif
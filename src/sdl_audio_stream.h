@@ -0,0 +1,397 @@
+#ifndef SDL_AUDIO_STREAM_H
+/*
+ * Audio streams: sound files decoded a chunk at a time on a platform thread
+ *
+ * Every stream has a fixed ring of decoded stereo frames (single producer: the stream thread; single consumer:
+ * whichever thread is making the sound). The stream thread tops each ring up to a read ahead worked out from how
+ * much sound the platform asks the game for at once, so it follows the latency controller: small device buffers
+ * keep little decoded, and a push mode write ahead of several buffers keeps more. While anything is playing it
+ * wakes about once per request's worth of sound, so a ring is refilled well before it can run dry; otherwise it
+ * sleeps until a stream is opened or closed.
+ *
+ * Included by sdl_main.cpp after sdl_main.h and sdl_file_io.h
+ */
+
+#include<stdio.h>
+#include<atomic>
+
+#include"audio_stream.h"
+
+static const int AUDIO_STREAM_INDEX_BITS = 3;
+static const int MAX_AUDIO_STREAMS = 1 << AUDIO_STREAM_INDEX_BITS;
+static const uint32_t AUDIO_STREAM_INDEX_MASK = MAX_AUDIO_STREAMS - 1;
+static const uint32_t AUDIO_STREAM_RING_FRAMES = 32768;     // power of 2; ~0.7s at 48kHz, 128KiB per stream
+static const uint32_t AUDIO_STREAM_CHUNK_FRAMES = 4096;     // most decoded per file read
+static const int AUDIO_STREAM_READ_AHEAD_MULTIPLE = 4;      // requests' worth of sound kept decoded, plus a chunk
+static const int MAX_AUDIO_STREAM_BYTES_PER_FRAME = 4;      // of file data; 16 bit stereo
+static const int WAV_HEADER_READ_SIZE = 4096;
+static_assert(IS_POWER_OF_2(AUDIO_STREAM_RING_FRAMES), "Stream ring size must be a power of 2");
+
+enum AudioStreamState
+{
+    AUDIO_STREAM_FREE,
+    AUDIO_STREAM_CLAIMED,   // being set up by platform_open_audio_stream
+    AUDIO_STREAM_OPENING,   // waiting for the stream thread to open the file
+    AUDIO_STREAM_PLAYING,
+    AUDIO_STREAM_FINISHED,  // everything is decoded; reads drain the ring
+    AUDIO_STREAM_FAILED,
+    AUDIO_STREAM_CLOSING,   // the stream thread frees it once the sound thread is out of it
+};
+
+struct PlatformAudioStreamSlot
+{
+    std::atomic<uint32_t> state;
+    // bumped every time the slot is taken, so a stale AudioStream can't read someone else's sound
+    std::atomic<uint32_t> generation;
+    std::atomic<bool> reading;      // the sound thread is in platform_read_audio_stream
+
+    char filename[MAX_PATH_LENGTH];
+    bool loop;
+
+    int16_t* frames;    // AUDIO_STREAM_RING_FRAMES stereo frames
+    alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> write_frame;     // stream thread only
+    alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> read_frame;      // sound thread only
+
+    // stream thread only
+    FILE* file;
+    AudioStreamFormat format;
+    uint64_t data_left;     // bytes before the end of the data (or the loop point)
+};
+
+struct PlatformAudioStreams
+{
+    PlatformAudioStreamSlot streams[MAX_AUDIO_STREAMS];
+    int samples_per_second;
+    std::atomic<int> request_frames;    // most sound the game is asked for at once
+    std::atomic<bool> quit;
+    std::atomic<uint32_t> underrun_count;   // reads from any stream that came up short while playing; reported by the latency controller
+    SDL_sem* wake;
+    SDL_Thread* thread;
+
+    int16_t* ring_memory;
+    uint8_t* read_buffer;   // stream thread's file data, before decoding
+};
+
+
+// NULL unless stream is a stream that's been opened (it may have finished or failed since)
+static PlatformAudioStreamSlot* get_audio_stream_slot(PlatformAudioStreams* streams, AudioStream stream)
+{
+    if (!stream)
+    {
+        return NULL;
+    }
+    PlatformAudioStreamSlot* slot = &streams->streams[stream & AUDIO_STREAM_INDEX_MASK];
+    uint32_t state = slot->state.load(std::memory_order_seq_cst);
+    if (slot->generation.load(std::memory_order_relaxed) != stream >> AUDIO_STREAM_INDEX_BITS ||
+        state == AUDIO_STREAM_FREE || state == AUDIO_STREAM_CLAIMED)
+    {
+        return NULL;
+    }
+    return slot;
+}
+
+// Open the file and find its samples; on the stream thread
+static bool start_audio_stream(PlatformAudioStreams* streams, PlatformAudioStreamSlot* stream)
+{
+    FILE* file = fopen(stream->filename, "rb");
+    if (!file)
+    {
+        DEBUG_PRINTF("Couldn't open audio stream %s\n", stream->filename);
+        return false;
+    }
+
+    uint8_t header[WAV_HEADER_READ_SIZE];
+    size_t header_size = fread(header, 1, sizeof(header), file);
+    if (!parse_wav_header(header, header_size, &stream->format))
+    {
+        DEBUG_PRINTF("Can't stream %s; only 16 bit PCM WAVs, mono or stereo\n", stream->filename);
+        fclose(file);
+        return false;
+    }
+    if (stream->format.samples_per_second != streams->samples_per_second)
+    {
+        DEBUG_PRINTF("Can't stream %s; it's %dHz, and streams aren't resampled from the output rate (%dHz)\n",
+                     stream->filename, stream->format.samples_per_second, streams->samples_per_second);
+        fclose(file);
+        return false;
+    }
+    if (FSEEK64(file, (int64_t)stream->format.data_offset, SEEK_SET))
+    {
+        fclose(file);
+        return false;
+    }
+
+    stream->file = file;
+    stream->data_left = stream->format.data_size;
+    return true;
+}
+
+// Decode until the ring holds the read ahead, or the data runs out; on the stream thread
+static void fill_audio_stream(PlatformAudioStreams* streams, PlatformAudioStreamSlot* stream)
+{
+    TIMED_FUNCTION();
+    const AudioStreamFormat* format = &stream->format;
+    uint32_t read_ahead = MIN((uint32_t)(AUDIO_STREAM_READ_AHEAD_MULTIPLE * streams->request_frames.load(std::memory_order_relaxed)) +
+                              AUDIO_STREAM_CHUNK_FRAMES, AUDIO_STREAM_RING_FRAMES);
+    bool rewound = false;   // nothing decoded since seeking back to the start; a loop with no data mustn't spin
+    for (;;)
+    {
+        uint32_t write_frame = stream->write_frame.load(std::memory_order_relaxed);
+        uint32_t buffered = write_frame - stream->read_frame.load(std::memory_order_acquire);
+        if (buffered >= read_ahead)
+        {
+            return;
+        }
+
+        if (!stream->data_left)
+        {
+            if (!stream->loop || rewound || FSEEK64(stream->file, (int64_t)format->data_offset, SEEK_SET))
+            {
+                uint32_t expected = AUDIO_STREAM_PLAYING;
+                stream->state.compare_exchange_strong(expected, AUDIO_STREAM_FINISHED, std::memory_order_release);
+                return;
+            }
+            stream->data_left = format->data_size;
+            rewound = true;
+        }
+
+        // as much as fits before the end of the ring; the rest goes at the start on the next time round
+        uint32_t index = write_frame & (AUDIO_STREAM_RING_FRAMES - 1);
+        uint32_t frames = MIN(AUDIO_STREAM_CHUNK_FRAMES, MIN(AUDIO_STREAM_RING_FRAMES - buffered, AUDIO_STREAM_RING_FRAMES - index));
+        uint64_t blocks = MIN((uint64_t)(frames / format->frames_per_block), stream->data_left / format->bytes_per_block);
+        size_t bytes = (size_t)blocks * format->bytes_per_block;
+        size_t read = fread(streams->read_buffer, 1, bytes, stream->file);
+        int read_blocks = (int)(read / format->bytes_per_block);
+        if (!read_blocks)
+        {
+            // the file is shorter than its header says, or unreadable: that's the end of the data, so a loop goes
+            // round again (from the top, so the check there stops it if it has just come from the start)
+            stream->data_left = 0;
+            continue;
+        }
+        // a short read is the end of the data, wherever the header said it was
+        stream->data_left = read < bytes ? 0 : stream->data_left - read;
+
+        int decoded = decode_audio_blocks(format, streams->read_buffer, read_blocks, &stream->frames[2 * index]);
+        stream->write_frame.store(write_frame + (uint32_t)decoded, std::memory_order_release);
+        rewound = false;
+    }
+}
+
+// Free a closed stream once the sound thread can't be reading it; on the stream thread
+static void release_audio_stream(PlatformAudioStreamSlot* stream)
+{
+    // pairs with platform_read_audio_stream: it sets reading before looking at the state
+    while (stream->reading.load(std::memory_order_seq_cst))
+    {
+        SDL_Delay(1);
+    }
+    if (stream->file)
+    {
+        fclose(stream->file);
+        stream->file = NULL;
+    }
+    stream->state.store(AUDIO_STREAM_FREE, std::memory_order_release);
+}
+
+static int audio_stream_thread_proc(void* data)
+{
+    PlatformAudioStreams* streams = (PlatformAudioStreams*)data;
+    NAME_PROFILE_THREAD("audio stream");
+
+    while (!streams->quit.load(std::memory_order_acquire))
+    {
+        bool playing = false;
+        for (int i = 0; i < MAX_AUDIO_STREAMS; ++i)
+        {
+            PlatformAudioStreamSlot* stream = &streams->streams[i];
+            uint32_t state = stream->state.load(std::memory_order_acquire);
+            if (state == AUDIO_STREAM_OPENING)
+            {
+                uint32_t started = start_audio_stream(streams, stream) ? AUDIO_STREAM_PLAYING : AUDIO_STREAM_FAILED;
+                // fails if it was closed in the meantime
+                stream->state.compare_exchange_strong(state, started, std::memory_order_acq_rel);
+                state = stream->state.load(std::memory_order_acquire);
+            }
+
+            if (state == AUDIO_STREAM_PLAYING)
+            {
+                fill_audio_stream(streams, stream);
+                playing = true;
+            }
+            else if (state == AUDIO_STREAM_CLOSING)
+            {
+                release_audio_stream(stream);
+            }
+        }
+
+        // opening or closing a stream wakes us early; with nothing playing, nothing else can need us until then
+        if (!playing)
+        {
+            SDL_SemWait(streams->wake);
+            continue;
+        }
+        int wait_ms = streams->request_frames.load(std::memory_order_relaxed) * 1000 / streams->samples_per_second;
+        SDL_SemWaitTimeout(streams->wake, (uint32_t)MAX(wait_ms, 1));
+    }
+    return 0;
+}
+
+static FUNC_PLATFORM_OPEN_AUDIO_STREAM(platform_open_audio_stream)
+{
+    if (strlen(filename) >= (size_t)MAX_PATH_LENGTH)
+    {
+        return 0;
+    }
+
+    for (int i = 0; i < MAX_AUDIO_STREAMS; ++i)
+    {
+        PlatformAudioStreamSlot* slot = &streams->streams[i];
+        uint32_t state = AUDIO_STREAM_FREE;
+        if (!slot->state.compare_exchange_strong(state, AUDIO_STREAM_CLAIMED, std::memory_order_acquire))
+        {
+            continue;
+        }
+
+        uint32_t generation = (slot->generation.load(std::memory_order_relaxed) + 1) & (~0U >> AUDIO_STREAM_INDEX_BITS);
+        generation = generation ? generation : 1;
+        slot->generation.store(generation, std::memory_order_relaxed);
+
+        strcpy(slot->filename, filename);
+        slot->loop = loop;
+        slot->file = NULL;
+        slot->write_frame.store(0, std::memory_order_relaxed);
+        slot->read_frame.store(0, std::memory_order_relaxed);
+        slot->state.store(AUDIO_STREAM_OPENING, std::memory_order_release);
+        SDL_SemPost(streams->wake);
+
+        return (generation << AUDIO_STREAM_INDEX_BITS) | (uint32_t)i;
+    }
+
+    return 0;
+}
+
+static FUNC_PLATFORM_CLOSE_AUDIO_STREAM(platform_close_audio_stream)
+{
+    PlatformAudioStreamSlot* slot = get_audio_stream_slot(streams, stream);
+    if (!slot)
+    {
+        return;
+    }
+    uint32_t state = slot->state.load(std::memory_order_seq_cst);
+    // the stream thread may be moving it on from opening or playing at the same time
+    while (state != AUDIO_STREAM_CLOSING && state != AUDIO_STREAM_FREE &&
+           !slot->state.compare_exchange_weak(state, AUDIO_STREAM_CLOSING, std::memory_order_seq_cst))
+    {
+    }
+    SDL_SemPost(streams->wake);
+}
+
+static FUNC_PLATFORM_READ_AUDIO_STREAM(platform_read_audio_stream)
+{
+    if (!stream)
+    {
+        return -1;
+    }
+    PlatformAudioStreamSlot* slot = &streams->streams[stream & AUDIO_STREAM_INDEX_MASK];
+    // keeps the stream thread from freeing the slot until we're done with it
+    slot->reading.store(true, std::memory_order_seq_cst);
+
+    int result = -1;
+    uint32_t state = slot->state.load(std::memory_order_seq_cst);
+    if (slot->generation.load(std::memory_order_relaxed) == stream >> AUDIO_STREAM_INDEX_BITS &&
+        (state == AUDIO_STREAM_OPENING || state == AUDIO_STREAM_PLAYING || state == AUDIO_STREAM_FINISHED))
+    {
+        uint32_t read_frame = slot->read_frame.load(std::memory_order_relaxed);
+        uint32_t available = slot->write_frame.load(std::memory_order_acquire) - read_frame;
+        int count = (int)MIN((uint32_t)num_frames, available);
+
+        // 2 pieces if it wraps
+        uint32_t index = read_frame & (AUDIO_STREAM_RING_FRAMES - 1);
+        int count_1 = (int)MIN((uint32_t)count, AUDIO_STREAM_RING_FRAMES - index);
+        memcpy(frames, &slot->frames[2 * index], (size_t)count_1 * 2 * sizeof(int16_t));
+        memcpy(&frames[2 * count_1], slot->frames, (size_t)(count - count_1) * 2 * sizeof(int16_t));
+        slot->read_frame.store(read_frame + (uint32_t)count, std::memory_order_release);
+
+        if (state == AUDIO_STREAM_PLAYING && count < num_frames)
+        {
+            streams->underrun_count.fetch_add(1, std::memory_order_relaxed);
+        }
+        // running low before the stream thread's next wake up; a post never blocks
+        if (state == AUDIO_STREAM_PLAYING && available - (uint32_t)count < 2 * (uint32_t)streams->request_frames.load(std::memory_order_relaxed))
+        {
+            SDL_SemPost(streams->wake);
+        }
+        // finished streams are done once they've played everything they decoded
+        result = (state == AUDIO_STREAM_FINISHED && count == 0) ? -1 : count;
+    }
+
+    slot->reading.store(false, std::memory_order_release);
+    return result;
+}
+
+static void init_audio_streams(PlatformAudioStreams* streams, int samples_per_second, int request_frames)
+{
+    streams->samples_per_second = samples_per_second;
+    streams->request_frames = request_frames;
+    streams->quit = false;
+    streams->underrun_count = 0;
+
+    size_t ring_size = (size_t)MAX_AUDIO_STREAMS * AUDIO_STREAM_RING_FRAMES * 2 * sizeof(int16_t);
+    size_t read_buffer_size = (size_t)AUDIO_STREAM_CHUNK_FRAMES * MAX_AUDIO_STREAM_BYTES_PER_FRAME;
+    streams->ring_memory = (int16_t*)LARGE_ALLOC(ring_size);
+    streams->read_buffer = (uint8_t*)LARGE_ALLOC(read_buffer_size);
+    if (!streams->ring_memory || !streams->read_buffer)
+    {
+        FATAL_PRINTF("Couldn't allocate audio stream buffers\n");
+    }
+    for (int i = 0; i < MAX_AUDIO_STREAMS; ++i)
+    {
+        PlatformAudioStreamSlot* slot = &streams->streams[i];
+        slot->state = AUDIO_STREAM_FREE;
+        slot->generation = 0;
+        slot->reading = false;
+        slot->frames = streams->ring_memory + (size_t)i * AUDIO_STREAM_RING_FRAMES * 2;
+        slot->file = NULL;
+    }
+
+    streams->wake = SDL_CreateSemaphore(0);
+    if (!streams->wake)
+    {
+        FATAL_PRINTF("Couldn't create audio stream semaphore - SDL_Error: %s\n", SDL_GetError());
+    }
+    streams->thread = SDL_CreateThread(audio_stream_thread_proc, "audio stream", streams);
+    if (!streams->thread)
+    {
+        FATAL_PRINTF("Couldn't create audio stream thread - SDL_Error: %s\n", SDL_GetError());
+    }
+}
+
+// Set how much sound the game is asked for at once; streams read ahead a few times this
+static inline void set_audio_stream_request_frames(PlatformAudioStreams* streams, int request_frames)
+{
+    streams->request_frames.store(request_frames, std::memory_order_relaxed);
+}
+
+// Nothing may be reading streams any more (the audio device is closed)
+static void free_audio_streams(PlatformAudioStreams* streams)
+{
+    streams->quit.store(true, std::memory_order_release);
+    SDL_SemPost(streams->wake);
+    SDL_WaitThread(streams->thread, NULL);
+
+    for (int i = 0; i < MAX_AUDIO_STREAMS; ++i)
+    {
+        if (streams->streams[i].file)
+        {
+            fclose(streams->streams[i].file);
+        }
+    }
+    SDL_DestroySemaphore(streams->wake);
+    LARGE_FREE(streams->ring_memory, (size_t)MAX_AUDIO_STREAMS * AUDIO_STREAM_RING_FRAMES * 2 * sizeof(int16_t));
+    LARGE_FREE(streams->read_buffer, (size_t)AUDIO_STREAM_CHUNK_FRAMES * MAX_AUDIO_STREAM_BYTES_PER_FRAME);
+}
+
+
+#define SDL_AUDIO_STREAM_H
+#endif
@@ -0,0 +1,657 @@
+#ifndef SDL_FILE_IO_H
+/*
+ * Asynchronous file I/O for game code
+ *
+ * Every request takes a slot until the game collects its result. A request opens the file, transfers
+ * (again and again on short reads/writes), closes the file, then is finished.
+ * On linux this runs on io_uring (raw syscalls; no liburing): each step is one submission, and a completion
+ * thread submits the next step as each one completes, so a request costs one syscall per step and no thread time.
+ * Elsewhere, when built against io_uring headers too old for the probe, or on kernels without io_uring or the
+ * opcodes we need, a few worker threads do the same steps with blocking stdio calls.
+ *
+ * Included by sdl_main.cpp after sdl_main.h
+ */
+
+#include<stdio.h>
+#include<errno.h>
+#include<atomic>
+
+#ifdef __linux__
+#if __has_include(<linux/io_uring.h>)
+#include<fcntl.h>
+#include<unistd.h>
+#include<sys/syscall.h>
+#include<linux/io_uring.h>
+// the opcodes are enums, so test for the probe flag that came with them (5.6 headers); older headers get the workers
+#if defined(IO_URING_OP_SUPPORTED) && defined(__NR_io_uring_setup) && defined(__NR_io_uring_register)
+#define USE_IO_URING
+#endif
+#endif
+#endif
+
+#ifdef _WIN32
+#define FSEEK64 _fseeki64
+#else
+#define FSEEK64 fseeko
+#endif
+
+static const int FILE_REQUEST_INDEX_BITS = 6;
+static const int MAX_FILE_REQUESTS = 1 << FILE_REQUEST_INDEX_BITS;     // in flight, or finished but not collected
+static const uint32_t FILE_REQUEST_INDEX_MASK = MAX_FILE_REQUESTS - 1;
+static const int FILE_IO_WORKERS = 2;
+// most a single read/write syscall is asked to move; bigger requests just take more steps
+static const uint64_t MAX_FILE_TRANSFER = 1 << 30;
+
+enum FileRequestState
+{
+    FILE_REQUEST_FREE,
+    FILE_REQUEST_BUSY,
+    FILE_REQUEST_FINISHED,  // result is ready for the game
+};
+
+enum FileRequestStep
+{
+    FILE_STEP_OPEN,
+    FILE_STEP_TRANSFER,
+    FILE_STEP_CLOSE,
+};
+
+struct FileRequestSlot
+{
+    std::atomic<uint32_t> state;
+    // bumped every time the slot is taken, so a stale FileRequest can't collect someone else's result
+    std::atomic<uint32_t> generation;
+
+    bool write;
+    char filename[MAX_PATH_LENGTH];
+    uint8_t* buffer;
+    uint64_t offset;
+    uint64_t size;
+
+    // progress; only touched by whichever thread is running the request
+    FileRequestStep step;
+    int fd;
+    uint64_t transferred;
+    FileError error;
+
+    FileResult result;
+};
+
+#ifdef USE_IO_URING
+struct IoUring
+{
+    int fd;
+    uint32_t entries;
+
+    uint32_t* sq_head;
+    uint32_t* sq_tail;
+    uint32_t sq_mask;
+    uint32_t* sq_array;
+    io_uring_sqe* sqes;
+
+    uint32_t* cq_head;
+    uint32_t* cq_tail;
+    uint32_t cq_mask;
+    io_uring_cqe* cqes;
+
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;          // same as sq_ring with IORING_FEAT_SINGLE_MMAP
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+// at least one per request (each has one step in flight at a time), plus the wake up at shutdown
+static const uint32_t IO_URING_ENTRIES = 2 * MAX_FILE_REQUESTS;
+// user_data of the no-op that tells the completion thread to quit
+static const uint64_t IO_URING_QUIT = ~0ULL;
+#endif
+
+struct PlatformFileQueue
+{
+    FileRequestSlot slots[MAX_FILE_REQUESTS];
+    SDL_sem* finished;      // posted every time a request finishes, for platform_wait_file
+    std::atomic<bool> quit;
+    bool use_io_uring;
+
+#ifdef USE_IO_URING
+    IoUring ring;
+    SDL_mutex* submit_mutex;    // the game and the completion thread both submit
+    SDL_Thread* completion_thread;
+#endif
+
+    // worker fallback: slot indices waiting for a worker, in order
+    SDL_mutex* pending_mutex;
+    SDL_sem* pending_count;
+    int pending[MAX_FILE_REQUESTS];
+    uint32_t pending_read;
+    uint32_t pending_write;
+    SDL_Thread* workers[FILE_IO_WORKERS];
+};
+
+
+static FileError file_error_from_errno(int error)
+{
+    switch (error)
+    {
+        case ENOENT:
+        case ENOTDIR:
+            return FILE_ERROR_NOT_FOUND;
+        case EACCES:
+        case EPERM:
+        case EROFS:
+            return FILE_ERROR_ACCESS_DENIED;
+        default:
+            return FILE_ERROR_IO;
+    }
+}
+
+static void finish_file_request(PlatformFileQueue* queue, FileRequestSlot* slot)
+{
+    slot->result.error = slot->error;
+    slot->result.bytes = (int64_t)slot->transferred;
+    slot->state.store(FILE_REQUEST_FINISHED, std::memory_order_release);
+    SDL_SemPost(queue->finished);
+}
+
+// NULL unless request is a live request
+static FileRequestSlot* get_file_request_slot(PlatformFileQueue* queue, FileRequest request)
+{
+    if (!request)
+    {
+        return NULL;
+    }
+    FileRequestSlot* slot = &queue->slots[request & FILE_REQUEST_INDEX_MASK];
+    if (slot->generation.load(std::memory_order_relaxed) != request >> FILE_REQUEST_INDEX_BITS ||
+        slot->state.load(std::memory_order_relaxed) == FILE_REQUEST_FREE)
+    {
+        return NULL;
+    }
+    return slot;
+}
+
+
+#ifdef USE_IO_URING
+static inline int io_uring_enter(int fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+// Set up the ring; false (with nothing left open) if the kernel can't do what we need
+static bool init_io_uring(IoUring* ring, uint32_t entries)
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+    {
+        DEBUG_PRINTF("io_uring not available (%s)\n", strerror(errno));
+        return false;
+    }
+
+    // openat/close/read/write arrived in 5.6, along with the probe; older kernels fail the probe itself
+    alignas(8) uint8_t probe_memory[sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op)];
+    memset(probe_memory, 0, sizeof(probe_memory));
+    io_uring_probe* probe = (io_uring_probe*)probe_memory;
+    bool supported = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    const uint8_t needed_ops[] = {IORING_OP_NOP, IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE};
+    for (size_t i = 0; supported && i < sizeof(needed_ops); ++i)
+    {
+        supported = needed_ops[i] <= probe->last_op && (probe->ops[needed_ops[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    if (!supported)
+    {
+        DEBUG_PRINTF("io_uring doesn't support file opcodes on this kernel\n");
+        close(ring->fd);
+        return false;
+    }
+
+    ring->entries = params.sq_entries;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ring->sq_ring_size = ring->cq_ring_size = MAX(ring->sq_ring_size, ring->cq_ring_size);
+    }
+    ring->sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = ring->sq_ring;
+    if (ring->sq_ring != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    }
+    ring->sqes = (io_uring_sqe*)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        DEBUG_PRINTF("Couldn't map io_uring (%s)\n", strerror(errno));
+        if (ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+        if (ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_size);
+        if (ring->sq_ring != MAP_FAILED) munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->fd);
+        return false;
+    }
+
+    uint8_t* sq = (uint8_t*)ring->sq_ring;
+    ring->sq_head = (uint32_t*)(sq + params.sq_off.head);
+    ring->sq_tail = (uint32_t*)(sq + params.sq_off.tail);
+    ring->sq_mask = *(uint32_t*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (uint32_t*)(sq + params.sq_off.array);
+
+    uint8_t* cq = (uint8_t*)ring->cq_ring;
+    ring->cq_head = (uint32_t*)(cq + params.cq_off.head);
+    ring->cq_tail = (uint32_t*)(cq + params.cq_off.tail);
+    ring->cq_mask = *(uint32_t*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    return true;
+}
+
+static void free_io_uring(IoUring* ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring)
+    {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+// Queue and submit one entry; user_data is the slot index
+static void submit_io_uring(PlatformFileQueue* queue, uint8_t opcode, int fd, uint64_t addr, uint32_t len, uint64_t offset, uint32_t open_flags, uint64_t user_data)
+{
+    IoUring* ring = &queue->ring;
+    SDL_LockMutex(queue->submit_mutex);
+
+    uint32_t tail = *ring->sq_tail;     // we're the only producer
+    // can't be full; every request has at most one entry in flight
+    DEBUG_ASSERT(tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) < ring->entries);
+    uint32_t index = tail & ring->sq_mask;
+    io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = addr;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->open_flags = open_flags;
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    int submitted;
+    do
+    {
+        submitted = io_uring_enter(ring->fd, 1, 0, 0);
+    } while (submitted < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY));
+    if (submitted < 0)
+    {
+        // still queued; goes in with the next submission
+        DEBUG_PRINTF("io_uring_enter failed (%s)\n", strerror(errno));
+    }
+
+    SDL_UnlockMutex(queue->submit_mutex);
+}
+
+// Submit whatever the slot's current step is
+static void submit_file_step(PlatformFileQueue* queue, FileRequestSlot* slot)
+{
+    uint64_t index = (uint64_t)(slot - queue->slots);
+    switch (slot->step)
+    {
+        case FILE_STEP_OPEN:
+        {
+            uint32_t flags = O_CLOEXEC | (slot->write ? O_WRONLY | O_CREAT | O_TRUNC : O_RDONLY);
+            submit_io_uring(queue, IORING_OP_OPENAT, AT_FDCWD, (uint64_t)slot->filename, 0666, 0, flags, index);
+        } break;
+        case FILE_STEP_TRANSFER:
+        {
+            uint32_t length = (uint32_t)MIN(slot->size - slot->transferred, MAX_FILE_TRANSFER);
+            submit_io_uring(queue, slot->write ? IORING_OP_WRITE : IORING_OP_READ, slot->fd, (uint64_t)(slot->buffer + slot->transferred),
+                            length, slot->offset + slot->transferred, 0, index);
+        } break;
+        case FILE_STEP_CLOSE:
+        {
+            submit_io_uring(queue, IORING_OP_CLOSE, slot->fd, 0, 0, 0, 0, index);
+        } break;
+    }
+}
+
+// A step finished with res (a result or -errno); on to the next one
+static void advance_file_request(PlatformFileQueue* queue, FileRequestSlot* slot, int32_t res)
+{
+    switch (slot->step)
+    {
+        case FILE_STEP_OPEN:
+        {
+            if (res < 0)
+            {
+                slot->error = file_error_from_errno(-res);
+                finish_file_request(queue, slot);
+                return;
+            }
+            slot->fd = res;
+            slot->step = slot->size ? FILE_STEP_TRANSFER : FILE_STEP_CLOSE;
+        } break;
+        case FILE_STEP_TRANSFER:
+        {
+            if (res < 0)
+            {
+                slot->error = file_error_from_errno(-res);
+                slot->step = FILE_STEP_CLOSE;
+            }
+            else if (res == 0)
+            {
+                // end of file for a read; a write that makes no progress is an error
+                slot->error = slot->write ? FILE_ERROR_IO : FILE_OK;
+                slot->step = FILE_STEP_CLOSE;
+            }
+            else
+            {
+                slot->transferred += (uint64_t)res;
+                if (slot->transferred == slot->size)
+                {
+                    slot->step = FILE_STEP_CLOSE;
+                }
+            }
+        } break;
+        case FILE_STEP_CLOSE:
+        {
+            // a failed close can mean a write never made it to disk
+            if (res < 0 && slot->write && slot->error == FILE_OK)
+            {
+                slot->error = FILE_ERROR_IO;
+            }
+            finish_file_request(queue, slot);
+            return;
+        }
+    }
+    submit_file_step(queue, slot);
+}
+
+static int file_completion_thread_proc(void* data)
+{
+    PlatformFileQueue* queue = (PlatformFileQueue*)data;
+    IoUring* ring = &queue->ring;
+    NAME_PROFILE_THREAD("file io");
+
+    for (;;)
+    {
+        if (io_uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+        {
+            DEBUG_PRINTF("io_uring_enter failed (%s)\n", strerror(errno));
+            SDL_Delay(1);
+        }
+
+        uint32_t head = *ring->cq_head;     // we're the only consumer
+        uint32_t tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        bool quit = false;
+        for (; head != tail; ++head)
+        {
+            io_uring_cqe* cqe = &ring->cqes[head & ring->cq_mask];
+            if (cqe->user_data == IO_URING_QUIT)
+            {
+                quit = true;
+                continue;
+            }
+            TIMED_BLOCK("advance_file_request");
+            advance_file_request(queue, &queue->slots[cqe->user_data], cqe->res);
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+        if (quit)
+        {
+            return 0;
+        }
+    }
+}
+#endif  // USE_IO_URING
+
+
+// Worker fallback: run every step of the request, blocking
+static void run_file_request(FileRequestSlot* slot)
+{
+    TIMED_FUNCTION();
+
+    FILE* file = fopen(slot->filename, slot->write ? "wb" : "rb");
+    if (!file)
+    {
+        slot->error = file_error_from_errno(errno);
+        return;
+    }
+
+    if (!slot->write && slot->offset && FSEEK64(file, (int64_t)slot->offset, SEEK_SET))
+    {
+        slot->error = file_error_from_errno(errno);
+    }
+    while (slot->error == FILE_OK && slot->transferred < slot->size)
+    {
+        size_t length = (size_t)MIN(slot->size - slot->transferred, MAX_FILE_TRANSFER);
+        size_t transferred = slot->write ? fwrite(slot->buffer + slot->transferred, 1, length, file)
+                                         : fread(slot->buffer + slot->transferred, 1, length, file);
+        slot->transferred += transferred;
+        if (transferred < length)
+        {
+            if (ferror(file))
+            {
+                slot->error = file_error_from_errno(errno);
+            }
+            break;  // end of file
+        }
+    }
+
+    if (fclose(file) && slot->write && slot->error == FILE_OK)
+    {
+        slot->error = FILE_ERROR_IO;
+    }
+}
+
+static int file_worker_thread_proc(void* data)
+{
+    PlatformFileQueue* queue = (PlatformFileQueue*)data;
+    NAME_PROFILE_THREAD("file io");
+
+    for (;;)
+    {
+        SDL_SemWait(queue->pending_count);
+        if (queue->quit.load(std::memory_order_acquire))
+        {
+            return 0;
+        }
+
+        SDL_LockMutex(queue->pending_mutex);
+        int index = queue->pending[queue->pending_read++ & FILE_REQUEST_INDEX_MASK];
+        SDL_UnlockMutex(queue->pending_mutex);
+
+        run_file_request(&queue->slots[index]);
+        finish_file_request(queue, &queue->slots[index]);
+    }
+}
+
+
+// Take a free slot and start the request in it; 0 if there's no room
+static FileRequest start_file_request(PlatformFileQueue* queue, bool write, const char* filename, uint64_t offset, void* buffer, uint64_t size)
+{
+    if (strlen(filename) >= (size_t)MAX_PATH_LENGTH)
+    {
+        return 0;
+    }
+
+    for (int i = 0; i < MAX_FILE_REQUESTS; ++i)
+    {
+        FileRequestSlot* slot = &queue->slots[i];
+        uint32_t state = FILE_REQUEST_FREE;
+        if (!slot->state.compare_exchange_strong(state, FILE_REQUEST_BUSY, std::memory_order_acquire))
+        {
+            continue;
+        }
+
+        uint32_t generation = (slot->generation.load(std::memory_order_relaxed) + 1) & (~0U >> FILE_REQUEST_INDEX_BITS);
+        generation = generation ? generation : 1;
+        slot->generation.store(generation, std::memory_order_relaxed);
+
+        slot->write = write;
+        strcpy(slot->filename, filename);
+        slot->buffer = (uint8_t*)buffer;
+        slot->offset = offset;
+        slot->size = size;
+        slot->step = FILE_STEP_OPEN;
+        slot->fd = -1;
+        slot->transferred = 0;
+        slot->error = FILE_OK;
+
+#ifdef USE_IO_URING
+        if (queue->use_io_uring)
+        {
+            submit_file_step(queue, slot);
+        }
+        else
+#endif
+        {
+            SDL_LockMutex(queue->pending_mutex);
+            queue->pending[queue->pending_write++ & FILE_REQUEST_INDEX_MASK] = i;
+            SDL_UnlockMutex(queue->pending_mutex);
+            SDL_SemPost(queue->pending_count);
+        }
+
+        return (generation << FILE_REQUEST_INDEX_BITS) | (uint32_t)i;
+    }
+
+    return 0;
+}
+
+static FUNC_PLATFORM_READ_FILE(platform_read_file)
+{
+    return start_file_request(queue, false, filename, offset, buffer, size);
+}
+
+static FUNC_PLATFORM_WRITE_FILE(platform_write_file)
+{
+    // writes always start at the beginning of a truncated file
+    return start_file_request(queue, true, filename, 0, (void*)buffer, size);
+}
+
+static FUNC_PLATFORM_POLL_FILE(platform_poll_file)
+{
+    FileRequestSlot* slot = get_file_request_slot(queue, request);
+    if (!slot)
+    {
+        result->error = FILE_ERROR_INVALID_REQUEST;
+        result->bytes = 0;
+        return true;
+    }
+    if (slot->state.load(std::memory_order_acquire) != FILE_REQUEST_FINISHED)
+    {
+        return false;
+    }
+
+    *result = slot->result;
+    slot->state.store(FILE_REQUEST_FREE, std::memory_order_release);
+    return true;
+}
+
+static FUNC_PLATFORM_WAIT_FILE(platform_wait_file)
+{
+    TIMED_FUNCTION();
+    while (!platform_poll_file(queue, request, result))
+    {
+        // posted when any request finishes, and someone else may have taken the post; hence the timeout
+        SDL_SemWaitTimeout(queue->finished, 1);
+    }
+}
+
+static void init_file_queue(PlatformFileQueue* queue, bool allow_io_uring)
+{
+    for (int i = 0; i < MAX_FILE_REQUESTS; ++i)
+    {
+        queue->slots[i].state = FILE_REQUEST_FREE;
+        queue->slots[i].generation = 0;
+    }
+    queue->quit = false;
+    queue->pending_read = 0;
+    queue->pending_write = 0;
+
+    queue->finished = SDL_CreateSemaphore(0);
+    if (!queue->finished)
+    {
+        FATAL_PRINTF("Couldn't create file queue semaphore - SDL_Error: %s\n", SDL_GetError());
+    }
+
+    queue->use_io_uring = false;
+#ifdef USE_IO_URING
+    if (allow_io_uring && init_io_uring(&queue->ring, IO_URING_ENTRIES))
+    {
+        queue->submit_mutex = SDL_CreateMutex();
+        if (!queue->submit_mutex)
+        {
+            FATAL_PRINTF("Couldn't create file queue mutex - SDL_Error: %s\n", SDL_GetError());
+        }
+        queue->completion_thread = SDL_CreateThread(file_completion_thread_proc, "file io", queue);
+        if (!queue->completion_thread)
+        {
+            FATAL_PRINTF("Couldn't create file completion thread - SDL_Error: %s\n", SDL_GetError());
+        }
+        queue->use_io_uring = true;
+        DEBUG_PRINTF("File I/O: io_uring\n");
+        return;
+    }
+#endif
+
+    queue->pending_mutex = SDL_CreateMutex();
+    queue->pending_count = SDL_CreateSemaphore(0);
+    if (!queue->pending_mutex || !queue->pending_count)
+    {
+        FATAL_PRINTF("Couldn't create file queue - SDL_Error: %s\n", SDL_GetError());
+    }
+    for (int i = 0; i < FILE_IO_WORKERS; ++i)
+    {
+        queue->workers[i] = SDL_CreateThread(file_worker_thread_proc, "file io", queue);
+        if (!queue->workers[i])
+        {
+            FATAL_PRINTF("Couldn't create file worker thread - SDL_Error: %s\n", SDL_GetError());
+        }
+    }
+    DEBUG_PRINTF("File I/O: %d worker threads\n", FILE_IO_WORKERS);
+}
+
+// Lets everything in flight finish first, so no write is cut short
+static void free_file_queue(PlatformFileQueue* queue)
+{
+    for (int i = 0; i < MAX_FILE_REQUESTS; ++i)
+    {
+        while (queue->slots[i].state.load(std::memory_order_acquire) == FILE_REQUEST_BUSY)
+        {
+            SDL_SemWaitTimeout(queue->finished, 1);
+        }
+    }
+
+    queue->quit.store(true, std::memory_order_release);
+#ifdef USE_IO_URING
+    if (queue->use_io_uring)
+    {
+        submit_io_uring(queue, IORING_OP_NOP, -1, 0, 0, 0, 0, IO_URING_QUIT);
+        SDL_WaitThread(queue->completion_thread, NULL);
+        SDL_DestroyMutex(queue->submit_mutex);
+        free_io_uring(&queue->ring);
+    }
+    else
+#endif
+    {
+        for (int i = 0; i < FILE_IO_WORKERS; ++i)
+        {
+            SDL_SemPost(queue->pending_count);
+        }
+        for (int i = 0; i < FILE_IO_WORKERS; ++i)
+        {
+            SDL_WaitThread(queue->workers[i], NULL);
+        }
+        SDL_DestroySemaphore(queue->pending_count);
+        SDL_DestroyMutex(queue->pending_mutex);
+    }
+    SDL_DestroySemaphore(queue->finished);
+}
+
+
+#define SDL_FILE_IO_H
+#endif
@@ -0,0 +1,328 @@
+#ifndef SDL_FRAME_SCHEDULER_H
+/*
+ * Frame pacing
+ *
+ * Sleeps until just before each frame deadline with an absolute-time sleep (clock_nanosleep on Linux, a high
+ * resolution waitable timer on Windows), then spins for the last little bit.
+ * How early to wake is measured: it's the scheduler's recent oversleep, learned at startup and on every frame.
+ * Also keeps a histogram of frame times and counts missed deadlines.
+ * The frame rate governor steps the target rate down (60 -> 45 -> 30 at 60 Hz) when frames don't fit, and back up
+ * when there's room again.
+ *
+ * Included by sdl_main.cpp after sdl_main.h and sdl_work_queue.h (for CPU_RELAX)
+ */
+
+#ifdef _WIN32
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
+#else
+#include<time.h>
+#include<errno.h>
+#endif
+
+static const int FRAME_HISTOGRAM_BUCKETS = 100;
+static const int64_t FRAME_HISTOGRAM_BUCKET_NS = 500000;    // 0.5ms; the last bucket is everything from 49.5ms up
+static const int64_t MIN_FRAME_SPIN_NS = 200000;            // always spin at least this long at the end
+static const int64_t MIN_SLEEP_SLACK_NS = 50000;
+static const int64_t MAX_SLEEP_SLACK_NS = 4000000;
+static const int SLEEP_SLACK_CALIBRATION_SLEEPS = 10;
+
+// rates the governor can pick, in quarters of the base rate
+static const int FRAME_RATE_STEP_QUARTERS[] = {4, 3, 2};
+static const int FRAME_RATE_STEPS = (int)SIZE_OF_ARRAY(FRAME_RATE_STEP_QUARTERS);
+static const int FRAME_RATE_DOWN_WINDOW = 30;           // frames
+static const int FRAME_RATE_DOWN_MISSES = 3;            // missed deadlines within a window that make us step down
+static const int FRAME_RATE_UP_FRAMES = 180;            // frames in a row with headroom before stepping up
+static const int64_t FRAME_RATE_UP_HEADROOM_PERCENT = 75;   // work has to fit in this much of the faster rate's frame
+
+struct FrameScheduler
+{
+    int64_t frame_ns;           // target frame duration
+    int64_t next_deadline;      // absolute, get_time_ns()
+    int64_t last_frame_end;
+    int64_t sleep_slack_ns;     // how late sleeps have been waking up lately
+    int64_t start_time;
+
+    // the frame just finished
+    int64_t last_frame_ns;      // start to start; how much real time the simulation has to catch up on
+    int64_t last_work_ns;       // start until we started waiting
+    bool missed_last_deadline;
+
+    uint64_t frame_count;
+    uint64_t missed_deadlines;  // frames whose work ran past the deadline
+    int64_t max_frame_ns;
+    uint32_t histogram[FRAME_HISTOGRAM_BUCKETS];
+
+#ifdef _WIN32
+    HANDLE timer;
+#endif
+};
+
+// Monotonic, in nanoseconds; the same clock the sleeps use
+static inline int64_t get_time_ns()
+{
+#ifdef _WIN32
+    static LARGE_INTEGER frequency;
+    if (!frequency.QuadPart)
+    {
+        QueryPerformanceFrequency(&frequency);
+    }
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return (int64_t)((double)counter.QuadPart * 1e9 / (double)frequency.QuadPart);
+#else
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (int64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+#endif
+}
+
+// Sleep until get_time_ns() >= deadline, give or take the scheduler
+static void sleep_until_ns(FrameScheduler* scheduler, int64_t deadline)
+{
+#ifdef _WIN32
+    int64_t remaining = deadline - get_time_ns();
+    if (remaining <= 0)
+    {
+        return;
+    }
+    if (scheduler->timer)
+    {
+        // relative, in 100ns units
+        LARGE_INTEGER due;
+        due.QuadPart = -(remaining / 100);
+        if (SetWaitableTimer(scheduler->timer, &due, 0, NULL, NULL, FALSE))
+        {
+            WaitForSingleObject(scheduler->timer, INFINITE);
+            return;
+        }
+    }
+    Sleep((DWORD)(remaining / 1000000));
+#else
+    struct timespec t;
+    t.tv_sec = (time_t)(deadline / 1000000000);
+    t.tv_nsec = (long)(deadline % 1000000000);
+    // absolute, so being interrupted and going back to sleep doesn't push the deadline back
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL) == EINTR)
+    {
+    }
+#endif
+}
+
+static inline void set_frame_rate(FrameScheduler* scheduler, int frames_per_second)
+{
+    scheduler->frame_ns = 1000000000 / frames_per_second;
+}
+
+static void init_frame_scheduler(FrameScheduler* scheduler, int frames_per_second)
+{
+    memset(scheduler, 0, sizeof(FrameScheduler));
+    set_frame_rate(scheduler, frames_per_second);
+
+#ifdef _WIN32
+    scheduler->timer = CreateWaitableTimerExW(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+    if (!scheduler->timer)
+    {
+        // older than Windows 10 1803; Sleep it is, at 1ms resolution
+        timeBeginPeriod(1);
+    }
+#endif
+
+    // how late does a 1ms sleep wake up?
+    int64_t slack = MIN_SLEEP_SLACK_NS;
+    for (int i = 0; i < SLEEP_SLACK_CALIBRATION_SLEEPS; ++i)
+    {
+        int64_t deadline = get_time_ns() + 1000000;
+        sleep_until_ns(scheduler, deadline);
+        slack = MAX(slack, get_time_ns() - deadline);
+    }
+    scheduler->sleep_slack_ns = MIN(slack, MAX_SLEEP_SLACK_NS);
+    DEBUG_PRINTF("Frame scheduler: %.3fms frames, sleeps wake up to %.3fms late\n",
+        (double)scheduler->frame_ns / 1e6, (double)scheduler->sleep_slack_ns / 1e6);
+
+    scheduler->start_time = get_time_ns();
+    scheduler->last_frame_end = scheduler->start_time;
+    scheduler->next_deadline = scheduler->last_frame_end + scheduler->frame_ns;
+    // the first frame gets the target as its dt
+    scheduler->last_frame_ns = scheduler->frame_ns;
+}
+
+static void free_frame_scheduler(FrameScheduler* scheduler)
+{
+#ifdef _WIN32
+    if (scheduler->timer)
+    {
+        CloseHandle(scheduler->timer);
+    }
+    else
+    {
+        timeEndPeriod(1);
+    }
+#endif
+}
+
+// Wait out the rest of the frame; returns the time the next frame starts
+static int64_t wait_for_next_frame(FrameScheduler* scheduler)
+{
+    int64_t now = get_time_ns();
+    scheduler->last_work_ns = now - scheduler->last_frame_end;
+    scheduler->missed_last_deadline = now > scheduler->next_deadline;
+    if (scheduler->missed_last_deadline)
+    {
+        // too late; start the next frame now rather than trying to catch up with short frames
+        scheduler->missed_deadlines++;
+        scheduler->next_deadline = now;
+    }
+    else
+    {
+        int64_t wake_time = scheduler->next_deadline - scheduler->sleep_slack_ns - MIN_FRAME_SPIN_NS;
+        if (wake_time > now)
+        {
+            sleep_until_ns(scheduler, wake_time);
+            now = get_time_ns();
+
+            // jump up to a new worst case straight away, decay slowly when sleeps are better than that
+            int64_t oversleep = now - wake_time;
+            if (oversleep > scheduler->sleep_slack_ns)
+            {
+                scheduler->sleep_slack_ns = oversleep;
+            }
+            else
+            {
+                scheduler->sleep_slack_ns -= (scheduler->sleep_slack_ns - oversleep) / 16;
+            }
+            scheduler->sleep_slack_ns = MIN(MAX(scheduler->sleep_slack_ns, MIN_SLEEP_SLACK_NS), MAX_SLEEP_SLACK_NS);
+        }
+
+        while (now < scheduler->next_deadline)
+        {
+            CPU_RELAX();
+            now = get_time_ns();
+        }
+    }
+
+    int64_t frame_ns = now - scheduler->last_frame_end;
+    int bucket = (int)MIN(frame_ns / FRAME_HISTOGRAM_BUCKET_NS, (int64_t)FRAME_HISTOGRAM_BUCKETS - 1);
+    scheduler->histogram[bucket]++;
+    scheduler->max_frame_ns = MAX(scheduler->max_frame_ns, frame_ns);
+    scheduler->frame_count++;
+
+    scheduler->last_frame_ns = frame_ns;
+    scheduler->last_frame_end = now;
+    scheduler->next_deadline += scheduler->frame_ns;
+    return now;
+}
+
+struct FrameRateGovernor
+{
+    int base_rate;      // fastest rate; the display's or target_framerate
+    int step;           // index into FRAME_RATE_STEP_QUARTERS
+    int frame_rate;
+
+    int window_frames;
+    int window_misses;
+    int headroom_frames;
+};
+
+static void init_frame_rate_governor(FrameRateGovernor* governor, int base_rate)
+{
+    memset(governor, 0, sizeof(FrameRateGovernor));
+    governor->base_rate = base_rate;
+    governor->frame_rate = base_rate;
+}
+
+static inline int get_frame_rate_for_step(FrameRateGovernor* governor, int step)
+{
+    return governor->base_rate * FRAME_RATE_STEP_QUARTERS[step] / 4;
+}
+
+// Call after every wait_for_next_frame; returns true if frame_rate changed
+static bool update_frame_rate_governor(FrameRateGovernor* governor, FrameScheduler* scheduler)
+{
+    int new_step = governor->step;
+
+    // down: too many misses in a window
+    governor->window_frames++;
+    governor->window_misses += scheduler->missed_last_deadline ? 1 : 0;
+    if (governor->window_misses >= FRAME_RATE_DOWN_MISSES)
+    {
+        new_step = MIN(governor->step + 1, FRAME_RATE_STEPS - 1);
+    }
+    if (governor->window_frames >= FRAME_RATE_DOWN_WINDOW)
+    {
+        governor->window_frames = 0;
+        governor->window_misses = 0;
+    }
+
+    // up: every frame for a while would have fit in the faster rate, with room to spare
+    if (governor->step > 0 && new_step == governor->step)
+    {
+        int64_t faster_frame_ns = 1000000000 / get_frame_rate_for_step(governor, governor->step - 1);
+        if (scheduler->last_work_ns * 100 < faster_frame_ns * FRAME_RATE_UP_HEADROOM_PERCENT)
+        {
+            if (++governor->headroom_frames >= FRAME_RATE_UP_FRAMES)
+            {
+                new_step = governor->step - 1;
+            }
+        }
+        else
+        {
+            governor->headroom_frames = 0;
+        }
+    }
+
+    if (new_step == governor->step)
+    {
+        return false;
+    }
+
+    governor->step = new_step;
+    governor->frame_rate = get_frame_rate_for_step(governor, new_step);
+    governor->window_frames = 0;
+    governor->window_misses = 0;
+    governor->headroom_frames = 0;
+    set_frame_rate(scheduler, governor->frame_rate);
+    return true;
+}
+
+// Frame time (upper edge of its histogram bucket) that fraction of frames came in under
+static inline double get_frame_time_percentile_ms(FrameScheduler* scheduler, double fraction)
+{
+    uint64_t target = (uint64_t)((double)scheduler->frame_count * fraction);
+    uint64_t count = 0;
+    for (int i = 0; i < FRAME_HISTOGRAM_BUCKETS; ++i)
+    {
+        count += scheduler->histogram[i];
+        if (count > target)
+        {
+            return (double)((i + 1) * FRAME_HISTOGRAM_BUCKET_NS) / 1e6;
+        }
+    }
+    return (double)scheduler->max_frame_ns / 1e6;
+}
+
+static void print_frame_times(FrameScheduler* scheduler, bool full_histogram)
+{
+    DEBUG_PRINTF("Frames: %llu, missed deadlines: %llu, target %.2fms, p50 %.1fms, p99 %.1fms, max %.2fms, sleep slack %.3fms\n",
+        (unsigned long long)scheduler->frame_count, (unsigned long long)scheduler->missed_deadlines,
+        (double)scheduler->frame_ns / 1e6,
+        get_frame_time_percentile_ms(scheduler, 0.5), get_frame_time_percentile_ms(scheduler, 0.99),
+        (double)scheduler->max_frame_ns / 1e6, (double)scheduler->sleep_slack_ns / 1e6);
+
+    if (full_histogram)
+    {
+        for (int i = 0; i < FRAME_HISTOGRAM_BUCKETS; ++i)
+        {
+            if (scheduler->histogram[i])
+            {
+                DEBUG_PRINTF("  %5.1f-%5.1fms: %u\n", (double)(i * FRAME_HISTOGRAM_BUCKET_NS) / 1e6,
+                    (double)((i + 1) * FRAME_HISTOGRAM_BUCKET_NS) / 1e6, scheduler->histogram[i]);
+            }
+        }
+    }
+}
+
+
+#define SDL_FRAME_SCHEDULER_H
+#endif
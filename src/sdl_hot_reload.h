@@ -0,0 +1,374 @@
+#ifndef SDL_HOT_RELOAD_H
+/*
+ * Hot reloading game code without a hitch
+ *
+ * A reload thread watches the directory the game object is built into (inotify on Linux, a change notification
+ * on Windows) and waits for writes to the object to settle. Then it copies it (copy_file_range, falling back to
+ * sendfile) and loads the copy with all its entry points.
+ * The main loop swaps the new GameCode in at a frame boundary and hands the old object back to be unloaded,
+ * so the frame thread never touches the disk or the dynamic loader.
+ * Copies alternate between two names, so a new copy never overwrites the one that's loaded.
+ *
+ * Included by sdl_main.cpp after sdl_main.h
+ */
+
+#ifndef _WIN32
+#include<sys/inotify.h>
+#include<sys/sendfile.h>
+#include<sys/stat.h>
+#include<fcntl.h>
+#include<poll.h>
+#include<unistd.h>
+#include<errno.h>
+#include<elf.h>
+#endif
+
+static const uint32_t RELOAD_SETTLE_MS = 200;   // quiet time after the last write before loading; linkers write in bursts
+static const int RELOAD_POLL_MS = 50;           // how often the reload thread checks for requests and quit
+
+struct GameCodeReloader
+{
+    SDL_Thread* thread;
+    std::atomic<bool> quit;
+    std::atomic<bool> reload_requested;     // reload now, without waiting for a change (k key)
+
+    char object_path[MAX_PATH_LENGTH];
+    char copy_paths[2][MAX_PATH_LENGTH];
+    int next_copy;      // the copy that isn't loaded; reload thread only, once it's started
+
+    // handoff: the main thread owns each of these while its flag is set, the reload thread otherwise
+    GameCode ready_code;
+    std::atomic<bool> ready;        // loaded, waiting to be swapped in
+    GameCode retired_code;
+    std::atomic<bool> retired;      // swapped out, waiting to be unloaded
+
+#ifdef _WIN32
+    HANDLE change_notification;
+    FILETIME last_write_time;
+#else
+    int inotify_fd;
+#endif
+};
+
+static void init_game_code_reloader(GameCodeReloader* reloader, const char* directory)
+{
+    DEBUG_ASSERT(strlen(directory) + strlen(GAME_CODE_OBJECT_FILE) + 3 < (size_t)MAX_PATH_LENGTH);
+    SDL_strlcpy(reloader->object_path, directory, MAX_PATH_LENGTH);
+    SDL_strlcat(reloader->object_path, GAME_CODE_OBJECT_FILE, MAX_PATH_LENGTH);
+    for (int i = 0; i < 2; ++i)
+    {
+        SDL_strlcpy(reloader->copy_paths[i], directory, MAX_PATH_LENGTH);
+        SDL_strlcat(reloader->copy_paths[i], i ? "_1_" : "_0_", MAX_PATH_LENGTH);
+        SDL_strlcat(reloader->copy_paths[i], GAME_CODE_OBJECT_FILE, MAX_PATH_LENGTH);
+    }
+    reloader->next_copy = 0;
+    reloader->quit = false;
+    reloader->reload_requested = false;
+    reloader->ready = false;
+    reloader->retired = false;
+
+#ifdef _WIN32
+    reloader->change_notification = FindFirstChangeNotificationA(directory, FALSE, FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME);
+    if (reloader->change_notification == INVALID_HANDLE_VALUE)
+    {
+        DEBUG_PRINTF("Couldn't watch %s for changes; press k to reload\n", directory);
+    }
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+    if (GetFileAttributesExA(reloader->object_path, GetFileExInfoStandard, &attributes))
+    {
+        reloader->last_write_time = attributes.ftLastWriteTime;
+    }
+#else
+    // the directory rather than the file: builds often replace the file (a new inode) rather than write to it
+    reloader->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (reloader->inotify_fd < 0 || inotify_add_watch(reloader->inotify_fd, directory, IN_CLOSE_WRITE | IN_MODIFY | IN_MOVED_TO | IN_CREATE) < 0)
+    {
+        DEBUG_PRINTF("Couldn't watch %s for changes (%s); press k to reload\n", directory, strerror(errno));
+    }
+#endif
+}
+
+#ifndef _WIN32
+// A half written object can look fine to dlopen, which then maps segments past the end of the file and dies
+// with SIGBUS when it touches them; check every segment and the section headers (last thing written) are there
+static bool game_object_complete(int fd, int64_t size)
+{
+    Elf64_Ehdr header;
+    if (pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) || memcmp(header.e_ident, ELFMAG, SELFMAG) != 0 ||
+        header.e_ident[EI_CLASS] != ELFCLASS64 || header.e_phentsize != sizeof(Elf64_Phdr))
+    {
+        return false;
+    }
+    if ((int64_t)(header.e_shoff + (uint64_t)header.e_shnum * header.e_shentsize) > size ||
+        (int64_t)(header.e_phoff + (uint64_t)header.e_phnum * header.e_phentsize) > size)
+    {
+        return false;
+    }
+    for (int i = 0; i < header.e_phnum; ++i)
+    {
+        Elf64_Phdr segment;
+        if (pread(fd, &segment, sizeof(segment), (off_t)(header.e_phoff + (uint64_t)i * sizeof(segment))) != (ssize_t)sizeof(segment) ||
+            (int64_t)(segment.p_offset + segment.p_filesz) > size)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+#endif
+
+// Copy to a new file, so whatever had the old one loaded at that path keeps its pages
+static bool copy_game_object(const char* from, const char* to)
+{
+#ifdef _WIN32
+    // fails if to is still loaded, rather than corrupting it
+    if (!CopyFileA(from, to, FALSE))
+    {
+        DEBUG_PRINTF("Couldn't copy %s to %s (error %lu)\n", from, to, GetLastError());
+        return false;
+    }
+    return true;
+#else
+    int in = open(from, O_RDONLY | O_CLOEXEC);
+    if (in < 0)
+    {
+        DEBUG_PRINTF("Couldn't open %s: %s\n", from, strerror(errno));
+        return false;
+    }
+    struct stat in_stat;
+    if (fstat(in, &in_stat))
+    {
+        DEBUG_PRINTF("Couldn't stat %s: %s\n", from, strerror(errno));
+        close(in);
+        return false;
+    }
+    if (!game_object_complete(in, (int64_t)in_stat.st_size))
+    {
+        DEBUG_PRINTF("%s is incomplete; the build is probably still writing it\n", from);
+        close(in);
+        return false;
+    }
+    unlink(to);
+    int out = open(to, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0755);
+    if (out < 0)
+    {
+        DEBUG_PRINTF("Couldn't create %s: %s\n", to, strerror(errno));
+        close(in);
+        return false;
+    }
+
+    // in the kernel, no buffer of ours; copy_file_range can even share extents on filesystems that support it
+    int64_t remaining = (int64_t)in_stat.st_size;
+    bool use_sendfile = false;
+    while (remaining > 0)
+    {
+        ssize_t copied = use_sendfile ? sendfile(out, in, NULL, (size_t)remaining) : copy_file_range(in, NULL, out, NULL, (size_t)remaining, 0);
+        if (copied < 0 && !use_sendfile && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP))
+        {
+            // older kernels, or across filesystems; both calls use the file offsets, so carry on from here
+            use_sendfile = true;
+            continue;
+        }
+        if (copied < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (copied <= 0)
+        {
+            // 0 means the file got shorter under us; the build is still writing it
+            DEBUG_PRINTF("Couldn't copy %s to %s: %s\n", from, to, copied ? strerror(errno) : "file shrank");
+            close(in);
+            close(out);
+            return false;
+        }
+        remaining -= copied;
+    }
+    close(in);
+    if (close(out))
+    {
+        DEBUG_PRINTF("Couldn't write %s: %s\n", to, strerror(errno));
+        return false;
+    }
+    return true;
+#endif
+}
+
+// Copy the game object and load every entry point from the copy; false (and nothing loaded) on any error
+static bool load_game_object(GameCodeReloader* reloader, GameCode* code)
+{
+    const char* copy_path = reloader->copy_paths[reloader->next_copy];
+    if (!copy_game_object(reloader->object_path, copy_path))
+    {
+        return false;
+    }
+
+    GameCode new_code{};
+    new_code.object = SDL_LoadObject(copy_path);
+    if (!new_code.object)
+    {
+        DEBUG_PRINTF("%s\n", SDL_GetError());
+        return false;
+    }
+    new_code.init_memory = (GameInitMemory*) SDL_LoadFunction(new_code.object, "game_init_memory");
+    new_code.update = (GameUpdate*) SDL_LoadFunction(new_code.object, "game_update");
+    new_code.render = (GameRender*) SDL_LoadFunction(new_code.object, "game_render");
+    new_code.get_sound_samples = (GameGetSoundSamples*) SDL_LoadFunction(new_code.object, "game_get_sound_samples");
+    if (!new_code.init_memory || !new_code.update || !new_code.render || !new_code.get_sound_samples)
+    {
+        DEBUG_PRINTF("%s\n", SDL_GetError());
+        SDL_UnloadObject(new_code.object);
+        return false;
+    }
+
+    *code = new_code;
+    reloader->next_copy ^= 1;
+    return true;
+}
+
+// Waits up to timeout_ms; true if the game object was written to, created or replaced
+static bool wait_for_game_object_change(GameCodeReloader* reloader, int timeout_ms)
+{
+#ifdef _WIN32
+    if (reloader->change_notification == INVALID_HANDLE_VALUE)
+    {
+        SDL_Delay(timeout_ms);
+        return false;
+    }
+    if (WaitForSingleObject(reloader->change_notification, (DWORD)timeout_ms) != WAIT_OBJECT_0)
+    {
+        return false;
+    }
+    FindNextChangeNotification(reloader->change_notification);
+    // something in the directory changed; see if it was the object (our own copies land here too)
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+    if (!GetFileAttributesExA(reloader->object_path, GetFileExInfoStandard, &attributes) ||
+        CompareFileTime(&attributes.ftLastWriteTime, &reloader->last_write_time) == 0)
+    {
+        return false;
+    }
+    reloader->last_write_time = attributes.ftLastWriteTime;
+    return true;
+#else
+    if (reloader->inotify_fd < 0)
+    {
+        SDL_Delay(timeout_ms);
+        return false;
+    }
+    struct pollfd poll_fd{reloader->inotify_fd, POLLIN, 0};
+    if (poll(&poll_fd, 1, timeout_ms) <= 0)
+    {
+        return false;
+    }
+
+    bool changed = false;
+    alignas(struct inotify_event) char buffer[4096];
+    for (;;)
+    {
+        ssize_t length = read(reloader->inotify_fd, buffer, sizeof(buffer));
+        if (length <= 0)
+        {
+            break;
+        }
+        for (char* p = buffer; p < buffer + length;)
+        {
+            struct inotify_event* event = (struct inotify_event*)p;
+            // our own copies land here too
+            if (event->len && strcmp(event->name, GAME_CODE_OBJECT_FILE) == 0)
+            {
+                changed = true;
+            }
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    return changed;
+#endif
+}
+
+static int reload_thread_proc(void* data)
+{
+    GameCodeReloader* reloader = (GameCodeReloader*)data;
+    NAME_PROFILE_THREAD("reload");
+
+    bool changed = false;
+    uint32_t last_change_time = 0;
+    while (!reloader->quit.load(std::memory_order_acquire))
+    {
+        if (reloader->retired.load(std::memory_order_acquire))
+        {
+            TIMED_BLOCK("unload_game_code");
+            SDL_UnloadObject(reloader->retired_code.object);
+            reloader->retired.store(false, std::memory_order_release);
+        }
+
+        if (wait_for_game_object_change(reloader, RELOAD_POLL_MS))
+        {
+            changed = true;
+            last_change_time = SDL_GetTicks();
+        }
+
+        // the retired object is at the path the next copy goes to, so it has to be gone first
+        bool settled = changed && SDL_GetTicks() - last_change_time >= RELOAD_SETTLE_MS;
+        bool requested = reloader->reload_requested.load(std::memory_order_acquire);
+        if ((settled || requested) && !reloader->ready.load(std::memory_order_acquire) && !reloader->retired.load(std::memory_order_acquire))
+        {
+            changed = false;
+            reloader->reload_requested.store(false, std::memory_order_relaxed);
+
+            TIMED_BLOCK("load_game_code");
+            if (load_game_object(reloader, &reloader->ready_code))
+            {
+                reloader->ready.store(true, std::memory_order_release);
+            }
+            else
+            {
+                // half written, or it doesn't link; keep running the old code until the next change
+                DEBUG_PRINTF("Game code reload failed; still running the old code\n");
+            }
+        }
+    }
+    return 0;
+}
+
+static void start_game_code_reloader(GameCodeReloader* reloader)
+{
+    reloader->thread = SDL_CreateThread(reload_thread_proc, "reload", reloader);
+    if (!reloader->thread)
+    {
+        FATAL_PRINTF("Couldn't create reload thread - SDL_Error: %s\n", SDL_GetError());
+    }
+}
+
+static void stop_game_code_reloader(GameCodeReloader* reloader)
+{
+    if (reloader->thread)
+    {
+        reloader->quit.store(true, std::memory_order_release);
+        SDL_WaitThread(reloader->thread, NULL);
+        reloader->thread = NULL;
+    }
+    if (reloader->ready.load(std::memory_order_acquire))
+    {
+        SDL_UnloadObject(reloader->ready_code.object);
+        reloader->ready = false;
+    }
+    if (reloader->retired.load(std::memory_order_acquire))
+    {
+        SDL_UnloadObject(reloader->retired_code.object);
+        reloader->retired = false;
+    }
+#ifdef _WIN32
+    if (reloader->change_notification != INVALID_HANDLE_VALUE)
+    {
+        FindCloseChangeNotification(reloader->change_notification);
+    }
+#else
+    if (reloader->inotify_fd >= 0)
+    {
+        close(reloader->inotify_fd);
+    }
+#endif
+}
+
+
+#define SDL_HOT_RELOAD_H
+#endif
@@ -3,29 +3,61 @@
  */
 
 #include"sdl_main.h"
+#include"sdl_work_queue.h"
+#include"sdl_file_io.h"
+#include"sdl_asset_pack.h"
+#include"sdl_audio_stream.h"
+#include"sdl_frame_scheduler.h"
+#include"sdl_profiler.h"
+#include"sdl_hot_reload.h"
 
 static bool running = true;
-static bool do_load_game_code = false;
 
 static char* executable_path;
-// TODO something something string handling, allocator for strings possibly...not sure
-// for now use these for fiddling with paths
-static char tmp_path_1[MAX_PATH_LENGTH];
-static char tmp_path_2[MAX_PATH_LENGTH];
 
 
 // Rendering stuff
 static SDL_Window* window = NULL;
 static SDL_Renderer* renderer = NULL;
 static SDL_Texture* texture = NULL;
+static bool zero_copy_present = true;   // the game draws straight into locked texture memory; --texture-copy to turn off
 static const int BYTES_PER_PIXEL = 4;
-// TODO dynamic or adjustable
+// fastest frame rate; the governor steps down from here when frames don't fit (unless --fixed-rate)
 static int target_framerate = 60;
-// TODO recompute based on framerate
-static float target_frame_ms = 1000.0F/(float)target_framerate;
+static bool lock_to_display_refresh_rate = false;    // --lock-refresh; use the display's rate instead of target_framerate
+static bool variable_frame_rate = true;
+static FrameScheduler frame_scheduler;
+static FrameRateGovernor frame_rate_governor;
+static const int FRAME_REPORT_SECONDS = 10;
+// game_update runs at tick_hz whatever the frame rate; render interpolates between ticks
+static const int DEFAULT_TICK_HZ = 60;
+// after a long stall (debugger, window drag) the rest is dropped rather than spending ever longer frames catching up
+static const int MAX_TICKS_PER_FRAME = 5;
+static SimulationClock simulation_clock;
+// depth > 1 makes frame N+1 on a game thread while frame N is uploaded and presented, for depth - 1 frames of latency
+static const int DEFAULT_PIPELINE_DEPTH = 2;
+static FramePipeline frame_pipeline;
+// the render buffer follows the window size, scaled down when drawing and uploading it takes too much of the frame
+static ResolutionScaler resolution_scaler;
+static const float MIN_RENDER_SCALE = 0.5F;
+static const float RENDER_SCALE_STEP = 0.05F;
+static const int MIN_RENDER_WIDTH = 160;
+static const int MIN_RENDER_HEIGHT = 90;
+static const int RESOLUTION_WINDOW_FRAMES = 30;
+// share of the frame the resolution dependent work should take; above SHRINK we scale down, below GROW for
+// QUIET_WINDOWS_TO_GROW windows in a row we try a step up
+static const float RESOLUTION_SHRINK_LOAD = 0.6F;
+static const float RESOLUTION_GROW_LOAD = 0.35F;
+static const int RESOLUTION_QUIET_WINDOWS_TO_GROW = 4;
+static HeadlessRun headless;
+static InputScript input_script;
+#ifdef PROFILER
+static const char* trace_file_path = "trace.json";  // --trace-file <path>; written by --trace N and the t key
+#endif
 
 // Audio stuff
-// TODO BUG/weird issues - audio skips during some OS interactions; holding on window X, typing in search box...arg
+// Audio skips during some OS interactions (holding on window X, typing in search box...); the latency controller
+// grows the buffers when that happens, and fades out instead of clicking when the data runs out
 // From cursory research, it seems to be okay to lag anywhere from 3-9 frames before audio latency is noticeable
 // However we still want to minimize it without causing skips etc
 
@@ -33,15 +65,15 @@ static float target_frame_ms = 1000.0F/(float)target_framerate;
 
 static const int AUDIO_SAMPLES_PER_SECOND = 48000;
 
-// TODO this number is pretty crucial
-// if it's too low, the audio callback has to run very frequently, blocking the main loop
+// The device buffer size is pretty crucial
+// if it's too low, the audio callback has to run very frequently, and the OS may not get to it in time
 // if it's too high, the callback runs less frequently and the play index is less accurate
-// it should possibly be tuned at startup, or even at runtime? (have to close and open the audio device)
 // e.g. 512 means that the play cursor updates every 10ms
-// To mitigate this we take averages of stuff
-static const int SDL_AUDIO_BUFFER_SAMPLES = 256;    // must be power of 2
-static const int AUDIO_RING_BUFFER_SIZE_SAMPLES = AUDIO_SAMPLES_PER_SECOND;
-static const int APPROX_AUDIO_SAMPLES_PER_FRAME = AUDIO_SAMPLES_PER_SECOND / target_framerate;
+// To mitigate this we take averages of stuff, and the latency controller tunes it at runtime (reopening the device)
+static const int INITIAL_SDL_AUDIO_BUFFER_SAMPLES = 256;    // all of these must be powers of 2
+static const int MIN_SDL_AUDIO_BUFFER_SAMPLES = 128;
+static const int MAX_SDL_AUDIO_BUFFER_SAMPLES = 2048;
+static const int AUDIO_RING_BUFFER_SIZE_SAMPLES = 65536; // must be power of 2; ~1.4s
 static const int NUM_AUDIO_CHANNELS = 2;
 static const int AUDIO_SAMPLE_SIZE = (AUDIO_S16SYS & SDL_AUDIO_MASK_BITSIZE) / BITS_PER_BYTE; //in bytes
 static const int BYTES_PER_AUDIO_SAMPLE = AUDIO_SAMPLE_SIZE * NUM_AUDIO_CHANNELS;
@@ -49,24 +81,88 @@ static const int BYTES_PER_AUDIO_SAMPLE = AUDIO_SAMPLE_SIZE * NUM_AUDIO_CHANNELS
 static SDL_AudioDeviceID audio_device_id = 0;
 static SDL_AudioSpec audio_settings;
 static AudioRingBuffer audio_ring_buffer{};
+static AudioWriteState audio_write_state{};
+static AudioCallbackStats audio_stats{};
+static uint64_t audio_callback_period = 0;  // performance counter ticks per device buffer; only changes while the device is closed
+
+// Latency controller
+static AudioLatencyController audio_latency{};
+// Pull mode fades out ahead of a skip once a callback leaves less than this fraction of a device buffer to spare
+// (push mode fades once the ring buffer holds less than one more device buffer)
+static const int PULL_FADE_MARGIN_DIVISOR = 4;
+static const int MIN_SAFETY_BUFFERS = 1;
+static const int MAX_SAFETY_BUFFERS = 4;
+static const int AUDIO_LATENCY_WINDOW_MS = 1000;
+static const int INITIAL_QUIET_WINDOWS_TO_SHRINK = 10;
+static const int MAX_QUIET_WINDOWS_TO_SHRINK = 120;
+static FILE* audio_stats_file = NULL;      // csv, one row per window; --audio-stats <path>
+
+static int game_sound_buffer_max_size = 0;
+// Use this to compute how far ahead we should write audio (also determines our audio latency)
+static const int SAMPLES_PER_FRAME_COUNT = 30;
+
+// Pull: the audio callback asks the game for exactly the samples it's about to play (lowest latency)
+// Push: the main loop writes a frame or two ahead into the ring buffer, and the callback copies from that
+enum AudioMode
+{
+    AUDIO_MODE_PULL,
+    AUDIO_MODE_PUSH
+};
+static AudioMode audio_mode = AUDIO_MODE_PULL;
+static_assert(IS_POWER_OF_2(AUDIO_RING_BUFFER_SIZE_SAMPLES) && IS_POWER_OF_2(BYTES_PER_AUDIO_SAMPLE), "Ring buffer size must be a power of 2");
 
 // Input stuff
 // indices in this array correspond to indices of ControllerInput structs in GameInput
 // the keyboard is the last index in the array (not in this array, only in ControllerInput)
 static const int MAX_GAMECONTROLLERS = MAX_CONTROLLERS - 1;
 static SDL_GameController* controller_handles[MAX_GAMECONTROLLERS];
+// Gamepads are polled on the input thread at poll_hz, or once per frame on the main thread if that's 0
+// Keyboard and mouse come from SDL events on the main thread either way; those are already timestamped by the OS
+static InputThread input_thread;
+static const int DEFAULT_INPUT_POLL_HZ = 1000;
+static uint64_t last_input_time = 0;    // performance counter when the current GameInput was started
 
 // Stuff passed to game
 static GameCode game_code{
     NULL,
     game_init_memory_stub,
-    game_update_and_render_stub
+    game_update_stub,
+    game_render_stub,
+    game_get_sound_samples_stub
 };
+static GameCodeReloader game_code_reloader;
+static PlatformAssetPack asset_pack;
+static PlatformAudioStreams audio_streams;
 static GameMemory game_memory{};
-static GameInputBuffer game_input_buffer{};
-static GameRenderBuffer game_render_buffer{};
+static GameInputBuffer game_input_buffer{};         // gathered into on the main thread
+static GameInputBuffer simulation_input_buffer{};   // what game_update sees; its own history, taken from the above
 static GameSoundBuffer game_sound_buffer{};
 
+// Threads
+static PlatformWorkQueue work_queue;
+static PlatformFileQueue file_queue;
+
+
+#ifdef PREFAULT_BUFFERS
+// Touch every page now so the first frame (or the audio thread) doesn't take the page faults,
+// and lock them so they stay resident
+static void prefault_buffer(void* memory, uint64_t size, const char* name)
+{
+    static const uint64_t PAGE_SIZE = KIBIBYTES(4);
+    volatile uint8_t* bytes = (volatile uint8_t*)memory;
+    for (uint64_t i = 0; i < size; i += PAGE_SIZE)
+    {
+        // write, not just read; reading an untouched anonymous page only maps the shared zero page
+        bytes[i] = bytes[i];
+    }
+    if (!LOCK_MEMORY(memory, size))
+    {
+        DEBUG_PRINTF("Couldn't lock %s in memory (%llu bytes)\n", name, (unsigned long long)size);
+    }
+}
+#else
+#define prefault_buffer(MEMORY, SIZE, NAME)
+#endif
 
 static FUNC_DEBUG_PLATFORM_READ_ENTIRE_FILE(DEBUG_platform_read_entire_file)
 {
@@ -134,70 +230,268 @@ static FUNC_DEBUG_PLATFORM_WRITE_ENTIRE_FILE(DEBUG_platform_write_entire_file)
 }
 
 
-static void load_game_code()
+// Resolution
+
+static void update_render_size(ResolutionScaler* scaler)
+{
+    // windows bigger than the pool are drawn at the pool size, keeping the aspect ratio
+    float fit = MIN(1.0F, MIN((float)scaler->max_width / (float)scaler->window_width, (float)scaler->max_height / (float)scaler->window_height));
+    float scale = scaler->scale * fit;
+    // whole groups of 4 pixels keep the rows of the render kernels aligned
+    int width = (int)((float)scaler->window_width * scale) & ~3;
+    int height = (int)((float)scaler->window_height * scale);
+    scaler->width = MIN(MAX(width, MIN_RENDER_WIDTH), scaler->max_width);
+    scaler->height = MIN(MAX(height, MIN_RENDER_HEIGHT), scaler->max_height);
+}
+
+static void init_resolution_scaler(ResolutionScaler* scaler, bool dynamic, int window_width, int window_height, int max_width, int max_height)
+{
+    scaler->dynamic = dynamic;
+    scaler->scale = 1.0F;
+    scaler->window_width = MAX(window_width, 1);
+    scaler->window_height = MAX(window_height, 1);
+    scaler->max_width = max_width;
+    scaler->max_height = max_height;
+    scaler->window_work_ns = 0;
+    scaler->window_frames = 0;
+    scaler->quiet_windows = 0;
+    update_render_size(scaler);
+}
+
+static void set_resolution_window_size(ResolutionScaler* scaler, int window_width, int window_height)
+{
+    scaler->window_width = MAX(window_width, 1);
+    scaler->window_height = MAX(window_height, 1);
+    update_render_size(scaler);
+}
+
+// Called with the game render and upload time of each frame that was drawn; returns true if the resolution changed
+static bool update_resolution_scaler(ResolutionScaler* scaler, int64_t work_ns, int64_t frame_ns)
 {
-    if (game_code.object)
+    if (!scaler->dynamic)
+    {
+        return false;
+    }
+    scaler->window_work_ns += work_ns;
+    if (++scaler->window_frames < RESOLUTION_WINDOW_FRAMES)
     {
-        SDL_UnloadObject(game_code.object);
-        game_code = GameCode{};
+        return false;
     }
 
-    // Copy dll so it can be rebuilt at runtime
+    float load = (float)scaler->window_work_ns / (float)scaler->window_frames / (float)frame_ns;
+    scaler->window_work_ns = 0;
+    scaler->window_frames = 0;
 
-    // Make paths
-    uint64_t executable_path_len = strlen(executable_path);
-    DEBUG_ASSERT((executable_path_len + strlen(GAME_CODE_OBJECT_FILE) + 1) < MAX_PATH_LENGTH);
+    float scale = scaler->scale;
+    if (load > RESOLUTION_SHRINK_LOAD)
+    {
+        // the work goes with the pixel count, so the square root gives the scale that lands between the thresholds
+        scale *= sqrtf((RESOLUTION_SHRINK_LOAD + RESOLUTION_GROW_LOAD) * 0.5F / load);
+        scale = MAX(scale, MIN_RENDER_SCALE);
+        scaler->quiet_windows = 0;
+    }
+    else if (load < RESOLUTION_GROW_LOAD && ++scaler->quiet_windows >= RESOLUTION_QUIET_WINDOWS_TO_GROW)
+    {
+        scale = MIN(scale + RENDER_SCALE_STEP, 1.0F);
+        scaler->quiet_windows = 0;
+    }
+    else if (load >= RESOLUTION_GROW_LOAD)
+    {
+        scaler->quiet_windows = 0;
+    }
 
-    char * obj_path = tmp_path_1;
-    char * obj_copy_path = tmp_path_2;
-    SDL_strlcpy(obj_path, executable_path, MAX_PATH_LENGTH);
-    SDL_strlcpy(obj_copy_path, executable_path, MAX_PATH_LENGTH);
-    SDL_strlcat(obj_path, GAME_CODE_OBJECT_FILE, MAX_PATH_LENGTH);
-    SDL_strlcat(obj_copy_path, "_" GAME_CODE_OBJECT_FILE, MAX_PATH_LENGTH);
+    int old_width = scaler->width;
+    int old_height = scaler->height;
+    scaler->scale = scale;
+    update_render_size(scaler);
+    return scaler->width != old_width || scaler->height != old_height;
+}
 
-    // Do the copy
-    int64_t size;
-    void * data = DEBUG_platform_read_entire_file(obj_path, &size);
-    DEBUG_platform_write_entire_file(obj_copy_path, data, (int32_t)size);
-    DEBUG_platform_free_file_memory(data);
+static void unlock_frame_texture(PipelineFrame* frame)
+{
+    if (frame->locked)
+    {
+        SDL_UnlockTexture(frame->texture);
+        frame->locked = false;
+    }
+}
 
-    // Load the code
-    game_code.object = SDL_LoadObject(obj_copy_path);
-    if (!game_code.object)
+// Upload what changed and draw it to the back buffer; returns the number of pixels uploaded
+static int64_t render_offscreen_buffer(PipelineFrame* frame)
+{
+    TIMED_FUNCTION();
+    GameRenderBuffer* b = &frame->render_buffer;
+    SDL_Texture* frame_texture = frame->texture;
+    int64_t uploaded_pixels = 0;
+    if (frame_texture)
     {
-        FATAL_PRINTF("%s\n", SDL_GetError());
+        // unlocking is where the renderer takes the pixels, if it has to move them at all; it's all or nothing
+        unlock_frame_texture(frame);
+        uploaded_pixels = (int64_t)b->width * b->height;
+    }
+    else
+    {
+        DEBUG_ASSERT(texture);
+        // the texture still has the last frame presented, so only the changes go up
+        for (int i = 0; i < b->num_dirty_rects; ++i)
+        {
+            RenderRect* r = &b->dirty_rects[i];
+            SDL_Rect rect{r->x, r->y, r->width, r->height};
+            SDL_UpdateTexture(texture, &rect, &((uint8_t*)b->pixels)[(int64_t)r->y * b->pitch + r->x * BYTES_PER_PIXEL], b->pitch);
+            uploaded_pixels += (int64_t)r->width * r->height;
+        }
+        frame_texture = texture;
     }
+    // this will stretch the frame to the render target if necessary, using bilinear interpolation
+    // (textures are the size of the pool; only the top left is this frame's)
+    SDL_Rect source{0, 0, b->width, b->height};
+    SDL_RenderCopy(renderer, frame_texture, &source, NULL);
+    return uploaded_pixels;
+}
 
-    game_code.init_memory = (GameInitMemory*) SDL_LoadFunction(game_code.object, "game_init_memory");
-    if (!game_code.init_memory)
+static const int DIRTY_TILE_SIZE = 64;
+
+// Compare the frame with the previous one a tile at a time, copying changed tiles across as we go
+// Runs of changed tiles along a row of tiles become one rect
+static void find_dirty_tiles(GameRenderBuffer* frame, GameRenderBuffer* previous, bool* previous_valid)
+{
+    TIMED_FUNCTION();
+    DEBUG_ASSERT(frame->pitch == previous->pitch);
+    uint8_t* frame_pixels = (uint8_t*)frame->pixels;
+    uint8_t* previous_pixels = (uint8_t*)previous->pixels;
+    if (!*previous_valid)
     {
-        FATAL_PRINTF("%s\n", SDL_GetError());
+        memcpy(previous_pixels, frame_pixels, (size_t)frame->height * frame->pitch);
+        *previous_valid = true;
+        mark_all_dirty(frame);
+        return;
     }
-    game_code.update_and_render = (GameUpdateAndRender*) SDL_LoadFunction(game_code.object, "game_update_and_render");
-    if (!game_code.update_and_render)
+
+    frame->num_dirty_rects = 0;
+    for (int tile_y = 0; tile_y < frame->height; tile_y += DIRTY_TILE_SIZE)
     {
-        FATAL_PRINTF("%s\n", SDL_GetError());
+        int rows = MIN(DIRTY_TILE_SIZE, frame->height - tile_y);
+        int run_start = -1;
+        // one step past the last tile to close any run still open
+        for (int tile_x = 0; tile_x < frame->width + DIRTY_TILE_SIZE; tile_x += DIRTY_TILE_SIZE)
+        {
+            bool dirty = false;
+            if (tile_x < frame->width)
+            {
+                size_t row_bytes = (size_t)MIN(DIRTY_TILE_SIZE, frame->width - tile_x) * BYTES_PER_PIXEL;
+                size_t start = (size_t)tile_y * frame->pitch + (size_t)tile_x * BYTES_PER_PIXEL;
+                for (int row = 0; row < rows && !dirty; ++row)
+                {
+                    size_t offset = start + (size_t)row * frame->pitch;
+                    dirty = memcmp(&frame_pixels[offset], &previous_pixels[offset], row_bytes) != 0;
+                }
+                for (int row = 0; dirty && row < rows; ++row)
+                {
+                    size_t offset = start + (size_t)row * frame->pitch;
+                    memcpy(&previous_pixels[offset], &frame_pixels[offset], row_bytes);
+                }
+            }
+
+            if (dirty && run_start < 0)
+            {
+                run_start = tile_x;
+            }
+            else if (!dirty && run_start >= 0)
+            {
+                add_dirty_rect(frame, run_start, tile_y, tile_x - run_start, rows);
+                run_start = -1;
+            }
+        }
     }
+}
 
-    DEBUG_PRINTF("Reloaded game code\n");
+
+// Make room by removing the earliest sample that only moved a stick or the mouse: the one before it for the same
+// controller has the same buttons, so every button edge is still in the history and only in-between motion is lost
+static bool merge_motion_sample(GameInput* game_input)
+{
+    for (int i = 1; i < game_input->num_samples; ++i)
+    {
+        InputSample* sample = &game_input->samples[i];
+        int previous = i - 1;
+        while (previous >= 0 && game_input->samples[previous].controller_index != sample->controller_index)
+        {
+            --previous;
+        }
+        if (previous < 0)
+        {
+            continue;
+        }
+        const ControllerInput* before = &game_input->samples[previous].controller;
+        if (sample->controller_index == MOUSE_SAMPLE_INDEX ||
+            (sample->controller.ended_down == before->ended_down && sample->controller.plugged_in == before->plugged_in))
+        {
+            memmove(sample, sample + 1, (size_t)(game_input->num_samples - i - 1) * sizeof(InputSample));
+            game_input->num_samples--;
+            return true;
+        }
+    }
+    return false;
 }
 
-static void render_offscreen_buffer(GameRenderBuffer* b)
+// Record the change that was just made to the current frame's input, keeping samples in time order
+static void add_input_sample(GameInput* game_input, uint64_t time, int controller_index)
 {
-    DEBUG_ASSERT(texture);
+    if (game_input->num_samples == MAX_INPUT_SAMPLES)
+    {
+        if (merge_motion_sample(game_input))
+        {
+            frame_pipeline.stage_times.merged_input_samples++;
+        }
+        else
+        {
+            // every sample is a button edge; the state is still right, we just lose this one from the history
+            frame_pipeline.stage_times.dropped_input_samples++;
+            return;
+        }
+    }
+
+    float seconds = time > last_input_time ? (float)(time - last_input_time) / (float)SDL_GetPerformanceFrequency() : 0.0F;
+
+    // events and input thread samples are added separately, so they can arrive out of order
+    int i = game_input->num_samples++;
+    while (i > 0 && game_input->samples[i - 1].time > seconds)
+    {
+        game_input->samples[i] = game_input->samples[i - 1];
+        --i;
+    }
 
-    SDL_UpdateTexture(texture, NULL, b->pixels, b->pitch);
-    // this will stretch the texture to the render target if necessary, using bilinear interpolation
-    SDL_RenderCopy(renderer, texture, NULL, NULL);
+    InputSample* sample = &game_input->samples[i];
+    sample->time = seconds;
+    sample->controller_index = controller_index;
+    sample->mouse_x = game_input->mouse_x;
+    sample->mouse_y = game_input->mouse_y;
+    if (controller_index == MOUSE_SAMPLE_INDEX)
+    {
+        memset(&sample->controller, 0, sizeof(ControllerInput));
+    }
+    else
+    {
+        sample->controller = game_input->controllers[controller_index];
+    }
 }
 
+// SDL event timestamps are SDL_GetTicks milliseconds; convert to the performance counter
+static uint64_t event_time_to_counter(uint32_t timestamp)
+{
+    uint64_t now = SDL_GetPerformanceCounter();
+    uint64_t age = (uint64_t)(SDL_GetTicks() - timestamp) * SDL_GetPerformanceFrequency() / 1000;
+    return now - MIN(now, age);
+}
 
+// Controller handles are shared with the input thread; lock the joysticks to change them
 static void add_controller(int joystick_index) {
     if (!SDL_IsGameController(joystick_index))
     {
         return;
     }
 
+    SDL_LockJoysticks();
     bool success = false;
     const char * error = "maximum number of controllers reached";
     // find empty slot
@@ -218,6 +512,7 @@ static void add_controller(int joystick_index) {
             break;
         }
     }
+    SDL_UnlockJoysticks();
     if (!success)
     {
         DEBUG_PRINTF("Tried to add controller, but failed: %s\n", error);
@@ -225,6 +520,7 @@ static void add_controller(int joystick_index) {
 }
 
 static void remove_controller(SDL_JoystickID joystick_id) {
+    SDL_LockJoysticks();
     for (int i = 0; i < MAX_GAMECONTROLLERS; ++i)
     {
         if (controller_handles[i])
@@ -238,6 +534,7 @@ static void remove_controller(SDL_JoystickID joystick_id) {
             break;
         }
     }
+    SDL_UnlockJoysticks();
 }
 
 static void handle_event(SDL_Event* e)
@@ -257,9 +554,16 @@ static void handle_event(SDL_Event* e)
                 case SDL_WINDOWEVENT_SIZE_CHANGED:
                 {
                     DEBUG_PRINTF("Resizing window (%d, %d)\n", e->window.data1, e->window.data2);
-                    // comment out to stretch to window size
-                    //free_offscreen_buffer(&screen_buffer);
-                    //screen_buffer = create_offscreen_buffer(e->window.data1, e->window.data2);
+                    // the next frame is requested at the new size; the buffers are already big enough
+                    set_resolution_window_size(&resolution_scaler, e->window.data1, e->window.data2);
+                    frame_pipeline.redraw_all = true;
+                    break;
+                }
+                case SDL_WINDOWEVENT_EXPOSED:
+                case SDL_WINDOWEVENT_RESTORED:
+                {
+                    // the window's contents are gone; an unchanged frame would leave it blank
+                    frame_pipeline.redraw_all = true;
                     break;
                 }
             }
@@ -274,20 +578,30 @@ static void handle_event(SDL_Event* e)
             remove_controller(e->cdevice.which);
             break;
         }
+        case SDL_MOUSEMOTION:
+        {
+            GameInput* game_input = &(game_input_buffer.buffer[game_input_buffer.last]);
+            game_input->mouse_x = e->motion.x;
+            game_input->mouse_y = e->motion.y;
+            add_input_sample(game_input, event_time_to_counter(e->motion.timestamp), MOUSE_SAMPLE_INDEX);
+            break;
+        }
         case SDL_MOUSEBUTTONDOWN:
             key_state = true;
         case SDL_MOUSEBUTTONUP:
         {
-            ControllerInput* controller = &(game_input_buffer.buffer[game_input_buffer.last].controllers[KEYBOARD_INDEX]);
+            GameInput* game_input = &(game_input_buffer.buffer[game_input_buffer.last]);
+            ControllerInput* controller = &(game_input->controllers[KEYBOARD_INDEX]);
             switch(e->button.button)
             {
                 case SDL_BUTTON_LEFT:
-                    controller->left_shoulder = key_state;
+                    set_button(controller, BUTTON_LEFT_SHOULDER, key_state);
                     break;
                 case SDL_BUTTON_RIGHT:
-                    controller->right_shoulder = key_state;
+                    set_button(controller, BUTTON_RIGHT_SHOULDER, key_state);
                     break;
             }
+            add_input_sample(game_input, event_time_to_counter(e->button.timestamp), KEYBOARD_INDEX);
             break;
         }
         case SDL_KEYDOWN:
@@ -295,483 +609,1751 @@ static void handle_event(SDL_Event* e)
         case SDL_KEYUP:
         {
             SDL_Keycode keycode = e->key.keysym.sym;
-            ControllerInput* controller = &(game_input_buffer.buffer[game_input_buffer.last].controllers[KEYBOARD_INDEX]);
+            GameInput* game_input = &(game_input_buffer.buffer[game_input_buffer.last]);
+            ControllerInput* controller = &(game_input->controllers[KEYBOARD_INDEX]);
+            ControllerInput last_state = *controller;
             // TODO make these remappable
             switch(keycode)
             {
                 case SDLK_LEFT:
                 case SDLK_a:
-                    controller->left = key_state;
+                    set_button(controller, BUTTON_LEFT, key_state);
                     break;
                 case SDLK_UP:
                 case SDLK_w:
-                    controller->up = key_state;
+                    set_button(controller, BUTTON_UP, key_state);
                     break;
                 case SDLK_RIGHT:
                 case SDLK_d:
-                    controller->right = key_state;
+                    set_button(controller, BUTTON_RIGHT, key_state);
                     break;
                 case SDLK_DOWN:
                 case SDLK_s:
-                    controller->down = key_state;
+                    set_button(controller, BUTTON_DOWN, key_state);
                     break;
                 case SDLK_q:
-                    controller->b = key_state;
+                    set_button(controller, BUTTON_B, key_state);
                     break;
                 case SDLK_e:
-                    controller->x = key_state;
+                    set_button(controller, BUTTON_X, key_state);
                     break;
                 case SDLK_r:
-                    controller->y = key_state;
+                    set_button(controller, BUTTON_Y, key_state);
                     break;
                 case SDLK_SPACE:
-                    controller->a = key_state;
+                    set_button(controller, BUTTON_A, key_state);
                     break;
                 case SDLK_ESCAPE:
-                    controller->start = key_state;
+                    set_button(controller, BUTTON_START, key_state);
                     break;
                 case SDLK_BACKSPACE:
-                    controller->back = key_state;
+                    set_button(controller, BUTTON_BACK, key_state);
                     break;
                 case SDLK_k:
-                    do_load_game_code = true;
+                    game_code_reloader.reload_requested.store(true, std::memory_order_release);
+                    break;
+#ifdef PROFILER
+                case SDLK_p:
+                    if (key_state)
+                    {
+                        print_profile_report(global_profiler);
+                    }
                     break;
+                case SDLK_t:
+                    if (key_state)
+                    {
+                        request_trace_capture(DEFAULT_TRACE_FRAMES, trace_file_path);
+                    }
+                    break;
+#endif
+            }
+            // key repeats and unmapped keys don't change anything
+            if (memcmp(&last_state, controller, sizeof(ControllerInput)) != 0)
+            {
+                add_input_sample(game_input, event_time_to_counter(e->key.timestamp), KEYBOARD_INDEX);
             }
             break;
         }
     }
 }
 
-static inline float process_stick_input(int16_t input, int16_t deadzone)
+static void poll_mouse()
 {
-    if (abs(input) < deadzone) return 0.0F;
+    GameInput* game_input = &(game_input_buffer.buffer[game_input_buffer.last]);
+    SDL_GetMouseState(&(game_input->mouse_x), &(game_input->mouse_y));
+}
 
-    if (input >= 0)
+// Read a gamepad's current state; any thread, with the joysticks locked
+static void read_controller(SDL_GameController* handle, ControllerInput* controller)
+{
+    static const SDL_GameControllerButton sdl_buttons[] = {
+        SDL_CONTROLLER_BUTTON_START, SDL_CONTROLLER_BUTTON_BACK,
+        SDL_CONTROLLER_BUTTON_LEFTSHOULDER, SDL_CONTROLLER_BUTTON_INVALID, SDL_CONTROLLER_BUTTON_LEFTSTICK,
+        SDL_CONTROLLER_BUTTON_RIGHTSHOULDER, SDL_CONTROLLER_BUTTON_INVALID, SDL_CONTROLLER_BUTTON_RIGHTSTICK,
+        SDL_CONTROLLER_BUTTON_A, SDL_CONTROLLER_BUTTON_B, SDL_CONTROLLER_BUTTON_X, SDL_CONTROLLER_BUTTON_Y,
+        SDL_CONTROLLER_BUTTON_DPAD_UP, SDL_CONTROLLER_BUTTON_DPAD_DOWN, SDL_CONTROLLER_BUTTON_DPAD_LEFT, SDL_CONTROLLER_BUTTON_DPAD_RIGHT,
+    };
+    static_assert(SIZE_OF_ARRAY(sdl_buttons) == BUTTON_COUNT, "every button needs an SDL mapping");
+
+    RawControllerState raw{};
+    // triggers are axes, and become buttons in convert_controller_state
+    for (int button = 0; button < BUTTON_COUNT; ++button)
     {
-        return ((float)input)/32767.0F;
+        if (sdl_buttons[button] != SDL_CONTROLLER_BUTTON_INVALID && SDL_GameControllerGetButton(handle, sdl_buttons[button]))
+        {
+            raw.buttons |= (uint16_t)(1 << button);
+        }
     }
-    return ((float)input)/32768.0F;
-    // TODO test this!
-}
 
-static void poll_mouse()
-{
-    GameInput* game_input = &(game_input_buffer.buffer[game_input_buffer.last]);
-    SDL_GetMouseState(&(game_input->mouse_x), &(game_input->mouse_y));
+    raw.left_trigger = SDL_GameControllerGetAxis(handle, SDL_CONTROLLER_AXIS_TRIGGERLEFT);
+    raw.left_stick_x = SDL_GameControllerGetAxis(handle, SDL_CONTROLLER_AXIS_LEFTX);
+    raw.left_stick_y = SDL_GameControllerGetAxis(handle, SDL_CONTROLLER_AXIS_LEFTY);
+    raw.right_trigger = SDL_GameControllerGetAxis(handle, SDL_CONTROLLER_AXIS_TRIGGERRIGHT);
+    raw.right_stick_x = SDL_GameControllerGetAxis(handle, SDL_CONTROLLER_AXIS_RIGHTX);
+    raw.right_stick_y = SDL_GameControllerGetAxis(handle, SDL_CONTROLLER_AXIS_RIGHTY);
+
+    convert_controller_state(&raw, controller);
 }
 
+// Once per frame on the main thread, when there's no input thread
 static void poll_controllers()
 {
-    // TODO better deadzone handling, maybe adjustable
-    static const int deadzone_left = 5000;
-    static const int deadzone_right = 5000;
-
+    TIMED_FUNCTION();
     GameInput* game_input = &(game_input_buffer.buffer[game_input_buffer.last]);
-    game_input->num_controllers = 1; // keyboard
+    uint64_t now = SDL_GetPerformanceCounter();
 
     for (int i = 0; i < MAX_GAMECONTROLLERS; ++i)
     {
-
         ControllerInput* controller = &(game_input->controllers[i]);
+        ControllerInput last_state = *controller;
 
+        ControllerInput state;
+        memset(&state, 0, sizeof(state));
         if(controller_handles[i] != NULL && SDL_GameControllerGetAttached(controller_handles[i]))
         {
-            game_input->num_controllers++;
-            controller->plugged_in = true;
-
-            controller->up = SDL_GameControllerGetButton(controller_handles[i], SDL_CONTROLLER_BUTTON_DPAD_UP);
-            controller->down = SDL_GameControllerGetButton(controller_handles[i], SDL_CONTROLLER_BUTTON_DPAD_DOWN);
-            controller->left = SDL_GameControllerGetButton(controller_handles[i], SDL_CONTROLLER_BUTTON_DPAD_LEFT);
-            controller->right = SDL_GameControllerGetButton(controller_handles[i], SDL_CONTROLLER_BUTTON_DPAD_RIGHT);
-            controller->start = SDL_GameControllerGetButton(controller_handles[i], SDL_CONTROLLER_BUTTON_START);
-            controller->back = SDL_GameControllerGetButton(controller_handles[i], SDL_CONTROLLER_BUTTON_BACK);
-            controller->left_shoulder = SDL_GameControllerGetButton(controller_handles[i], SDL_CONTROLLER_BUTTON_LEFTSHOULDER);
-            controller->right_shoulder = SDL_GameControllerGetButton(controller_handles[i], SDL_CONTROLLER_BUTTON_RIGHTSHOULDER);
-            controller->a = SDL_GameControllerGetButton(controller_handles[i], SDL_CONTROLLER_BUTTON_A);
-            controller->b = SDL_GameControllerGetButton(controller_handles[i], SDL_CONTROLLER_BUTTON_B);
-            controller->x = SDL_GameControllerGetButton(controller_handles[i], SDL_CONTROLLER_BUTTON_X);
-            controller->y = SDL_GameControllerGetButton(controller_handles[i], SDL_CONTROLLER_BUTTON_Y);
-
-            int16_t left_trigger = SDL_GameControllerGetAxis(controller_handles[i], SDL_CONTROLLER_AXIS_TRIGGERLEFT);
-            int16_t left_stick_x = SDL_GameControllerGetAxis(controller_handles[i], SDL_CONTROLLER_AXIS_LEFTX);
-            int16_t left_stick_y = SDL_GameControllerGetAxis(controller_handles[i], SDL_CONTROLLER_AXIS_LEFTY);
-            controller->left_trigger = left_trigger > 16383 ? true : false;
-            controller->left_stick_x = process_stick_input(left_stick_x, deadzone_left);
-            controller->left_stick_y = process_stick_input(left_stick_y, deadzone_left);
-
-            int16_t right_trigger = SDL_GameControllerGetAxis(controller_handles[i], SDL_CONTROLLER_AXIS_TRIGGERRIGHT);
-            int16_t right_stick_x = SDL_GameControllerGetAxis(controller_handles[i], SDL_CONTROLLER_AXIS_RIGHTX);
-            int16_t right_stick_y = SDL_GameControllerGetAxis(controller_handles[i], SDL_CONTROLLER_AXIS_RIGHTY);
-            controller->right_trigger = right_trigger > 16383 ? true : false;
-            controller->right_stick_x = process_stick_input(right_stick_x, deadzone_right);
-            controller->right_stick_y = process_stick_input(right_stick_y, deadzone_right);
+            read_controller(controller_handles[i], &state);
         }
-        else
+        apply_controller_state(controller, &state);
+
+        if (memcmp(&last_state, controller, sizeof(ControllerInput)) != 0)
         {
-            controller->plugged_in = false;
+            add_input_sample(game_input, now, i);
         }
     }
 }
 
-static void audio_callback(void* user_data, uint8_t* audio_data, int length)
+static int input_thread_proc(void* data)
 {
-    AudioRingBuffer* ring_buffer = (AudioRingBuffer*)user_data;
+    InputThread* input = (InputThread*)data;
+    NAME_PROFILE_THREAD("input");
 
-    DEBUG_ASSERT(length <= ring_buffer->size);
+    uint64_t frequency = SDL_GetPerformanceFrequency();
+    uint64_t period = frequency / (uint64_t)input->poll_hz;
+    uint64_t next_poll = SDL_GetPerformanceCounter();
 
-    // Copy length bytes from ring buffer to audio_data buffer
-    int space_left = ring_buffer->size - ring_buffer->play_index;
+    // the last state we managed to send, so we only send changes
+    ControllerInput sent[MAX_GAMECONTROLLERS];
+    memset(sent, 0, sizeof(sent));
 
-    if (length > space_left)
+    while (!input->quit.load(std::memory_order_acquire))
     {
-        memcpy(audio_data, &((uint8_t*)ring_buffer->data)[ring_buffer->play_index], space_left);
-        memcpy(&audio_data[space_left], ring_buffer->data, length - space_left);
-        ring_buffer->play_index = length - space_left;
+        BEGIN_TIMED_BLOCK("poll_controllers");
+        SDL_LockJoysticks();
+        // SDL only refreshes gamepad state when events are pumped, unless we ask
+        SDL_GameControllerUpdate();
+        uint64_t now = SDL_GetPerformanceCounter();
+        for (int i = 0; i < MAX_GAMECONTROLLERS; ++i)
+        {
+            PlatformInputSample sample;
+            // zeroed, so padding doesn't break the comparison
+            memset(&sample, 0, sizeof(sample));
+            if(controller_handles[i] != NULL && SDL_GameControllerGetAttached(controller_handles[i]))
+            {
+                read_controller(controller_handles[i], &sample.controller);
+            }
+
+            if (memcmp(&sample.controller, &sent[i], sizeof(ControllerInput)) != 0)
+            {
+                sample.time = now;
+                sample.controller_index = i;
+                if (spsc_push(&input->samples, &sample))
+                {
+                    sent[i] = sample.controller;
+                }
+                else
+                {
+                    input->dropped_samples.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+        }
+        SDL_UnlockJoysticks();
+        END_TIMED_BLOCK("poll_controllers");
+        input->poll_count.fetch_add(1, std::memory_order_relaxed);
+
+        // sleep granularity is ~1ms, so 1kHz is a target rather than a guarantee
+        next_poll += period;
+        now = SDL_GetPerformanceCounter();
+        if ((int64_t)(next_poll - now) <= 0)
+        {
+            // fell behind; don't try to catch up with a burst of polls
+            next_poll = now;
+        }
+        else
+        {
+            uint32_t sleep_ms = (uint32_t)((next_poll - now) * 1000 / frequency);
+            SDL_Delay(MAX(sleep_ms, 1U));
+        }
     }
-    else
+    return 0;
+}
+
+static void start_input_thread(InputThread* input, int poll_hz)
+{
+    input->poll_hz = poll_hz;
+    input->quit = false;
+    input->dropped_samples = 0;
+    input->poll_count = 0;
+    init_spsc_queue(&input->samples);
+    input->thread = SDL_CreateThread(input_thread_proc, "input", input);
+    if (!input->thread)
     {
-        memcpy(audio_data, &((uint8_t*)ring_buffer->data)[ring_buffer->play_index], length);
-        ring_buffer->play_index += length;
+        FATAL_PRINTF("Couldn't create input thread - SDL_Error: %s\n", SDL_GetError());
     }
 }
 
-int main(int argc, char* args[])
+static void stop_input_thread(InputThread* input)
 {
+    if (input->thread)
+    {
+        input->quit.store(true, std::memory_order_release);
+        SDL_WaitThread(input->thread, NULL);
+        input->thread = NULL;
+    }
+}
 
-    int width = 800;
-    int height = 600;
+// Apply everything the input thread saw since last frame to this frame's input
+static void drain_input_samples(InputThread* input, GameInput* game_input)
+{
+    PlatformInputSample sample;
+    while (spsc_pop(&input->samples, &sample))
+    {
+        apply_controller_state(&game_input->controllers[sample.controller_index], &sample.controller);
+        add_input_sample(game_input, sample.time, sample.controller_index);
+    }
+}
 
-    // Init SDL
-    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_GAMECONTROLLER | SDL_INIT_AUDIO) < 0)
+// Called at the start of every audio callback, in both modes
+// Returns the performance counter ticks since the previous callback started, or 0 for the first one
+static uint64_t record_audio_callback()
+{
+    uint64_t now = SDL_GetPerformanceCounter();
+    uint64_t interval = 0;
+    if (audio_stats.last_callback_time)
     {
-        FATAL_PRINTF("SDL couldn't be initialized - SDL_Error: %s\n", SDL_GetError());
+        interval = now - audio_stats.last_callback_time;
+        // only the controller lowers this, so a stale read just means one extra store
+        if (interval > audio_stats.max_callback_interval.load(std::memory_order_relaxed))
+        {
+            audio_stats.max_callback_interval.store(interval, std::memory_order_relaxed);
+        }
+        if (interval > 2 * audio_callback_period)
+        {
+            audio_stats.late_callback_count.fetch_add(1, std::memory_order_relaxed);
+        }
     }
+    audio_stats.last_callback_time = now;
+    audio_stats.callback_count.fetch_add(1, std::memory_order_relaxed);
+    return interval;
+}
 
-    // Get the path we're running in
-    executable_path = SDL_GetBasePath();
-    if (!executable_path) {
-        executable_path = SDL_strdup("./");
+// Fade out the end of a block that a skip is about to follow, and count it; the next block with sound fades back in
+static void fade_out_before_skip(int16_t* samples, int num_samples, bool* faded_out)
+{
+    if (num_samples)
+    {
+        fade_audio(samples, num_samples, NUM_AUDIO_CHANNELS, false);
+    }
+    if (!*faded_out)
+    {
+        audio_stats.fade_count.fetch_add(1, std::memory_order_relaxed);
+        *faded_out = true;
     }
+}
 
-    // Create Window and Renderer
+static void audio_callback(void* user_data, uint8_t* audio_data, int length)
+{
+    NAME_PROFILE_THREAD("audio");
+    TIMED_FUNCTION();
+    AudioRingBuffer* ring_buffer = (AudioRingBuffer*)user_data;
 
-    window = SDL_CreateWindow(
-        "Game",
-        SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
-        width, height,
-        SDL_WINDOW_RESIZABLE);
+    DEBUG_ASSERT(length <= ring_buffer->size);
+    record_audio_callback();
 
-    if(window == NULL)
-    {
-        FATAL_PRINTF("Window could not be created - SDL_Error: %s\n", SDL_GetError());
-    }
+    // we're the only writer of play_cursor
+    uint32_t play_cursor = ring_buffer->play_cursor.load(std::memory_order_relaxed);
+    // acquire pairs with the release in the main loop, so the data up to write_cursor is visible
+    uint32_t write_cursor = ring_buffer->write_cursor.load(std::memory_order_acquire);
 
-    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+    // negative if the writer fell behind and we already played past it
+    int32_t available = (int32_t)(write_cursor - play_cursor);
+    int copy_length = (int)MIN(MAX(available, 0), length);
+    PROFILE_COUNTER("audio_buffered_samples", available / BYTES_PER_AUDIO_SAMPLE);
 
-    if(renderer == NULL)
+    int32_t margin = available - length;
+    if (margin < audio_stats.min_margin.load(std::memory_order_relaxed))
     {
-        FATAL_PRINTF("Renderer could not be created - SDL_Error: %s\n", SDL_GetError());
+        audio_stats.min_margin.store(margin, std::memory_order_relaxed);
     }
 
-    // Initialize rendering buffer
+    BEGIN_TIMED_BLOCK("ring_buffer_read");
+    ring_buffer_read(ring_buffer, play_cursor, audio_data, copy_length);
+    END_TIMED_BLOCK("ring_buffer_read");
 
-    game_render_buffer.pitch = width * BYTES_PER_PIXEL;
-    game_render_buffer.width = width;
-    game_render_buffer.height = height;
-    game_render_buffer.pixels = LARGE_ALLOC(height * game_render_buffer.pitch);
-    if(game_render_buffer.pixels == NULL)
+    int copy_samples = copy_length / BYTES_PER_AUDIO_SAMPLE;
+    if (ring_buffer->faded_out && copy_samples)
     {
-        FATAL_PRINTF("Couldn't allocate pixels buffer");
+        fade_audio((int16_t*)audio_data, copy_samples, NUM_AUDIO_CHANNELS, true);
+        ring_buffer->faded_out = false;
     }
 
-    texture = SDL_CreateTexture(
-        renderer,
-        SDL_PIXELFORMAT_ARGB8888,
-        SDL_TEXTUREACCESS_STREAMING,
-        width,
-        height);
-
-    if(texture == NULL)
+    if (copy_length < length)
     {
-        FATAL_PRINTF("Window could not be created - SDL_Error: %s\n", SDL_GetError());
+        // underrun; fade out what we have, then play silence rather than whatever stale data is in the ring buffer
+        // (play_cursor still advances by length, so the stale data is never played later either)
+        fade_out_before_skip((int16_t*)audio_data, copy_samples, &ring_buffer->faded_out);
+        memset(&audio_data[copy_length], ring_buffer->silence, length - copy_length);
+        ring_buffer->underrun_count.fetch_add(1, std::memory_order_relaxed);
     }
-
-    // Initialize audio
-
-    // TODO store the name of the device for debugging and/or settings menu stuff (must be copied)
-    // WARNING I don't think this index always equals the audio device id, because devices can change at runtime
-    int num_audio_devices = SDL_GetNumAudioDevices(0); // iscapture = 0
-    DEBUG_PRINTF("Audio devices:\n");
-    for (int i = 0; i < num_audio_devices; ++i)
+    else if (margin < length)
     {
-        DEBUG_PRINTF("  %d: %s\n", i, SDL_GetAudioDeviceName(i, 0));
+        // less than another device buffer is left, so the next callback skips unless the main loop writes before it;
+        // fade out now, at the end of real sound, rather than cutting off mid-wave when it runs dry
+        fade_out_before_skip((int16_t*)audio_data, copy_samples, &ring_buffer->faded_out);
     }
 
-    SDL_AudioSpec actual_settings{};
+    // release so the main loop doesn't overwrite this region until we're done reading it
+    ring_buffer->play_cursor.store(play_cursor + length, std::memory_order_release);
+}
 
-    audio_settings.freq = AUDIO_SAMPLES_PER_SECOND;
-    audio_settings.format = AUDIO_S16SYS;
-    audio_settings.channels = NUM_AUDIO_CHANNELS;
-    audio_settings.samples = SDL_AUDIO_BUFFER_SAMPLES;
-    audio_settings.callback = audio_callback;
-    audio_settings.userdata = &audio_ring_buffer;
+/*
+ *  How audio works (lots of buffers)
+ *  - Push mode, each frame in the main loop:
+ *      - We figure out how far ahead we need to write so the audio doesn't skip
+ *      - Game code fills a sound buffer
+ *      - We copy it to the ring buffer
+ *  - In SDL's callback function (run in another thread), we copy from the ring buffer to SDL's internal buffer
+ *  - SDL copies to the platform's sound buffer
+ * 
+ *  We need to tell the game code to give us more than 1 frame of sound, or there could be skips!
+ * 
+ *  Frame timeline 
+ * 
+ * |----------------------------------------------|----------------------------------------------|
+ *     ^ |---(get sound from game)---| ^                ^                          ^
+ *  set target                    write data        set target                  write data
+ *                                                                  (need to get here before play catches up) 
+ * 
+ *  We need to ask the game for enough sound data to get us to the end of the next frame
+ *  So, starting at set target, we need to set our target at the end of the next frame
+ *  This is just 2 frames minus the first bit of the frame before set target
+ *  We use rolling exponentially weighted averages of the number of samples between each frame to hopefully make it more accurate
+ */
 
-    // find a suitable device, no changes in format allowed
-    // TODO make selectable and automatically change at runtime by listening for SDL_AudioDeviceEvent
-    audio_device_id = SDL_OpenAudioDevice(NULL, 0, &audio_settings, &actual_settings, 0);
-    if (audio_device_id == 0) {
-        FATAL_PRINTF("Failed to open audio - SDL_Error: %s\n", SDL_GetError());
-    }
-    if (actual_settings.format != AUDIO_S16LSB || actual_settings.freq != AUDIO_SAMPLES_PER_SECOND || actual_settings.samples != SDL_AUDIO_BUFFER_SAMPLES) {
-        FATAL_PRINTF("Audio settings don't match requested\n");
-    }
-    DEBUG_PRINTF("Audio device selected: %d\n", audio_device_id);
-    audio_settings = actual_settings;
+static void set_audio_target(AudioWriteState* state)
+{
+    // cursors only ever increase (modulo 2^32), so plain subtraction gives the distance
+    uint32_t new_play_cursor_set_target = audio_ring_buffer.play_cursor.load(std::memory_order_acquire);
 
-    // Lock the callback
-    SDL_LockAudioDevice(audio_device_id);
-    {
-        SDL_PauseAudioDevice(audio_device_id, 0); /* start audio playing. */
+    state->samples_since_last_frame_set_target = (int)(new_play_cursor_set_target - state->play_cursor_set_target) / BYTES_PER_AUDIO_SAMPLE;
+    int samples_since_start_of_frame = (int)(new_play_cursor_set_target - state->play_cursor_init) / BYTES_PER_AUDIO_SAMPLE;
+    state->avg_samples_since_start_of_frame = (int)EXP_WEIGHTED_AVG(state->avg_samples_since_start_of_frame, SAMPLES_PER_FRAME_COUNT, samples_since_start_of_frame);
 
-        DEBUG_PRINTF("Audio silence: %d\n", audio_settings.silence);
-        DEBUG_PRINTF("SDL audio buffer size: %d\n", audio_settings.size);
+    state->play_cursor_set_target = new_play_cursor_set_target;
 
-        // initialize ring buffer to 1 second
-        audio_ring_buffer.size = BYTES_PER_AUDIO_SAMPLE * AUDIO_RING_BUFFER_SIZE_SAMPLES;
-        DEBUG_ASSERT((int)audio_settings.size <= audio_ring_buffer.size);
+    // 2 frames minus any samples from the start of this frame, plus some device buffers for safety (set by the latency controller)
+    int device_buffer_samples = audio_latency.device_buffer_samples;
+    int target_samples_ahead = (state->avg_samples_per_frame * 2 - state->avg_samples_since_start_of_frame) + audio_latency.safety_buffers * device_buffer_samples;
 
-        audio_ring_buffer.write_index = 0;
-        audio_ring_buffer.play_index = 0;
-        DEBUG_PRINTF("Audio ring buffer size: %d\n", audio_ring_buffer.size);
+    //DEBUG_PRINTF("avg samples in frame %d\n", state->avg_samples_per_frame);
+    //DEBUG_PRINTF("avg samples since start of frame: %d\n", state->avg_samples_since_start_of_frame);
+    //DEBUG_PRINTF("target samples ahead: %d\n", target_samples_ahead);
+    int rem = target_samples_ahead % device_buffer_samples;
+    target_samples_ahead += (device_buffer_samples - rem);
 
-        audio_ring_buffer.data = LARGE_ALLOC(audio_ring_buffer.size);
-        if (!audio_ring_buffer.data)
-        {
-            FATAL_PRINTF("Couldn't allocate audio ring buffer\n");
-        }
+    uint32_t target_cursor = state->play_cursor_set_target + (uint32_t)(target_samples_ahead * BYTES_PER_AUDIO_SAMPLE);
 
-        // fill ring buffer with silence
-        memset(audio_ring_buffer.data, audio_settings.silence, audio_ring_buffer.size);
+    // we're the only writer of write_cursor
+    state->write_cursor = audio_ring_buffer.write_cursor.load(std::memory_order_relaxed);
+    if ((int32_t)(state->write_cursor - state->play_cursor_set_target) < 0)
+    {
+        // we fell behind and the callback played silence past the end of our data; skip ahead to where it's playing
+        state->write_cursor = state->play_cursor_set_target;
     }
-    // Unlock the callback
-    SDL_UnlockAudioDevice(audio_device_id);
 
-    // init game code
-    load_game_code();
+    // never write over data that hasn't been played yet
+    int max_write_size = MIN(audio_ring_buffer.size - (int)(state->write_cursor - state->play_cursor_set_target), game_sound_buffer_max_size);
+    state->write_size = (int)MIN(MAX((int32_t)(target_cursor - state->write_cursor), 0), max_write_size);
 
-    // init game memory
-    game_memory.memory_size = GIBIBYTES(1);
-#ifdef FIXED_GAME_MEMORY
-    game_memory.memory = LARGE_ALLOC_FIXED(game_memory.memory_size, TEBIBYTES(2));
-#else
-    game_memory.memory = LARGE_ALLOC(game_memory.memory_size);
-#endif
+    game_sound_buffer.buffer_size = state->write_size;
+    //DEBUG_PRINTF("game sound buffer samples size %d\n", game_sound_buffer.buffer_size / BYTES_PER_AUDIO_SAMPLE);
+}
 
-    if (!game_memory.memory)
+// Most sound the game is asked for at once: a device buffer in pull mode, or set_audio_target's write ahead in push mode
+// Audio streams keep a few times this decoded, so they follow the latency controller
+static int get_audio_request_samples()
+{
+    int device_buffer_samples = audio_latency.device_buffer_samples;
+    if (audio_mode == AUDIO_MODE_PUSH)
     {
-        FATAL_PRINTF("Couldn't allocate game memory\n");
+        return audio_write_state.avg_samples_per_frame * 2 + audio_latency.safety_buffers * device_buffer_samples;
     }
-    game_memory.DEBUG_platform_read_entire_file = DEBUG_platform_read_entire_file;
-    game_memory.DEBUG_platform_free_file_memory = DEBUG_platform_free_file_memory;
-    game_memory.DEBUG_platform_write_entire_file = DEBUG_platform_write_entire_file;
+    return device_buffer_samples;
+}
 
-    game_code.init_memory(game_memory);
+static void write_audio_frame(AudioWriteState* state)
+{
+    TIMED_FUNCTION();
+    uint32_t new_play_cursor_write_data = audio_ring_buffer.play_cursor.load(std::memory_order_acquire);
+    int samples_since_last_frame_write_data = (int)(new_play_cursor_write_data - state->play_cursor_write_data) / BYTES_PER_AUDIO_SAMPLE;
 
-    // init game audio
-    game_sound_buffer.buffer_size = AUDIO_SAMPLES_PER_SECOND * BYTES_PER_AUDIO_SAMPLE;
-    game_sound_buffer.buffer = LARGE_ALLOC(game_sound_buffer.buffer_size);
-    if (!game_sound_buffer.buffer)
+    // avg of this frame
+    float avg_this_frame = ((float)state->samples_since_last_frame_set_target + (float)samples_since_last_frame_write_data) / 2.0F;
+    // exponentially weighted rolling average
+    state->avg_samples_per_frame = (int)EXP_WEIGHTED_AVG(state->avg_samples_per_frame, SAMPLES_PER_FRAME_COUNT, avg_this_frame);
+
+    state->play_cursor_write_data = new_play_cursor_write_data;
+
+    if (game_sound_buffer.buffer_size)
     {
-        FATAL_PRINTF("Couldn't allocate game sound buffer\n");
+        BEGIN_TIMED_BLOCK("ring_buffer_write");
+        ring_buffer_write(&audio_ring_buffer, state->write_cursor, game_sound_buffer.buffer, state->write_size);
+        END_TIMED_BLOCK("ring_buffer_write");
+        PROFILE_COUNTER("audio_write_samples", state->write_size / BYTES_PER_AUDIO_SAMPLE);
+
+        // release so the callback sees the data before it sees the new cursor
+        audio_ring_buffer.write_cursor.store(state->write_cursor + (uint32_t)state->write_size, std::memory_order_release);
     }
-    game_sound_buffer.samples_per_second = audio_settings.freq;
-    game_sound_buffer.bytes_per_sample = BYTES_PER_AUDIO_SAMPLE;
-    game_sound_buffer.num_channels = NUM_AUDIO_CHANNELS;
+}
 
-    // init game input
+// Pull mode: the game makes exactly as much sound as the device asks for, right when it's needed
+// Latency is one device buffer; there's no ring buffer or write-ahead estimate
+static void audio_pull_callback(void* user_data, uint8_t* audio_data, int length)
+{
+    NAME_PROFILE_THREAD("audio");
+    TIMED_FUNCTION();
+    PROFILE_COUNTER("audio_callback_samples", length / BYTES_PER_AUDIO_SAMPLE);
+    uint64_t interval = record_audio_callback();
+    uint64_t start_time = SDL_GetPerformanceCounter();
+
+    GameSoundBuffer sound_buffer = game_sound_buffer;
+    sound_buffer.buffer = audio_data;
+    sound_buffer.buffer_size = length;
+    // the device is locked while game code is swapped, so this is never old code
+    game_code.get_sound_samples(game_memory, &sound_buffer);
+
+    int16_t* samples = (int16_t*)audio_data;
+    int num_samples = length / BYTES_PER_AUDIO_SAMPLE;
+    // after a fade out, or a gap we didn't see coming (the same test as a late callback)
+    if (audio_stats.faded_out || interval > 2 * audio_callback_period)
+    {
+        fade_audio(samples, num_samples, NUM_AUDIO_CHANNELS, true);
+        audio_stats.faded_out = false;
+    }
+
+    // The device skips once 2 device buffers pass between callbacks (see record_audio_callback), so our margin is
+    // what's left of those after the time since the last callback and however long the game took; if that's nearly
+    // gone, the next callback will be late
+    uint64_t used = interval + (SDL_GetPerformanceCounter() - start_time);
+    if (interval && used + audio_callback_period / PULL_FADE_MARGIN_DIVISOR > 2 * audio_callback_period)
+    {
+        fade_out_before_skip(samples, num_samples, &audio_stats.faded_out);
+    }
+}
+
+// Opens the default device with buffer_samples per callback, paused; false if it can't do exactly that
+static bool open_audio_device(int buffer_samples)
+{
+    SDL_AudioSpec requested_settings{};
+    requested_settings.freq = AUDIO_SAMPLES_PER_SECOND;
+    requested_settings.format = AUDIO_S16SYS;
+    requested_settings.channels = NUM_AUDIO_CHANNELS;
+    requested_settings.samples = (uint16_t)buffer_samples;
+    if (audio_mode == AUDIO_MODE_PULL)
+    {
+        requested_settings.callback = audio_pull_callback;
+        requested_settings.userdata = NULL;
+    }
+    else
+    {
+        requested_settings.callback = audio_callback;
+        requested_settings.userdata = &audio_ring_buffer;
+    }
+
+    // no callback is running, so it's safe to reset its timing
+    audio_callback_period = SDL_GetPerformanceFrequency() * (uint64_t)buffer_samples / AUDIO_SAMPLES_PER_SECOND;
+    audio_stats.last_callback_time = 0;
+
+    // find a suitable device, no changes in format allowed
+    // TODO make selectable and automatically change at runtime by listening for SDL_AudioDeviceEvent
+    SDL_AudioSpec actual_settings{};
+    audio_device_id = SDL_OpenAudioDevice(NULL, 0, &requested_settings, &actual_settings, 0);
+    if (audio_device_id == 0) {
+        DEBUG_PRINTF("Failed to open audio - SDL_Error: %s\n", SDL_GetError());
+        return false;
+    }
+    if (actual_settings.format != AUDIO_S16LSB || actual_settings.freq != AUDIO_SAMPLES_PER_SECOND || actual_settings.samples != buffer_samples) {
+        DEBUG_PRINTF("Audio settings don't match requested\n");
+        SDL_CloseAudioDevice(audio_device_id);
+        audio_device_id = 0;
+        return false;
+    }
+    audio_settings = actual_settings;
+    audio_latency.device_buffer_samples = buffer_samples;
+    return true;
+}
+
+// Reopen the device with a different buffer size (and keep playing); falls back to the old size if that doesn't work
+static void resize_audio_device_buffer(int buffer_samples)
+{
+    int old_buffer_samples = audio_latency.device_buffer_samples;
+    // waits for the callback to return
+    SDL_CloseAudioDevice(audio_device_id);
+    if (!open_audio_device(buffer_samples) && !open_audio_device(old_buffer_samples))
+    {
+        FATAL_PRINTF("Couldn't reopen audio device\n");
+    }
+    DEBUG_ASSERT((int)audio_settings.size <= audio_ring_buffer.size);
+    SDL_PauseAudioDevice(audio_device_id, 0);
+}
+
+static inline float audio_samples_to_ms(int samples)
+{
+    return 1000.0F * (float)samples / (float)AUDIO_SAMPLES_PER_SECOND;
+}
+
+/*
+ *  Adaptive latency
+ *  - Dropouts in a window (underruns in push mode, late callbacks in pull mode) make it grow:
+ *      - push mode writes another device buffer ahead, until MAX_SAFETY_BUFFERS, then the device buffer doubles
+ *      - pull mode can only double the device buffer
+ *  - After quiet_windows_to_shrink windows without dropouts it shrinks again, one step at a time:
+ *      - push mode drops a safety buffer if the ring buffer never got close to running dry, then halves the device buffer
+ *      - the device buffer is only halved if callbacks came on time
+ *  - Dropouts soon after shrinking double quiet_windows_to_shrink, so a limit we keep hitting is retried less and less often
+ */
+static void update_audio_latency(AudioLatencyController* controller, uint64_t now)
+{
+    uint64_t frequency = SDL_GetPerformanceFrequency();
+    if (now - controller->window_start_time < frequency * AUDIO_LATENCY_WINDOW_MS / 1000)
+    {
+        return;
+    }
+    float window_s = (float)(now - controller->window_start_time) / (float)frequency;
+    controller->window_start_time = now;
+
+    uint32_t underrun_count = audio_ring_buffer.underrun_count.load(std::memory_order_relaxed);
+    uint32_t callback_count = audio_stats.callback_count.load(std::memory_order_relaxed);
+    uint32_t late_callback_count = audio_stats.late_callback_count.load(std::memory_order_relaxed);
+    uint32_t fade_count = audio_stats.fade_count.load(std::memory_order_relaxed);
+    uint32_t stream_underrun_count = audio_streams.underrun_count.load(std::memory_order_relaxed);
+    int underruns = (int)(underrun_count - controller->last_underrun_count);
+    int callbacks = (int)(callback_count - controller->last_callback_count);
+    int late_callbacks = (int)(late_callback_count - controller->last_late_callback_count);
+    int fades = (int)(fade_count - controller->last_fade_count);
+    // the stream thread falling behind; not something the device buffer can fix, so it's only reported
+    int stream_underruns = (int)(stream_underrun_count - controller->last_stream_underrun_count);
+    controller->last_underrun_count = underrun_count;
+    controller->last_callback_count = callback_count;
+    controller->last_late_callback_count = late_callback_count;
+    controller->last_fade_count = fade_count;
+    controller->last_stream_underrun_count = stream_underrun_count;
+
+    float max_callback_interval_ms = 1000.0F * (float)audio_stats.max_callback_interval.exchange(0, std::memory_order_relaxed) / (float)frequency;
+    int32_t min_margin = audio_stats.min_margin.exchange(INT32_MAX, std::memory_order_relaxed);
+
+    int device_buffer_samples = controller->device_buffer_samples;
+    float device_buffer_ms = audio_samples_to_ms(device_buffer_samples);
+    bool push = audio_mode == AUDIO_MODE_PUSH;
+
+    // what's queued in front of the speaker right now
+    int latency_samples = device_buffer_samples;
+    if (push)
+    {
+        uint32_t queued = audio_ring_buffer.write_cursor.load(std::memory_order_relaxed) - audio_ring_buffer.play_cursor.load(std::memory_order_relaxed);
+        latency_samples += (int)MAX((int32_t)queued, 0) / BYTES_PER_AUDIO_SAMPLE;
+    }
+
+    controller->windows_since_shrink = MIN(controller->windows_since_shrink + 1, MAX_QUIET_WINDOWS_TO_SHRINK);
+    bool dropouts = push ? underruns > 0 : late_callbacks > 0;
+    int new_device_buffer_samples = device_buffer_samples;
+    int old_safety_buffers = controller->safety_buffers;
+    if (dropouts)
+    {
+        controller->quiet_windows = 0;
+        if (push && controller->safety_buffers < MAX_SAFETY_BUFFERS)
+        {
+            controller->safety_buffers++;
+        }
+        else if (device_buffer_samples < MAX_SDL_AUDIO_BUFFER_SAMPLES)
+        {
+            new_device_buffer_samples = device_buffer_samples * 2;
+        }
+        if (controller->windows_since_shrink <= controller->quiet_windows_to_shrink)
+        {
+            controller->quiet_windows_to_shrink = MIN(controller->quiet_windows_to_shrink * 2, MAX_QUIET_WINDOWS_TO_SHRINK);
+        }
+    }
+    else if (++controller->quiet_windows >= controller->quiet_windows_to_shrink)
+    {
+        controller->quiet_windows = 0;
+        bool callbacks_on_time = max_callback_interval_ms < 1.5F * device_buffer_ms;
+        // with one fewer safety buffer, would we still have had data left over?
+        bool margin_to_spare = min_margin > device_buffer_samples * BYTES_PER_AUDIO_SAMPLE;
+        if (push && controller->safety_buffers > MIN_SAFETY_BUFFERS && margin_to_spare)
+        {
+            controller->safety_buffers--;
+            controller->windows_since_shrink = 0;
+        }
+        else if (device_buffer_samples > MIN_SDL_AUDIO_BUFFER_SAMPLES && callbacks_on_time)
+        {
+            new_device_buffer_samples = device_buffer_samples / 2;
+            controller->windows_since_shrink = 0;
+        }
+    }
+
+    bool changed = new_device_buffer_samples != device_buffer_samples || controller->safety_buffers != old_safety_buffers;
+    if (dropouts || changed || stream_underruns)
+    {
+        DEBUG_PRINTF("Audio: %d underruns, %d late callbacks, %d fades, %d stream underruns; latency %.1fms, device buffer %d -> %d, safety buffers %d -> %d\n",
+            underruns, late_callbacks, fades, stream_underruns, audio_samples_to_ms(latency_samples),
+            device_buffer_samples, new_device_buffer_samples, old_safety_buffers, controller->safety_buffers);
+    }
+
+    if (audio_stats_file)
+    {
+        fprintf(audio_stats_file, "%.3f,%s,%d,%d,%.2f,%d,%d,%d,%d,%.2f,%d,",
+            (float)SDL_GetTicks() / 1000.0F, push ? "push" : "pull", device_buffer_samples, old_safety_buffers,
+            audio_samples_to_ms(latency_samples), (int)((float)callbacks / window_s), underruns, late_callbacks, fades, max_callback_interval_ms,
+            stream_underruns);
+        // margin only exists in push mode
+        if (push && min_margin != INT32_MAX)
+        {
+            fprintf(audio_stats_file, "%.2f", audio_samples_to_ms(min_margin / BYTES_PER_AUDIO_SAMPLE));
+        }
+        fprintf(audio_stats_file, "\n");
+        fflush(audio_stats_file);
+    }
+
+    if (new_device_buffer_samples != device_buffer_samples)
+    {
+        resize_audio_device_buffer(new_device_buffer_samples);
+    }
+}
+
+// Start the next entry in an input buffer once the current one is done with
+// State carries over; events and the input thread only tell us about changes
+static void advance_game_input(GameInputBuffer* input_buffer)
+{
+    GameInput* previous_input = &input_buffer->buffer[input_buffer->last];
+    input_buffer->last = (input_buffer->last + 1) % INPUT_BUFFER_SIZE;
+    GameInput* game_input = &input_buffer->buffer[input_buffer->last];
+    memcpy(game_input->controllers, previous_input->controllers, sizeof(game_input->controllers));
+    for (int i = 0; i < MAX_CONTROLLERS; ++i)
+    {
+        // transitions are counted per update; what's held stays held
+        game_input->controllers[i].half_transitions = 0;
+    }
+    game_input->num_controllers = previous_input->num_controllers;
+    game_input->mouse_x = previous_input->mouse_x;
+    game_input->mouse_y = previous_input->mouse_y;
+    game_input->num_samples = 0;
+}
+
+// Hand the input gathered since the last tick to the simulation and start gathering the next lot
+// Only this needs input_mutex; the ticks then run on the simulation's copy while the main thread carries on
+static void take_game_input(FramePipeline* pipeline)
+{
+    SDL_LockMutex(pipeline->input_mutex);
+    simulation_input_buffer.last = (simulation_input_buffer.last + 1) % INPUT_BUFFER_SIZE;
+    simulation_input_buffer.buffer[simulation_input_buffer.last] = game_input_buffer.buffer[game_input_buffer.last];
+    advance_game_input(&game_input_buffer);
+    last_input_time = SDL_GetPerformanceCounter();
+    SDL_UnlockMutex(pipeline->input_mutex);
+}
+
+// Run game_update for every whole tick of real time that has passed, up to MAX_TICKS_PER_FRAME
+// Returns how far we are into the next tick, for game_render to interpolate with
+static float run_simulation_ticks(FramePipeline* pipeline, SimulationClock* clock, int64_t frame_ns)
+{
+    TIMED_FUNCTION();
+    clock->accumulator_ns += frame_ns;
+    int ticks = 0;
+    while (clock->accumulator_ns >= clock->tick_ns)
+    {
+        if (ticks == MAX_TICKS_PER_FRAME)
+        {
+            // death spiral guard: drop the backlog and carry on from here, slower than real time for a moment
+            int64_t dropped = clock->accumulator_ns / clock->tick_ns;
+            clock->dropped_ticks += dropped;
+            clock->accumulator_ns -= dropped * clock->tick_ns;
+            DEBUG_PRINTF("Dropped %lld simulation ticks\n", (long long)dropped);
+            break;
+        }
+
+        // the first tick gets everything gathered since the last one; any more this frame just carry the state on
+        if (ticks == 0)
+        {
+            take_game_input(pipeline);
+        }
+        else
+        {
+            advance_game_input(&simulation_input_buffer);
+        }
+        GameInput* game_input = &simulation_input_buffer.buffer[simulation_input_buffer.last];
+        game_input->dt = (float)clock->tick_ns / 1e9F;
+        game_input->time = (double)clock->tick_count * (double)clock->tick_ns / 1e9;
+        game_code.update(game_memory, &simulation_input_buffer);
+
+        clock->accumulator_ns -= clock->tick_ns;
+        clock->tick_count++;
+        ticks++;
+    }
+    return (float)clock->accumulator_ns / (float)clock->tick_ns;
+}
+
+static SDL_Texture* create_frame_texture(int width, int height)
+{
+    SDL_Texture* new_texture = SDL_CreateTexture(
+        renderer,
+        SDL_PIXELFORMAT_ARGB8888,
+        SDL_TEXTUREACCESS_STREAMING,
+        width,
+        height);
+
+    if(new_texture == NULL)
+    {
+        FATAL_PRINTF("Texture could not be created - SDL_Error: %s\n", SDL_GetError());
+    }
+    return new_texture;
+}
+
+// Game thread
+
+// Run the simulation up to now and draw the frame; on the game thread, or the main thread at depth 1
+static void make_frame(FramePipeline* pipeline, PipelineFrame* frame)
+{
+    TIMED_FUNCTION();
+    int64_t start_time = get_time_ns();
+    float alpha = run_simulation_ticks(pipeline, &simulation_clock, frame->frame_ns);
+    int64_t update_end_time = get_time_ns();
+
+    // push mode is only allowed at depth 1, so the sound buffer is never shared between frames in flight
+    GameRenderBuffer* render_buffer = &frame->render_buffer;
+    game_code.render(game_memory, render_buffer, &game_sound_buffer, alpha);
+
+    if (render_buffer->redraw_all)
+    {
+        // also where the render resolution changes; the copy of the previous frame takes on the new size
+        pipeline->previous_frame_valid = false;
+        pipeline->previous_frame.width = render_buffer->width;
+        pipeline->previous_frame.height = render_buffer->height;
+        pipeline->previous_frame.pitch = render_buffer->pitch;
+    }
+    if (render_buffer->num_dirty_rects == DIRTY_RECTS_UNKNOWN)
+    {
+        if (pipeline->previous_frame.pixels)
+        {
+            find_dirty_tiles(render_buffer, &pipeline->previous_frame, &pipeline->previous_frame_valid);
+        }
+        else
+        {
+            // zero copy: reading back texture memory to compare would cost more than uploading it
+            mark_all_dirty(render_buffer);
+        }
+    }
+    else
+    {
+        // the game is saying what changed, so the copy of the previous frame stops being kept up to date
+        pipeline->previous_frame_valid = false;
+        if (render_buffer->redraw_all)
+        {
+            mark_all_dirty(render_buffer);
+        }
+    }
+
+    frame->update_ns = update_end_time - start_time;
+    frame->render_ns = get_time_ns() - update_end_time;
+}
+
+static int game_thread_proc(void* data)
+{
+    FramePipeline* pipeline = (FramePipeline*)data;
+    NAME_PROFILE_THREAD("game");
+    for (;;)
+    {
+        SDL_SemWait(pipeline->requested);
+        if (pipeline->quit.load(std::memory_order_acquire))
+        {
+            break;
+        }
+        make_frame(pipeline, &pipeline->frames[pipeline->made_count % pipeline->depth]);
+        pipeline->made_count++;
+        SDL_SemPost(pipeline->finished);
+    }
+    return 0;
+}
+
+// Everything is allocated at the largest render resolution, so changing it never allocates
+// Zero copy needs a texture per frame in flight; the first one is the main texture, already tested by the caller
+static void init_frame_pipeline(FramePipeline* pipeline, int depth, int max_width, int max_height, bool zero_copy)
+{
+    pipeline->depth = depth;
+    pipeline->requested_count = 0;
+    pipeline->finished_count = 0;
+    pipeline->made_count = 0;
+    pipeline->quit = false;
+    pipeline->redraw_all = true;
+    pipeline->width = 0;
+    pipeline->height = 0;
+    pipeline->previous_frame_valid = false;
+    memset(&pipeline->previous_frame, 0, sizeof(GameRenderBuffer));
+    memset(&pipeline->stage_times, 0, sizeof(StageTimes));
+
+    for (int i = 0; i < depth; ++i)
+    {
+        PipelineFrame* frame = &pipeline->frames[i];
+        GameRenderBuffer* render_buffer = &frame->render_buffer;
+        render_buffer->pixels = NULL;
+        frame->locked = false;
+        frame->texture = NULL;
+        if (zero_copy)
+        {
+            // pixels and pitch are filled in each time the texture is locked
+            frame->texture = i == 0 ? texture : create_frame_texture(max_width, max_height);
+            continue;
+        }
+
+        int max_size = max_height * max_width * BYTES_PER_PIXEL;
+        render_buffer->pixels = LARGE_ALLOC(max_size);
+        if (render_buffer->pixels == NULL)
+        {
+            FATAL_PRINTF("Couldn't allocate pixels buffer");
+        }
+        prefault_buffer(render_buffer->pixels, max_size, "render buffer");
+    }
+
+    if (!zero_copy)
+    {
+        GameRenderBuffer* previous_frame = &pipeline->previous_frame;
+        previous_frame->pixels = LARGE_ALLOC(max_height * max_width * BYTES_PER_PIXEL);
+        if (previous_frame->pixels == NULL)
+        {
+            FATAL_PRINTF("Couldn't allocate previous frame buffer");
+        }
+    }
+
+    pipeline->requested = SDL_CreateSemaphore(0);
+    pipeline->finished = SDL_CreateSemaphore(0);
+    pipeline->input_mutex = SDL_CreateMutex();
+    if (!pipeline->requested || !pipeline->finished || !pipeline->input_mutex)
+    {
+        FATAL_PRINTF("Couldn't create frame pipeline sync objects - SDL_Error: %s\n", SDL_GetError());
+    }
+}
+
+// Game code has to be loaded and its memory initialized before this
+static void start_game_thread(FramePipeline* pipeline)
+{
+    if (pipeline->depth > 1)
+    {
+        pipeline->thread = SDL_CreateThread(game_thread_proc, "game", pipeline);
+        if (!pipeline->thread)
+        {
+            FATAL_PRINTF("Couldn't create game thread - SDL_Error: %s\n", SDL_GetError());
+        }
+    }
+}
+
+static int frames_in_flight(FramePipeline* pipeline)
+{
+    return (int)(pipeline->requested_count - pipeline->finished_count);
+}
+
+// Hand the next frame to the game thread, or make it right here at depth 1
+static void request_frame(FramePipeline* pipeline, int64_t frame_ns, int width, int height)
+{
+    DEBUG_ASSERT(frames_in_flight(pipeline) < pipeline->depth);
+    PipelineFrame* frame = &pipeline->frames[pipeline->requested_count % pipeline->depth];
+    GameRenderBuffer* render_buffer = &frame->render_buffer;
+    frame->frame_ns = frame_ns;
+    if (width != pipeline->width || height != pipeline->height)
+    {
+        // nothing the game drew before is the right size any more
+        pipeline->width = width;
+        pipeline->height = height;
+        pipeline->redraw_all = true;
+    }
+    render_buffer->width = width;
+    render_buffer->height = height;
+    render_buffer->num_dirty_rects = DIRTY_RECTS_UNKNOWN;
+    render_buffer->redraw_all = pipeline->redraw_all;
+    pipeline->redraw_all = false;
+    if (frame->texture)
+    {
+        // locked here on the main thread, drawn into by the game thread, unlocked when it's presented
+        SDL_Rect rect{0, 0, width, height};
+        if (SDL_LockTexture(frame->texture, &rect, &render_buffer->pixels, &render_buffer->pitch) != 0)
+        {
+            FATAL_PRINTF("Couldn't lock texture - SDL_Error: %s\n", SDL_GetError());
+        }
+        frame->locked = true;
+    }
+    else
+    {
+        // the pool buffer is packed at whatever width this frame is
+        render_buffer->pitch = width * BYTES_PER_PIXEL;
+    }
+    pipeline->requested_count++;
+    if (pipeline->thread)
+    {
+        SDL_SemPost(pipeline->requested);
+    }
+    else
+    {
+        make_frame(pipeline, frame);
+    }
+}
+
+// Oldest frame in flight, once the game thread has finished with it
+// Its slot isn't reused until the next request_frame, so it can be presented until then
+static PipelineFrame* finish_frame(FramePipeline* pipeline)
+{
+    DEBUG_ASSERT(frames_in_flight(pipeline) > 0);
+    if (pipeline->thread)
+    {
+        SDL_SemWait(pipeline->finished);
+    }
+    return &pipeline->frames[pipeline->finished_count++ % pipeline->depth];
+}
+
+// Wait for everything in flight and throw it away
+static void drop_frames_in_flight(FramePipeline* pipeline)
+{
+    while (frames_in_flight(pipeline))
+    {
+        unlock_frame_texture(finish_frame(pipeline));
+    }
+    // the game thinks those were shown, so what it says changed next won't be relative to what's on screen
+    pipeline->redraw_all = true;
+}
+
+static void stop_game_thread(FramePipeline* pipeline)
+{
+    drop_frames_in_flight(pipeline);
+    if (pipeline->thread)
+    {
+        pipeline->quit.store(true, std::memory_order_release);
+        SDL_SemPost(pipeline->requested);
+        SDL_WaitThread(pipeline->thread, NULL);
+        pipeline->thread = NULL;
+    }
+}
+
+static void free_frame_pipeline(FramePipeline* pipeline)
+{
+    SDL_DestroySemaphore(pipeline->requested);
+    SDL_DestroySemaphore(pipeline->finished);
+    SDL_DestroyMutex(pipeline->input_mutex);
+}
+
+// Swap in the code the reload thread loaded, and hand it the old code to unload; main thread, between frames
+static void swap_game_code(GameCodeReloader* reloader)
+{
+    TIMED_FUNCTION();
+    // frames in flight were made by the old code; drop them rather than have the game thread call into it
+    drop_frames_in_flight(&frame_pipeline);
+    // work entries point at callbacks in the old code
+    platform_complete_all_work(&work_queue);
+
+    // the audio callback may be inside the old code; locking waits for it to return
+    GameCode old_game_code = game_code;
+    if (audio_device_id)
+    {
+        SDL_LockAudioDevice(audio_device_id);
+    }
+    game_code = reloader->ready_code;
+    if (audio_device_id)
+    {
+        SDL_UnlockAudioDevice(audio_device_id);
+    }
+
+#ifdef PROFILER
+    // nothing can be running the old code now; take its events while the block names are still mapped
+    if (global_profiler)
+    {
+        collate_profile_events(global_profiler);
+        forget_profile_name_pointers(global_profiler);
+    }
+#endif
+
+    reloader->retired_code = old_game_code;
+    reloader->retired.store(true, std::memory_order_release);
+    reloader->ready.store(false, std::memory_order_release);
+    DEBUG_PRINTF("Reloaded game code\n");
+}
+
+static void record_stage_time(StageTimes* times, FrameStage stage, int64_t ns)
+{
+    times->total_ns[stage] += ns;
+    times->max_ns[stage] = MAX(times->max_ns[stage], ns);
+    times->current_ns[stage] += ns;
+}
+
+// Average and worst time per stage since the last report
+static void print_stage_times(StageTimes* times)
+{
+    if (times->frames == 0)
+    {
+        return;
+    }
+    const char* stage_names[STAGE_COUNT] = {"input", "update", "render", "audio", "wait", "upload", "present", "sleep"};
+    DEBUG_PRINTF("Frame stages over %d frames (avg/max ms):", times->frames);
+    for (int i = 0; i < STAGE_COUNT; ++i)
+    {
+        DEBUG_PRINTF(" %s %.2f/%.2f", stage_names[i], (double)times->total_ns[i] / (double)times->frames / 1e6, (double)times->max_ns[i] / 1e6);
+    }
+    DEBUG_PRINTF("\n");
+    DEBUG_PRINTF("  %d unchanged frames not presented, uploaded %.1f%% of pixels\n", times->skipped_presents,
+        times->frame_pixels ? 100.0 * (double)times->uploaded_pixels / (double)times->frame_pixels : 0.0);
+    if (times->page_faults)
+    {
+        DEBUG_PRINTF("  %lld page faults in %d frames, at most %lld in one\n", (long long)times->page_faults,
+            times->page_fault_frames, (long long)times->max_page_faults);
+    }
+    if (times->merged_input_samples || times->dropped_input_samples)
+    {
+        DEBUG_PRINTF("  input history full: %d stick/mouse samples merged, %d dropped\n", times->merged_input_samples,
+            times->dropped_input_samples);
+    }
+    memset(times, 0, sizeof(StageTimes));
+}
+
+// Scripted input
+
+static const char* BUTTON_NAMES[BUTTON_COUNT] = {
+    "start", "back",
+    "left_shoulder", "left_trigger", "left_stick",
+    "right_shoulder", "right_trigger", "right_stick",
+    "a", "b", "x", "y",
+    "up", "down", "left", "right"
+};
+
+// Read ahead to the next event, skipping anything that isn't one
+static void read_input_script_event(InputScript* script)
+{
+    script->has_next = false;
+    char line[256];
+    while (fgets(line, sizeof(line), script->file))
+    {
+        line[strcspn(line, "\r\n")] = 0;
+        unsigned long long frame;
+        char button_name[64];
+        char state[16];
+        int count = sscanf(line, "%llu %63s %15s", &frame, button_name, state);
+        if (line[0] == '#' || count == EOF)
+        {
+            continue;
+        }
+
+        int button = 0;
+        while (button < BUTTON_COUNT && (count < 2 || strcmp(button_name, BUTTON_NAMES[button]) != 0))
+        {
+            ++button;
+        }
+        bool down = count == 3 && strcmp(state, "down") == 0;
+        if (button == BUTTON_COUNT || count != 3 || (!down && strcmp(state, "up") != 0))
+        {
+            DEBUG_PRINTF("Input script: skipping \"%s\"\n", line);
+            continue;
+        }
+
+        script->next_frame = frame;
+        script->next_button = (ControllerButton)button;
+        script->next_down = down;
+        script->has_next = true;
+        return;
+    }
+}
+
+static void open_input_script(InputScript* script, const char* path)
+{
+    script->file = fopen(path, "r");
+    if (!script->file)
+    {
+        FATAL_PRINTF("Couldn't open %s\n", path);
+    }
+    read_input_script_event(script);
+}
+
+// Everything scheduled up to this frame goes to the keyboard, as if it had just been pressed or released
+static void apply_input_script(InputScript* script, GameInput* game_input, uint64_t frame_index)
+{
+    while (script->has_next && script->next_frame <= frame_index)
+    {
+        set_button(&game_input->controllers[KEYBOARD_INDEX], script->next_button, script->next_down);
+        add_input_sample(game_input, SDL_GetPerformanceCounter(), KEYBOARD_INDEX);
+        read_input_script_event(script);
+    }
+}
+
+// Headless
+
+static int compare_int64(const void* a, const void* b)
+{
+    int64_t x = *(const int64_t*)a;
+    int64_t y = *(const int64_t*)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// CSV on stdout, so it can be compared between runs; everything else goes to stderr
+static void print_headless_report(HeadlessRun* run)
+{
+    const char* column_names[HEADLESS_COLUMNS] = {"input", "update", "render", "audio", "wait", "upload", "present", "sleep", "frame"};
+    int frames = run->frames_run;
+    if (frames == 0)
+    {
+        return;
+    }
+
+    int64_t* sorted = (int64_t*)malloc(sizeof(int64_t) * frames);
+    printf("stage,frames,min_ms,median_ms,p99_ms,max_ms\n");
+    for (int column = 0; column < HEADLESS_COLUMNS; ++column)
+    {
+        for (int i = 0; i < frames; ++i)
+        {
+            sorted[i] = run->stage_ns[i * HEADLESS_COLUMNS + column];
+        }
+        qsort(sorted, frames, sizeof(int64_t), compare_int64);
+        printf("%s,%d,%.4f,%.4f,%.4f,%.4f\n", column_names[column], frames,
+            (double)sorted[0] / 1e6, (double)sorted[frames / 2] / 1e6,
+            (double)sorted[MIN(frames - 1, (int)((double)frames * 0.99))] / 1e6, (double)sorted[frames - 1] / 1e6);
+    }
+    free(sorted);
+}
+
+int main(int argc, char* args[])
+{
+    int input_poll_hz = DEFAULT_INPUT_POLL_HZ;
+    int tick_hz = DEFAULT_TICK_HZ;
+    int pipeline_depth = DEFAULT_PIPELINE_DEPTH;
+    bool dynamic_resolution = true;
+    int trace_frames = 0;
+    bool use_io_uring = true;
+    const char* asset_pack_path = NULL;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(args[i], "--audio-push") == 0)
+        {
+            audio_mode = AUDIO_MODE_PUSH;
+        }
+        else if (strcmp(args[i], "--fixed-rate") == 0)
+        {
+            variable_frame_rate = false;
+        }
+        else if (strcmp(args[i], "--lock-refresh") == 0)
+        {
+            lock_to_display_refresh_rate = true;
+        }
+        else if (strcmp(args[i], "--input-hz") == 0 && i + 1 < argc)
+        {
+            // 0 polls once per frame on the main thread
+            input_poll_hz = atoi(args[++i]);
+            input_poll_hz = MAX(input_poll_hz, 0);
+        }
+        else if (strcmp(args[i], "--tick-hz") == 0 && i + 1 < argc)
+        {
+            tick_hz = atoi(args[++i]);
+            tick_hz = MAX(tick_hz, 1);
+        }
+        else if (strcmp(args[i], "--headless") == 0 && i + 1 < argc)
+        {
+            headless.enabled = true;
+            headless.frames = atoi(args[++i]);
+            headless.frames = MAX(headless.frames, 1);
+        }
+        else if (strcmp(args[i], "--input-script") == 0 && i + 1 < argc)
+        {
+            open_input_script(&input_script, args[++i]);
+        }
+        else if (strcmp(args[i], "--fixed-resolution") == 0)
+        {
+            dynamic_resolution = false;
+        }
+        else if (strcmp(args[i], "--trace") == 0 && i + 1 < argc)
+        {
+            trace_frames = atoi(args[++i]);
+        }
+#ifdef PROFILER
+        else if (strcmp(args[i], "--trace-file") == 0 && i + 1 < argc)
+        {
+            trace_file_path = args[++i];
+        }
+#endif
+        else if (strcmp(args[i], "--no-io-uring") == 0)
+        {
+            // file I/O on worker threads, as on platforms without io_uring
+            use_io_uring = false;
+        }
+        else if (strcmp(args[i], "--asset-pack") == 0 && i + 1 < argc)
+        {
+            asset_pack_path = args[++i];
+        }
+        else if (strcmp(args[i], "--texture-copy") == 0)
+        {
+            zero_copy_present = false;
+        }
+        else if (strcmp(args[i], "--pipeline-depth") == 0 && i + 1 < argc)
+        {
+            pipeline_depth = atoi(args[++i]);
+            pipeline_depth = MIN(MAX(pipeline_depth, 1), MAX_PIPELINE_DEPTH);
+        }
+        else if (strcmp(args[i], "--audio-stats") == 0 && i + 1 < argc)
+        {
+            audio_stats_file = fopen(args[++i], "w");
+            if (!audio_stats_file)
+            {
+                FATAL_PRINTF("Couldn't open %s\n", args[i]);
+            }
+            fprintf(audio_stats_file, "time_s,mode,device_buffer_samples,safety_buffers,latency_ms,callbacks_per_s,underruns,late_callbacks,fades,max_callback_interval_ms,stream_underruns,min_margin_ms\n");
+        }
+    }
+    if (headless.enabled)
+    {
+        // the same work every run: sound is made on the main thread where it can be timed, frames are made in
+        // order, and nothing adapts to how fast this machine is
+        audio_mode = AUDIO_MODE_PULL;
+        pipeline_depth = 1;
+        variable_frame_rate = false;
+        dynamic_resolution = false;
+        SDL_setenv("SDL_VIDEODRIVER", "dummy", 1);
+        SDL_setenv("SDL_AUDIODRIVER", "dummy", 1);
+        headless.frames_run = 0;
+        headless.stage_ns = (int64_t*)calloc((size_t)headless.frames * HEADLESS_COLUMNS, sizeof(int64_t));
+        if (!headless.stage_ns)
+        {
+            FATAL_PRINTF("Couldn't allocate headless stage times\n");
+        }
+        DEBUG_PRINTF("Headless: %d frames\n", headless.frames);
+    }
+    DEBUG_PRINTF("Audio mode: %s\n", audio_mode == AUDIO_MODE_PULL ? "pull" : "push");
+    if (audio_mode == AUDIO_MODE_PUSH && pipeline_depth > 1)
+    {
+        // the write target is worked out from the play cursor at the start of the frame that writes the sound
+        DEBUG_PRINTF("Push audio needs pipeline depth 1\n");
+        pipeline_depth = 1;
+    }
+    DEBUG_PRINTF("Pipeline depth: %d\n", pipeline_depth);
+
+    int width = 800;
+    int height = 600;
+
+    // Init SDL
+    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_GAMECONTROLLER | SDL_INIT_AUDIO) < 0)
+    {
+        FATAL_PRINTF("SDL couldn't be initialized - SDL_Error: %s\n", SDL_GetError());
+    }
+
+#ifdef PROFILER
+    // before any other thread starts, so they all see it
+    global_profiler = (Profiler*)LARGE_ALLOC(sizeof(Profiler));
+    if (!global_profiler)
+    {
+        FATAL_PRINTF("Couldn't allocate profiler\n");
+    }
+    init_profiler(global_profiler, measure_profile_clocks_per_ms());
+    DEBUG_PRINTF("Profiler: %.0f clocks/ms, %.1f MiB; press p for a report, t to capture a trace\n", global_profiler->clocks_per_ms, (double)sizeof(Profiler) / (double)MEBIBYTES(1));
+    NAME_PROFILE_THREAD("main");
+    if (trace_frames > 0)
+    {
+        request_trace_capture(trace_frames, trace_file_path);
+    }
+#else
+    if (trace_frames > 0)
+    {
+        DEBUG_PRINTF("--trace needs a build with PROFILER\n");
+    }
+#endif
+
+    // Get the path we're running in
+    executable_path = SDL_GetBasePath();
+    if (!executable_path) {
+        executable_path = SDL_strdup("./");
+    }
+
+    // Create Window and Renderer
+
+    window = SDL_CreateWindow(
+        "Game",
+        SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
+        width, height,
+        SDL_WINDOW_RESIZABLE);
+
+    if(window == NULL)
+    {
+        FATAL_PRINTF("Window could not be created - SDL_Error: %s\n", SDL_GetError());
+    }
+
+    // the dummy video driver only has the software renderer
+    renderer = SDL_CreateRenderer(window, -1, headless.enabled ? SDL_RENDERER_SOFTWARE : SDL_RENDERER_ACCELERATED);
+
+    if(renderer == NULL)
+    {
+        FATAL_PRINTF("Renderer could not be created - SDL_Error: %s\n", SDL_GetError());
+    }
+
+    if (lock_to_display_refresh_rate)
+    {
+        SDL_DisplayMode display_mode;
+        if (SDL_GetCurrentDisplayMode(SDL_GetWindowDisplayIndex(window), &display_mode) == 0 && display_mode.refresh_rate > 0)
+        {
+            target_framerate = display_mode.refresh_rate;
+        }
+        else
+        {
+            DEBUG_PRINTF("Display refresh rate unknown, staying at %d Hz\n", target_framerate);
+        }
+    }
+    DEBUG_PRINTF("Target frame rate: %d Hz\n", target_framerate);
+    simulation_clock.tick_ns = 1000000000LL / tick_hz;
+    DEBUG_PRINTF("Simulation tick rate: %d Hz\n", tick_hz);
+
+    // Initialize rendering buffer
+    // big enough for a window covering the whole display, so resizing never has to allocate
+    int max_width = width;
+    int max_height = height;
+    SDL_DisplayMode desktop_mode;
+    if (SDL_GetDesktopDisplayMode(SDL_GetWindowDisplayIndex(window), &desktop_mode) == 0)
+    {
+        max_width = MAX(max_width, desktop_mode.w);
+        max_height = MAX(max_height, desktop_mode.h);
+    }
+    init_resolution_scaler(&resolution_scaler, dynamic_resolution, width, height, max_width, max_height);
+    DEBUG_PRINTF("Render buffer pool: %dx%d%s\n", max_width, max_height, dynamic_resolution ? ", dynamic resolution" : "");
+    SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear");
+
+    texture = create_frame_texture(max_width, max_height);
+    if (zero_copy_present)
+    {
+        void* locked_pixels;
+        int locked_pitch;
+        if (SDL_LockTexture(texture, NULL, &locked_pixels, &locked_pitch) == 0)
+        {
+            SDL_UnlockTexture(texture);
+        }
+        else
+        {
+            DEBUG_PRINTF("Can't lock streaming textures, copying frames instead - SDL_Error: %s\n", SDL_GetError());
+            zero_copy_present = false;
+        }
+    }
+    DEBUG_PRINTF("Presenting with %s\n", zero_copy_present ? "locked textures (zero copy)" : "SDL_UpdateTexture (copy)");
+
+    // one per frame in flight
+    init_frame_pipeline(&frame_pipeline, pipeline_depth, max_width, max_height, zero_copy_present);
+
+    // Initialize audio
+
+    // TODO store the name of the device for debugging and/or settings menu stuff (must be copied)
+    // WARNING I don't think this index always equals the audio device id, because devices can change at runtime
+    int num_audio_devices = SDL_GetNumAudioDevices(0); // iscapture = 0
+    DEBUG_PRINTF("Audio devices:\n");
+    for (int i = 0; i < num_audio_devices; ++i)
+    {
+        DEBUG_PRINTF("  %d: %s\n", i, SDL_GetAudioDeviceName(i, 0));
+    }
+
+    audio_stats.min_margin = INT32_MAX;
+    if (!open_audio_device(INITIAL_SDL_AUDIO_BUFFER_SAMPLES))
+    {
+        FATAL_PRINTF("Couldn't open audio device\n");
+    }
+    DEBUG_PRINTF("Audio device selected: %d\n", audio_device_id);
+
+    audio_latency.safety_buffers = MIN_SAFETY_BUFFERS;
+    audio_latency.quiet_windows_to_shrink = INITIAL_QUIET_WINDOWS_TO_SHRINK;
+    audio_latency.windows_since_shrink = MAX_QUIET_WINDOWS_TO_SHRINK;
+
+    DEBUG_PRINTF("Audio silence: %d\n", audio_settings.silence);
+    DEBUG_PRINTF("SDL audio buffer size: %d\n", audio_settings.size);
+
+    // initialize ring buffer before the callback starts
+    audio_ring_buffer.size = BYTES_PER_AUDIO_SAMPLE * AUDIO_RING_BUFFER_SIZE_SAMPLES;
+    audio_ring_buffer.mask = (uint32_t)audio_ring_buffer.size - 1;
+    audio_ring_buffer.silence = audio_settings.silence;
+    DEBUG_ASSERT((int)audio_settings.size <= audio_ring_buffer.size);
+
+    audio_ring_buffer.write_cursor = 0;
+    audio_ring_buffer.play_cursor = 0;
+    audio_ring_buffer.underrun_count = 0;
+    audio_ring_buffer.faded_out = false;
+
+    // only push mode goes through the ring buffer; the pull callback asks the game directly
+    if (audio_mode == AUDIO_MODE_PUSH)
+    {
+        DEBUG_PRINTF("Audio ring buffer size: %d\n", audio_ring_buffer.size);
+        audio_ring_buffer.data = LARGE_ALLOC(audio_ring_buffer.size);
+        if (!audio_ring_buffer.data)
+        {
+            FATAL_PRINTF("Couldn't allocate audio ring buffer\n");
+        }
+        prefault_buffer(audio_ring_buffer.data, audio_ring_buffer.size, "audio ring buffer");
+
+        // fill ring buffer with silence
+        memset(audio_ring_buffer.data, audio_settings.silence, audio_ring_buffer.size);
+    }
+
+    // Initialize worker threads; the main thread also runs work while it waits, so leave a core for it
+    init_work_queue(&work_queue, SDL_GetCPUCount() - 1);
+    init_file_queue(&file_queue, use_io_uring);
+    init_audio_streams(&audio_streams, AUDIO_SAMPLES_PER_SECOND, audio_latency.device_buffer_samples);
+
+    // init game code; the first load is synchronous, later ones happen on the reload thread
+    init_game_code_reloader(&game_code_reloader, executable_path);
+    if (!load_game_object(&game_code_reloader, &game_code))
+    {
+        FATAL_PRINTF("Couldn't load game code from %s\n", game_code_reloader.object_path);
+    }
+    start_game_code_reloader(&game_code_reloader);
+
+    // assets; next to the executable unless given
+    char default_asset_pack_path[MAX_PATH_LENGTH];
+    if (!asset_pack_path)
+    {
+        SDL_strlcpy(default_asset_pack_path, executable_path, MAX_PATH_LENGTH);
+        SDL_strlcat(default_asset_pack_path, "assets.pack", MAX_PATH_LENGTH);
+        asset_pack_path = default_asset_pack_path;
+    }
+    open_asset_pack(&asset_pack, asset_pack_path);
+
+    // init game memory
+    game_memory.memory_size = GIBIBYTES(1);
+#ifdef FIXED_GAME_MEMORY
+    // same address every run, so pointers in game memory stay valid across runs and reloads
+    uint64_t game_memory_address = TEBIBYTES(2);
+#else
+    uint64_t game_memory_address = 0;
+#endif
+#ifdef HUGE_PAGE_GAME_MEMORY
+    game_memory.memory = LARGE_ALLOC_HUGE(game_memory.memory_size, game_memory_address);
+#else
+    game_memory.memory = LARGE_ALLOC_FIXED(game_memory.memory_size, game_memory_address);
+#endif
+
+    if (!game_memory.memory)
+    {
+        FATAL_PRINTF("Couldn't allocate game memory\n");
+    }
+    DEBUG_PRINTF("Game memory at %p\n", game_memory.memory);
+    game_memory.work_queue = &work_queue;
+    game_memory.num_work_threads = work_queue.num_workers + 1;
+    game_memory.platform_add_work_entry = platform_add_work_entry;
+    game_memory.platform_complete_all_work = platform_complete_all_work;
+    game_memory.file_queue = &file_queue;
+    game_memory.platform_read_file = platform_read_file;
+    game_memory.platform_write_file = platform_write_file;
+    game_memory.platform_poll_file = platform_poll_file;
+    game_memory.platform_wait_file = platform_wait_file;
+    game_memory.asset_pack = &asset_pack;
+    game_memory.platform_get_asset = platform_get_asset;
+    game_memory.platform_prefetch_asset_group = platform_prefetch_asset_group;
+    game_memory.audio_streams = &audio_streams;
+    game_memory.platform_open_audio_stream = platform_open_audio_stream;
+    game_memory.platform_close_audio_stream = platform_close_audio_stream;
+    game_memory.platform_read_audio_stream = platform_read_audio_stream;
+    game_memory.DEBUG_platform_read_entire_file = DEBUG_platform_read_entire_file;
+    game_memory.DEBUG_platform_free_file_memory = DEBUG_platform_free_file_memory;
+    game_memory.DEBUG_platform_write_entire_file = DEBUG_platform_write_entire_file;
+#ifdef PROFILER
+    game_memory.profiler = global_profiler;
+#endif
+
+    game_code.init_memory(game_memory);
+
+    // init game audio
+    game_sound_buffer_max_size = AUDIO_SAMPLES_PER_SECOND * BYTES_PER_AUDIO_SAMPLE;
+    game_sound_buffer.buffer_size = game_sound_buffer_max_size;
+    game_sound_buffer.buffer = LARGE_ALLOC(game_sound_buffer.buffer_size);
+    if (!game_sound_buffer.buffer)
+    {
+        FATAL_PRINTF("Couldn't allocate game sound buffer\n");
+    }
+    prefault_buffer(game_sound_buffer.buffer, game_sound_buffer.buffer_size, "game sound buffer");
+    game_sound_buffer.samples_per_second = audio_settings.freq;
+    game_sound_buffer.bytes_per_sample = BYTES_PER_AUDIO_SAMPLE;
+    game_sound_buffer.num_channels = NUM_AUDIO_CHANNELS;
+
+    // init game input
     memset(&game_input_buffer, 0, sizeof(GameInputBuffer));
     for (int i = 0; i < INPUT_BUFFER_SIZE; ++i)
     {
         game_input_buffer.buffer[i].controllers[KEYBOARD_INDEX].is_keyboard = true;
         game_input_buffer.buffer[i].controllers[KEYBOARD_INDEX].plugged_in = true;
     }
+    simulation_input_buffer = game_input_buffer;
     int num_joysticks = SDL_NumJoysticks();
     for (int joy_index = 0; joy_index < num_joysticks; ++joy_index)
     {
         add_controller(joy_index);
     }
+    if (input_poll_hz > 0)
+    {
+        start_input_thread(&input_thread, input_poll_hz);
+    }
+    DEBUG_PRINTF("Gamepads polled at %d Hz%s\n", input_poll_hz, input_poll_hz > 0 ? " on the input thread" : " (once per frame)");
 
     // Now do the game loop
     SDL_Event e;
 
     // timer
-    uint64_t frame_start_time = SDL_GetPerformanceCounter();
-
-
-    // Use this to compute how far ahead we should write audio (also determines our audio latency)
-    const int SAMPLES_PER_FRAME_COUNT = 30;
-    int avg_samples_per_frame = APPROX_AUDIO_SAMPLES_PER_FRAME;                   // bootstrap; estimate/ideal
-    int avg_samples_since_start_of_frame = 0;
-    int play_sample_set_target = 0;
-    int play_sample_write_data = 0;
+    init_frame_scheduler(&frame_scheduler, target_framerate);
+    init_frame_rate_governor(&frame_rate_governor, target_framerate);
+    int64_t next_frame_report_time = frame_scheduler.start_time + (int64_t)FRAME_REPORT_SECONDS * 1000000000;
+    last_input_time = SDL_GetPerformanceCounter();
+    uint64_t frame_index = 0;
+    int64_t frame_start_page_faults = get_page_fault_count();
+
+    audio_write_state.avg_samples_per_frame = AUDIO_SAMPLES_PER_SECOND / frame_rate_governor.frame_rate;   // bootstrap; estimate/ideal
+
+    // everything the audio thread needs is ready
+    audio_latency.window_start_time = SDL_GetPerformanceCounter();
+    if (!headless.enabled)
+    {
+        SDL_PauseAudioDevice(audio_device_id, 0); /* start audio playing. */
+    }
+    start_game_thread(&frame_pipeline);
 
     while(running)
     {
+        int64_t frame_start_time = get_time_ns();
+        BEGIN_TIMED_BLOCK("frame");
+        StageTimes* stage_times = &frame_pipeline.stage_times;
+        memset(stage_times->current_ns, 0, sizeof(stage_times->current_ns));
+
         // Get initial play cursor
-        SDL_LockAudioDevice(audio_device_id);
-        int play_sample_init = audio_ring_buffer.play_index / BYTES_PER_AUDIO_SAMPLE;
-        SDL_UnlockAudioDevice(audio_device_id);
+        audio_write_state.play_cursor_init = audio_ring_buffer.play_cursor.load(std::memory_order_acquire);
 
         // Input
-        // advance game input buffer, and clear next entry
-        game_input_buffer.last = (game_input_buffer.last + 1) % INPUT_BUFFER_SIZE;
-        memset(&game_input_buffer.buffer[game_input_buffer.last], 0, sizeof(GameInput));
-        // copy previous keyboard state (otherwise keys only fire on each keyboard event bounded by OS repeat rate)
-        game_input_buffer.buffer[game_input_buffer.last].controllers[KEYBOARD_INDEX] = \
-            game_input_buffer.buffer[(game_input_buffer.last + INPUT_BUFFER_SIZE - 1) % INPUT_BUFFER_SIZE].controllers[KEYBOARD_INDEX];
-        
+        // gathered into the current entry of the input buffer, which keeps collecting until a tick runs
+        // the game thread takes it and starts the next entry when one does, so hold the lock until we're done with it
+        int64_t input_start_time = get_time_ns();
+        BEGIN_TIMED_BLOCK("input");
+        SDL_LockMutex(frame_pipeline.input_mutex);
+        GameInput* game_input = &game_input_buffer.buffer[game_input_buffer.last];
         while (SDL_PollEvent(&e))
         {
             handle_event(&e);
         }
-        poll_controllers();
+        if (input_thread.thread)
+        {
+            drain_input_samples(&input_thread, game_input);
+        }
+        else
+        {
+            poll_controllers();
+        }
         poll_mouse();
+        if (input_script.file)
+        {
+            apply_input_script(&input_script, game_input, frame_index);
+        }
+        game_input->num_controllers = 1; // keyboard
+        for (int i = 0; i < MAX_GAMECONTROLLERS; ++i)
+        {
+            game_input->num_controllers += game_input->controllers[i].plugged_in ? 1 : 0;
+        }
+        SDL_UnlockMutex(frame_pipeline.input_mutex);
+        END_TIMED_BLOCK("input");
+        record_stage_time(stage_times, STAGE_INPUT, get_time_ns() - input_start_time);
 
-        // Reload the game code if we want to
-        if (do_load_game_code)
-        {
-            load_game_code();
-            do_load_game_code = false;
-        }
-
-        // Rendering and audio
-        SDL_SetRenderDrawColor(renderer, 0x50, 0x00, 0x50, 0xFF);
-        SDL_RenderClear(renderer);
-
-        /*
-         *  How audio works (lots of buffers)
-         *  - In this loop:
-         *      - We figure out how far ahead we need to write so the audio doesn't skip
-         *      - Game code fills a sound buffer
-         *      - We copy it to the ring buffer
-         *  - In SDL's callback function (run in another thread), we copy from the ring buffer to SDL's internal buffer
-         *  - SDL copies to the platform's sound buffer
-         * 
-         *  We need to tell the game code to give us more than 1 frame of sound, or there could be skips!
-         * 
-         *  Frame timeline 
-         * 
-         * |----------------------------------------------|----------------------------------------------|
-         *     ^ |---(get sound from game)---| ^                ^                          ^
-         *  set target                    write data        set target                  write data
-         *                                                                  (need to get here before play catches up) 
-         * 
-         *  We need to ask the game for enough sound data to get us to the end of the next frame
-         *  So, starting at set target, we need to set our target at the end of the next frame
-         *  This is just 2 frames minus the first bit of the frame before set target
-         *  We use rolling exponentially weighted averages of the number of samples between each frame to hopefully make it more accurate
-         */
-
-        // Set audio target
-        SDL_LockAudioDevice(audio_device_id);
-        int new_play_sample_set_target = audio_ring_buffer.play_index / BYTES_PER_AUDIO_SAMPLE;
-        SDL_UnlockAudioDevice(audio_device_id);
-
-        int samples_since_last_frame_set_target = DIST_IN_RING_BUFFER(play_sample_set_target, new_play_sample_set_target, AUDIO_RING_BUFFER_SIZE_SAMPLES);
-        int samples_since_start_of_frame = DIST_IN_RING_BUFFER(play_sample_init, new_play_sample_set_target, AUDIO_RING_BUFFER_SIZE_SAMPLES);
-        avg_samples_since_start_of_frame = (int)EXP_WEIGHTED_AVG(avg_samples_since_start_of_frame, SAMPLES_PER_FRAME_COUNT, samples_since_start_of_frame);
-
-        play_sample_set_target = new_play_sample_set_target;
-
-        // 2 frames minus any samples from the start of this frame, plus one sdl buffer size for safety
-        // TODO extra SDL buffer here is probably not needed
-        int target_samples_ahead = (avg_samples_per_frame * 2 - avg_samples_since_start_of_frame) + SDL_AUDIO_BUFFER_SAMPLES;
-
-        //DEBUG_PRINTF("avg samples in frame %d\n", avg_samples_per_frame);
-        //DEBUG_PRINTF("avg samples since start of frame: %d\n", avg_samples_since_start_of_frame);
-        //DEBUG_PRINTF("target samples ahead: %d\n", target_samples_ahead);
-        int rem = target_samples_ahead % SDL_AUDIO_BUFFER_SAMPLES;
-        target_samples_ahead += (SDL_AUDIO_BUFFER_SAMPLES - rem);
-
-        int target_index = ((play_sample_set_target + target_samples_ahead) * BYTES_PER_AUDIO_SAMPLE) % audio_ring_buffer.size;
-        // round to multiple of sdl buffer size
-        int region_size_1 = 0, region_size_2 = 0;
+        // Swap in new game code if the reload thread has it ready
+        if (game_code_reloader.ready.load(std::memory_order_acquire))
+        {
+            swap_game_code(&game_code_reloader);
+        }
 
-        // get region/s to fill (2 cases because of circular buffer)
-        if (audio_ring_buffer.write_index <= target_index)
+        // Audio
+        if (audio_mode == AUDIO_MODE_PUSH)
         {
-            region_size_1 = target_index - audio_ring_buffer.write_index;
-            region_size_2 = 0;
+            set_audio_target(&audio_write_state);
         }
         else
         {
-            region_size_1 = audio_ring_buffer.size - audio_ring_buffer.write_index;
-            region_size_2 = target_index;
+            // the audio thread pulls sound with game_get_sound_samples
+            game_sound_buffer.buffer_size = 0;
         }
 
-        game_sound_buffer.buffer_size = region_size_1 + region_size_2;
-        //DEBUG_PRINTF("game sound buffer samples size %d\n", game_sound_buffer.buffer_size / BYTES_PER_AUDIO_SAMPLE);
-
         // Call the game code
-        game_code.update_and_render(game_memory, &game_input_buffer, &game_render_buffer, &game_sound_buffer);
-
-        // Write audio data to the ring buffer
-        SDL_LockAudioDevice(audio_device_id);
+        // at depth 1 this makes the frame right here; otherwise we present the one the game thread made earlier
+        // headless frames all count as the target frame length, however long they really took
+        int64_t frame_ns = headless.enabled ? frame_scheduler.frame_ns : frame_scheduler.last_frame_ns;
+        if (headless.enabled)
+        {
+            // without input most frames change nothing, and the upload and present they'd skip are what we're timing
+            frame_pipeline.redraw_all = true;
+        }
+        request_frame(&frame_pipeline, frame_ns, resolution_scaler.width, resolution_scaler.height);
+        PipelineFrame* frame = NULL;
+        if (frames_in_flight(&frame_pipeline) == frame_pipeline.depth)
         {
-            int new_play_sample_write_data = audio_ring_buffer.play_index / BYTES_PER_AUDIO_SAMPLE;
-            int samples_since_last_frame_write_data = DIST_IN_RING_BUFFER(play_sample_write_data, new_play_sample_write_data, AUDIO_RING_BUFFER_SIZE_SAMPLES);
+            int64_t wait_start_time = get_time_ns();
+            BEGIN_TIMED_BLOCK("wait_for_game_thread");
+            frame = finish_frame(&frame_pipeline);
+            END_TIMED_BLOCK("wait_for_game_thread");
+            record_stage_time(stage_times, STAGE_WAIT, get_time_ns() - wait_start_time);
+        }
 
-            // avg of this frame
-            float avg_this_frame = ((float)samples_since_last_frame_set_target + (float)samples_since_last_frame_write_data) / 2.0F;
-            // exponentially weighted rolling average
-            avg_samples_per_frame = (int)EXP_WEIGHTED_AVG(avg_samples_per_frame, SAMPLES_PER_FRAME_COUNT, avg_this_frame);
+        if (audio_mode == AUDIO_MODE_PUSH)
+        {
+            write_audio_frame(&audio_write_state);
+        }
+        if (headless.enabled)
+        {
+            // the device is never started; make a frame's worth of sound here instead, as the callback would
+            int64_t audio_start_time = get_time_ns();
+            BEGIN_TIMED_BLOCK("headless_audio");
+            GameSoundBuffer sound_buffer = game_sound_buffer;
+            sound_buffer.buffer_size = (int)(AUDIO_SAMPLES_PER_SECOND * frame_ns / 1000000000) * BYTES_PER_AUDIO_SAMPLE;
+            set_audio_stream_request_frames(&audio_streams, sound_buffer.buffer_size / BYTES_PER_AUDIO_SAMPLE);
+            game_code.get_sound_samples(game_memory, &sound_buffer);
+            END_TIMED_BLOCK("headless_audio");
+            record_stage_time(stage_times, STAGE_AUDIO, get_time_ns() - audio_start_time);
+        }
+        else
+        {
+            update_audio_latency(&audio_latency, SDL_GetPerformanceCounter());
+            set_audio_stream_request_frames(&audio_streams, get_audio_request_samples());
+        }
 
-            play_sample_write_data = new_play_sample_write_data;
+        // Actually render to the screen; nothing to show until the pipeline has filled
+        if (frame)
+        {
+            record_stage_time(stage_times, STAGE_UPDATE, frame->update_ns);
+            record_stage_time(stage_times, STAGE_RENDER, frame->render_ns);
+            stage_times->frames++;
+            stage_times->frame_pixels += (int64_t)frame->render_buffer.width * frame->render_buffer.height;
 
-            if (game_sound_buffer.buffer_size)
+            if (frame->render_buffer.num_dirty_rects == 0)
             {
-
-                void* region = (void*)&((int8_t*)audio_ring_buffer.data)[audio_ring_buffer.write_index];
-
-                memcpy(region, game_sound_buffer.buffer, region_size_1);
-                if (region_size_2)
+                // nothing changed; whatever is on screen stays there
+                unlock_frame_texture(frame);
+                stage_times->skipped_presents++;
+            }
+            else
+            {
+                int64_t upload_start_time = get_time_ns();
+                SDL_SetRenderDrawColor(renderer, 0x50, 0x00, 0x50, 0xFF);
+                SDL_RenderClear(renderer);
+                int64_t uploaded_pixels = render_offscreen_buffer(frame);
+                stage_times->uploaded_pixels += uploaded_pixels;
+                PROFILE_COUNTER("uploaded_pixels", uploaded_pixels);
+                int64_t present_start_time = get_time_ns();
+                BEGIN_TIMED_BLOCK("present");
+                SDL_RenderPresent(renderer);
+                END_TIMED_BLOCK("present");
+                record_stage_time(stage_times, STAGE_UPLOAD, present_start_time - upload_start_time);
+                record_stage_time(stage_times, STAGE_PRESENT, get_time_ns() - present_start_time);
+
+                if (update_resolution_scaler(&resolution_scaler, frame->render_ns + (present_start_time - upload_start_time), frame_scheduler.frame_ns))
                 {
-                    memcpy(audio_ring_buffer.data, (void*)&((int8_t*)game_sound_buffer.buffer)[region_size_1], region_size_2);
+                    DEBUG_PRINTF("Render resolution: %dx%d (%.0f%%)\n", resolution_scaler.width, resolution_scaler.height, resolution_scaler.scale * 100.0F);
                 }
-
-                audio_ring_buffer.write_index = (audio_ring_buffer.write_index + region_size_1 + region_size_2) % audio_ring_buffer.size;
-
             }
         }
-        SDL_UnlockAudioDevice(audio_device_id);
 
-        // Actually render to the screen
-        render_offscreen_buffer(&game_render_buffer);
-        SDL_RenderPresent(renderer);
-        
         // Timing
-        uint64_t frame_end_time = SDL_GetPerformanceCounter();
-        float frame_time_ms = 1000.0F * (float)(frame_end_time - frame_start_time)/(float)SDL_GetPerformanceFrequency();
-        float diff_ms = target_frame_ms - frame_time_ms;
-        int loops = 0;
-        while (diff_ms > 0.0F)
+        int64_t frame_end_time;
+        if (headless.enabled)
         {
-            if (diff_ms > 1.1F)
+            // as fast as possible
+            frame_end_time = get_time_ns();
+            int64_t* row = &headless.stage_ns[headless.frames_run * HEADLESS_COLUMNS];
+            memcpy(row, stage_times->current_ns, sizeof(stage_times->current_ns));
+            row[HEADLESS_FRAME_COLUMN] = frame_end_time - frame_start_time;
+            if (++headless.frames_run == headless.frames)
             {
-                SDL_Delay((uint32_t)diff_ms);
+                running = false;
             }
-            frame_end_time = SDL_GetPerformanceCounter();
-            frame_time_ms = 1000.0F * (float)(frame_end_time - frame_start_time)/(float)SDL_GetPerformanceFrequency();
-            diff_ms = target_frame_ms - frame_time_ms;
-            loops++;
         }
-        //DEBUG_PRINTF("loops: %d\n", loops);
-        //DEBUG_PRINTF("frame_time_ms: %lf\n", frame_time_ms);
-        frame_start_time = frame_end_time;
+        else
+        {
+            int64_t sleep_start_time = get_time_ns();
+            BEGIN_TIMED_BLOCK("sleep");
+            frame_end_time = wait_for_next_frame(&frame_scheduler);
+            END_TIMED_BLOCK("sleep");
+            record_stage_time(stage_times, STAGE_SLEEP, frame_end_time - sleep_start_time);
+        }
+        if (variable_frame_rate && update_frame_rate_governor(&frame_rate_governor, &frame_scheduler))
+        {
+            DEBUG_PRINTF("Frame rate: %d Hz\n", frame_rate_governor.frame_rate);
+            // the write-ahead estimate is in samples per frame, so restart it from the new frame length
+            audio_write_state.avg_samples_per_frame = AUDIO_SAMPLES_PER_SECOND / frame_rate_governor.frame_rate;
+        }
+
+        // Page faults (any thread) since the start of the frame; reported with the stage times
+        int64_t frame_end_page_faults = get_page_fault_count();
+        int64_t frame_page_faults = frame_end_page_faults - frame_start_page_faults;
+        if (frame_page_faults)
+        {
+            stage_times->page_faults += frame_page_faults;
+            stage_times->max_page_faults = MAX(stage_times->max_page_faults, frame_page_faults);
+            stage_times->page_fault_frames++;
+        }
+        frame_start_page_faults = frame_end_page_faults;
+
+        if (frame_end_time >= next_frame_report_time)
+        {
+            print_frame_times(&frame_scheduler, false);
+            print_stage_times(stage_times);
+            next_frame_report_time += (int64_t)FRAME_REPORT_SECONDS * 1000000000;
+        }
+        frame_index++;
+
+        END_TIMED_BLOCK("frame");
+#ifdef PROFILER
+        end_profile_frame(global_profiler);
+#endif
 
     }
 
+    stop_game_thread(&frame_pipeline);
+#ifdef PROFILER
+    stop_trace_capture(global_profiler);
+#endif
+    free_frame_pipeline(&frame_pipeline);
+    print_frame_times(&frame_scheduler, true);
+    print_stage_times(&frame_pipeline.stage_times);
+    if (headless.enabled)
+    {
+        print_headless_report(&headless);
+        free(headless.stage_ns);
+    }
+    if (input_script.file)
+    {
+        fclose(input_script.file);
+    }
+    DEBUG_PRINTF("Simulation: %llu ticks, %llu dropped\n", (unsigned long long)simulation_clock.tick_count, (unsigned long long)simulation_clock.dropped_ticks);
+    free_frame_scheduler(&frame_scheduler);
+    stop_input_thread(&input_thread);
+    stop_game_code_reloader(&game_code_reloader);
+    free_file_queue(&file_queue);
+    close_asset_pack(&asset_pack);
+    free_work_queue(&work_queue);
     SDL_CloseAudioDevice(audio_device_id);
+    free_audio_streams(&audio_streams);
+    if (audio_stats_file)
+    {
+        fclose(audio_stats_file);
+    }
     SDL_DestroyWindow(window);
     SDL_Quit();
 
@@ -1,13 +1,28 @@
 #include<limits.h>
+#include<atomic>
 
 #ifdef _WIN32
 #include<windows.h>
+#include<psapi.h>
 #include<SDL.h>
 
 #define GAME_CODE_OBJECT_FILE "game.dll"
 #define LARGE_ALLOC(SZ) VirtualAlloc(NULL, (SZ), MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE)
 #define LARGE_ALLOC_FIXED(SZ, ADDR) VirtualAlloc((LPVOID)(ADDR), (SZ), MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE)
+// TODO large pages on windows (MEM_LARGE_PAGES needs SeLockMemoryPrivilege)
+#define LARGE_ALLOC_HUGE(SZ, ADDR) LARGE_ALLOC_FIXED((SZ), (ADDR))
 #define LARGE_FREE(PTR,SZ) DEBUG_ASSERT(VirtualFree((PTR), 0, MEM_RELEASE))
+#define LOCK_MEMORY(PTR, SZ) (VirtualLock((PTR), (SZ)) != 0)
+
+static inline int64_t get_page_fault_count()
+{
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+    {
+        return 0;
+    }
+    return (int64_t)counters.PageFaultCount;
+}
 
 static const int MAX_PATH_LENGTH = MAX_PATH;
 
@@ -15,13 +30,64 @@ static const int MAX_PATH_LENGTH = MAX_PATH;
 
 #ifdef __linux__
 #include<sys/mman.h>
+#include<sys/resource.h>
 #include<SDL2/SDL.h>
 
+// added in linux 4.17; older kernels ignore it and treat the address as a hint, which linux_large_alloc checks for
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
 #define GAME_CODE_OBJECT_FILE "game.so"
-#define LARGE_ALLOC(X) mmap(NULL, (X), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0)
-// TODO fixed alloc on linux
-#define LARGE_ALLOC_FIXED(SZ, ADDR) LARGE_ALLOC(SZ)
+#define LARGE_ALLOC(X) linux_large_alloc((X), 0, false)
+#define LARGE_ALLOC_FIXED(SZ, ADDR) linux_large_alloc((SZ), (ADDR), false)
+#define LARGE_ALLOC_HUGE(SZ, ADDR) linux_large_alloc((SZ), (ADDR), true)
 #define LARGE_FREE(X,Y) munmap((X), (Y))
+#define LOCK_MEMORY(PTR, SZ) (mlock((PTR), (SZ)) == 0)
+
+// Returns NULL on failure (not MAP_FAILED)
+// If addr is nonzero, the memory is mapped exactly there or not at all; it never replaces an existing mapping
+// If huge is set, tries reserved huge pages (MAP_HUGETLB) first, then falls back to transparent huge pages
+static inline void* linux_large_alloc(uint64_t size, uint64_t addr, bool huge)
+{
+    int flags = MAP_ANONYMOUS | MAP_PRIVATE | (addr ? MAP_FIXED_NOREPLACE : 0);
+    void* result = MAP_FAILED;
+
+    if (huge)
+    {
+        result = mmap((void*)addr, size, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+    }
+    if (result == MAP_FAILED)
+    {
+        result = mmap((void*)addr, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (result != MAP_FAILED && huge)
+        {
+            // no reserved huge pages; ask for transparent ones (only a hint, fine if it fails)
+            madvise(result, size, MADV_HUGEPAGE);
+        }
+    }
+    if (result == MAP_FAILED)
+    {
+        return NULL;
+    }
+    if (addr && result != (void*)addr)
+    {
+        munmap(result, size);
+        return NULL;
+    }
+    return result;
+}
+
+// minor + major faults for the whole process, including the audio thread
+static inline int64_t get_page_fault_count()
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage))
+    {
+        return 0;
+    }
+    return (int64_t)usage.ru_minflt + (int64_t)usage.ru_majflt;
+}
 
 static const int MAX_PATH_LENGTH = PATH_MAX;
 
@@ -30,18 +96,203 @@ static const int MAX_PATH_LENGTH = PATH_MAX;
 
 
 #include"game_platform_interface.h"
+#include"spsc_queue.h"
+#include"audio_ring_buffer.h"
+#include"controller_input.h"
+#include"profiler.h"
+
+// A controller's state right after it changed, from the input thread to the main loop
+struct PlatformInputSample
+{
+    uint64_t time;      // performance counter
+    int controller_index;
+    ControllerInput controller;
+};
+
+static const int INPUT_QUEUE_SIZE = 1024;  // power of 2; ~1s of changes at 1kHz
+
+// Polls gamepads much faster than the frame rate, and queues every change
+struct InputThread
+{
+    SDL_Thread* thread;
+    int poll_hz;
+    std::atomic<bool> quit;
+    std::atomic<uint32_t> dropped_samples;  // queue was full; the change is sent again on the next poll
+    std::atomic<uint32_t> poll_count;
+    SPSCQueue<PlatformInputSample, INPUT_QUEUE_SIZE> samples;
+};
+
+// Main thread bookkeeping for writing ahead of the play cursor (push mode)
+struct AudioWriteState
+{
+    int avg_samples_per_frame;
+    int avg_samples_since_start_of_frame;
+    int samples_since_last_frame_set_target;
+
+    // play cursor at the start of the frame, when we set the target, and when we write data
+    uint32_t play_cursor_init;
+    uint32_t play_cursor_set_target;
+    uint32_t play_cursor_write_data;
+
+    uint32_t write_cursor;
+    int write_size;     // bytes the game was asked for this frame
+};
+
+// Written by the audio callbacks, read by the latency controller on the main thread
+// Counts only ever go up; the controller diffs them against the last window
+struct AudioCallbackStats
+{
+    uint64_t last_callback_time;    // callback only
+    std::atomic<uint32_t> callback_count;
+    std::atomic<uint32_t> late_callback_count;      // more than 2 device buffers since the previous callback
+    std::atomic<uint32_t> fade_count;               // faded out because a skip was coming (or had come)
+    bool faded_out;                                 // pull mode, callback only; the last block ended in a fade out
+    // the controller swaps these back to their initial values at the end of each window
+    std::atomic<uint64_t> max_callback_interval;    // performance counter ticks
+    std::atomic<int32_t> min_margin;                // push mode: least bytes left over after a callback; negative is an underrun
+};
+
+// Trades latency for fewer dropouts and back again, once per window on the main thread
+struct AudioLatencyController
+{
+    int device_buffer_samples;      // SDL callback size, power of 2
+    int safety_buffers;             // push mode: device buffers written ahead on top of the 2 frame estimate
+    int quiet_windows;              // windows in a row without dropouts
+    int quiet_windows_to_shrink;    // backs off when a shrink causes dropouts, so we don't keep bouncing off the same limit
+    int windows_since_shrink;
+
+    uint64_t window_start_time;
+    uint32_t last_underrun_count;
+    uint32_t last_callback_count;
+    uint32_t last_late_callback_count;
+    uint32_t last_fade_count;
+    uint32_t last_stream_underrun_count;
+};
+
+// Fixed simulation ticks, decoupled from the display frame rate
+// Each frame adds the real time it took, then game_update runs once per whole tick in the accumulator
+struct SimulationClock
+{
+    int64_t tick_ns;
+    int64_t accumulator_ns;     // real time not yet simulated; less than tick_ns after a frame's ticks
+    uint64_t tick_count;
+    uint64_t dropped_ticks;     // ticks skipped because a frame would have needed more than MAX_TICKS_PER_FRAME
+};
+
+static const int MAX_PIPELINE_DEPTH = 3;
+
+// Where a frame's time goes, on whichever thread does that part
+enum FrameStage
+{
+    STAGE_INPUT,
+    STAGE_UPDATE,
+    STAGE_RENDER,
+    STAGE_AUDIO,        // game_get_sound_samples for a frame's sound; only timed on the main thread when headless
+    STAGE_WAIT,         // main thread waiting for the game thread to finish the frame it's about to present
+    STAGE_UPLOAD,
+    STAGE_PRESENT,
+    STAGE_SLEEP,
+    STAGE_COUNT
+};
+
+struct StageTimes
+{
+    int64_t total_ns[STAGE_COUNT];
+    int64_t max_ns[STAGE_COUNT];
+    int64_t current_ns[STAGE_COUNT];    // this frame only
+    int frames;
+    int skipped_presents;       // frames where nothing changed
+    int64_t uploaded_pixels;
+    int64_t frame_pixels;       // what uploading every frame in full would have been
+    int64_t page_faults;        // any thread, during these frames
+    int64_t max_page_faults;    // in one frame
+    int page_fault_frames;      // frames with any
+    int merged_input_samples;   // motion-only samples removed to make room in a full GameInput::samples
+    int dropped_input_samples;  // button edges lost because every sample in a full GameInput::samples was one
+};
+
+// One frame in flight: made by the game thread (or inline at depth 1), then presented by the main thread
+struct PipelineFrame
+{
+    GameRenderBuffer render_buffer;
+    SDL_Texture* texture;   // zero copy only: render_buffer points into this while it's locked
+    bool locked;
+    int64_t frame_ns;       // real time for the simulation to catch up on, set when the frame is requested
+    int64_t update_ns;
+    int64_t render_ns;
+};
+
+// Frame N is presented on the main thread while the game thread makes frame N + depth - 1
+// Frames are requested and finished strictly in order, so slot i % depth belongs to frame i
+struct FramePipeline
+{
+    int depth;                  // 1 runs the game on the main thread, in order, with no extra latency
+    SDL_Thread* thread;
+    SDL_sem* requested;         // one post per frame for the game thread to make
+    SDL_sem* finished;          // one post per frame it has made
+    SDL_mutex* input_mutex;     // held while the main thread gathers input, and while the game thread takes it
+    std::atomic<bool> quit;
+    uint64_t requested_count;   // main thread only
+    uint64_t finished_count;    // main thread only; frames it has taken back
+    uint64_t made_count;        // game thread only
+    PipelineFrame frames[MAX_PIPELINE_DEPTH];
+    StageTimes stage_times;     // main thread only
+    bool redraw_all;            // main thread only; passed to the game with the next frame requested
+    int width;                  // main thread only; size of the last frame requested
+    int height;
+    // copy path only, game thread only: the last frame made, for finding what changed when the game doesn't say
+    GameRenderBuffer previous_frame;
+    bool previous_frame_valid;
+};
+
+// Picks the internal render resolution from how long the resolution dependent work takes (game render + upload)
+// Buffers and textures are allocated once at max_width x max_height; frames use the top left width x height,
+// which SDL stretches to the window
+struct ResolutionScaler
+{
+    bool dynamic;               // false keeps scale at 1
+    float scale;                // of the window size, per axis
+    int window_width;
+    int window_height;
+    int max_width;
+    int max_height;
+    int width;
+    int height;
+    int64_t window_work_ns;     // over the current window of frames
+    int window_frames;
+    int quiet_windows;          // in a row with enough headroom to go up a step
+};
+
+// Keyboard input read from a file, one "<frame> <button> <down|up>" per line in frame order; # starts a comment
+// Button names are the ControllerButton names in lower case without BUTTON_, e.g. "30 right down"
+struct InputScript
+{
+    FILE* file;
+    bool has_next;
+    uint64_t next_frame;
+    ControllerButton next_button;
+    bool next_down;
+};
+
+// --headless: dummy video and audio drivers, no waiting between frames, and a fixed frame length so runs repeat
+// Every frame is redrawn, uploaded and presented in full, so the times are the same work whatever the game draws
+// Every frame's stage times are kept for a min/median/p99/max report on stdout at the end
+static const int HEADLESS_FRAME_COLUMN = STAGE_COUNT;  // whole frame, after the stages
+static const int HEADLESS_COLUMNS = STAGE_COUNT + 1;
 
-struct AudioRingBuffer
+struct HeadlessRun
 {
-    int size;
-    int write_index;
-    int play_index;
-    void* data;
+    bool enabled;
+    int frames;             // to run before quitting
+    int frames_run;
+    int64_t* stage_ns;      // frames x HEADLESS_COLUMNS
 };
 
 struct GameCode
 {
     void* object;
     GameInitMemory* init_memory;
-    GameUpdateAndRender* update_and_render;
+    GameUpdate* update;
+    GameRender* render;
+    GameGetSoundSamples* get_sound_samples;
 };
\ No newline at end of file
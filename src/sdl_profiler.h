@@ -0,0 +1,540 @@
+#ifndef SDL_PROFILER_H
+/*
+ * Collating profiler events (see profiler.h) into call trees, on the main thread
+ *
+ * Once a frame, every thread's queue is drained; each block that ended is added to that frame's tree under the
+ * blocks that were still open around it, with inclusive cycle counts and hit counts.
+ * Blocks can span frames (the game thread, the audio callback); they count in the frame they end in.
+ * The last PROFILE_HISTORY_FRAMES trees are kept.
+ *
+ * Trace capture: for the next N frames, every event collated is also copied out (with counters, which the
+ * trees ignore); when the capture ends a background thread writes it out as Chrome trace JSON, which
+ * chrome://tracing and ui.perfetto.dev both open.
+ *
+ * Included by sdl_main.cpp after sdl_main.h
+ */
+
+#ifdef PROFILER
+
+static void init_profiler(Profiler* profiler, double clocks_per_ms)
+{
+    memset((void*)profiler, 0, sizeof(Profiler));
+    for (int i = 0; i < MAX_PROFILE_THREADS; ++i)
+    {
+        init_spsc_queue(&profiler->threads[i].events);
+    }
+    profiler->clocks_per_ms = clocks_per_ms;
+    profiler->frames[0].begin_clock = read_profile_clock();
+    memset(profiler->frames[0].thread_roots, -1, sizeof(profiler->frames[0].thread_roots));
+}
+
+static inline ProfileFrame* current_profile_frame(Profiler* profiler)
+{
+    return &profiler->frames[profiler->frame_count % PROFILE_HISTORY_FRAMES];
+}
+
+static int get_profile_name_index(Profiler* profiler, const char* name)
+{
+    uint32_t slot = (uint32_t)(((uintptr_t)name >> 3) * 2654435761u) & (MAX_PROFILE_NAME_POINTERS - 1);
+    for (;;)
+    {
+        if (profiler->name_pointers[slot] == name)
+        {
+            return profiler->name_pointer_indices[slot];
+        }
+        if (!profiler->name_pointers[slot])
+        {
+            break;
+        }
+        slot = (slot + 1) & (MAX_PROFILE_NAME_POINTERS - 1);
+    }
+
+    // first time we've seen this pointer; it may be a name we already copied from an unloaded module
+    int index = -1;
+    for (int i = 0; i < profiler->num_names; ++i)
+    {
+        if (strncmp(profiler->names[i].name, name, PROFILE_NAME_LENGTH - 1) == 0)
+        {
+            index = i;
+            break;
+        }
+    }
+    if (index < 0)
+    {
+        if (profiler->num_names == MAX_PROFILE_NAMES)
+        {
+            return -1;
+        }
+        index = profiler->num_names++;
+        strncpy(profiler->names[index].name, name, PROFILE_NAME_LENGTH - 1);
+    }
+    // always leave a free slot, so lookups stop; past that, new pointers just aren't cached
+    if (profiler->num_name_pointers < MAX_PROFILE_NAME_POINTERS - 1)
+    {
+        profiler->name_pointers[slot] = name;
+        profiler->name_pointer_indices[slot] = index;
+        profiler->num_name_pointers++;
+    }
+    return index;
+}
+
+// Call before unloading a module that timed blocks, after collating its last events
+// A new module can load its strings where the old ones were
+static void forget_profile_name_pointers(Profiler* profiler)
+{
+    memset(profiler->name_pointers, 0, sizeof(profiler->name_pointers));
+    profiler->num_name_pointers = 0;
+}
+
+static int add_profile_node(ProfileFrame* frame, int name_index, int parent)
+{
+    if (frame->num_nodes == MAX_PROFILE_NODES)
+    {
+        return -1;
+    }
+    int index = frame->num_nodes++;
+    ProfileNode* node = &frame->nodes[index];
+    node->name_index = name_index;
+    node->parent = parent;
+    node->first_child = -1;
+    node->next_sibling = -1;
+    node->cycles = 0;
+    node->hits = 0;
+    if (parent >= 0)
+    {
+        node->next_sibling = frame->nodes[parent].first_child;
+        frame->nodes[parent].first_child = index;
+    }
+    return index;
+}
+
+static int find_or_add_profile_child(ProfileFrame* frame, int parent, int name_index)
+{
+    for (int child = frame->nodes[parent].first_child; child >= 0; child = frame->nodes[child].next_sibling)
+    {
+        if (frame->nodes[child].name_index == name_index)
+        {
+            return child;
+        }
+    }
+    return add_profile_node(frame, name_index, parent);
+}
+
+// A block on thread_index ended; add it to this frame's tree under the blocks still open around it
+static void add_profile_block(Profiler* profiler, int thread_index, int depth, uint64_t cycles)
+{
+    ProfileFrame* frame = current_profile_frame(profiler);
+    int node = frame->thread_roots[thread_index];
+    if (node < 0)
+    {
+        node = add_profile_node(frame, -1, -1);
+        frame->thread_roots[thread_index] = node;
+    }
+    for (int level = 0; level <= depth && node >= 0; ++level)
+    {
+        node = find_or_add_profile_child(frame, node, profiler->open_blocks[thread_index][level].name_index);
+    }
+    if (node < 0)
+    {
+        frame->dropped_events++;
+        return;
+    }
+    frame->nodes[node].cycles += cycles;
+    frame->nodes[node].hits++;
+}
+
+/*
+ * Trace capture
+ */
+
+static const int MAX_TRACE_EVENTS = 1 << 20;    // 24MiB; over 8000 events a frame at the default length
+static const int DEFAULT_TRACE_FRAMES = 120;
+
+struct TraceEvent
+{
+    uint64_t clock;
+    int64_t value;
+    int32_t name_index;
+    uint16_t thread_index;
+    uint16_t type;
+};
+
+struct TraceCapture
+{
+    char path[MAX_PATH_LENGTH];
+    int frames_left;
+    uint64_t begin_clock;
+    double clocks_per_ms;
+    int num_events;
+    uint32_t dropped_events;    // past MAX_TRACE_EVENTS
+    TraceEvent* events;
+
+    // filled in when recording ends, for the writer; names are only ever appended to, so the writer can read them
+    const ProfileName* names;
+    int num_names;
+    char thread_names[MAX_PROFILE_THREADS][PROFILE_NAME_LENGTH];
+};
+
+// Main thread only, apart from the capture being written
+struct TraceRecorder
+{
+    int requested_frames;           // start recording at the next frame boundary
+    char requested_path[MAX_PATH_LENGTH];
+    TraceCapture* recording;
+    TraceCapture* writing;
+    SDL_Thread* writer;
+    std::atomic<bool> written;
+};
+
+static TraceRecorder trace_recorder;
+
+// Start capturing frames at the end of this one (or once the last capture is written); ignored while one is being recorded
+static void request_trace_capture(int frames, const char* path)
+{
+    if (trace_recorder.recording || trace_recorder.requested_frames)
+    {
+        DEBUG_PRINTF("Already capturing a trace\n");
+        return;
+    }
+    trace_recorder.requested_frames = MAX(frames, 1);
+    SDL_strlcpy(trace_recorder.requested_path, path, MAX_PATH_LENGTH);
+}
+
+static void add_trace_event(TraceCapture* capture, int thread_index, int name_index, uint64_t clock, uint32_t type, int64_t value)
+{
+    if (capture->num_events == MAX_TRACE_EVENTS)
+    {
+        capture->dropped_events++;
+        return;
+    }
+    TraceEvent* event = &capture->events[capture->num_events++];
+    event->clock = clock;
+    event->value = value;
+    event->name_index = name_index;
+    event->thread_index = (uint16_t)thread_index;
+    event->type = (uint16_t)type;
+}
+
+// Drain every thread's queue into the current frame's tree
+// Also call this before unloading game code, while its name strings are still mapped
+static void collate_profile_events(Profiler* profiler)
+{
+    ProfileFrame* frame = current_profile_frame(profiler);
+    for (int t = 0; t < MAX_PROFILE_THREADS; ++t)
+    {
+        ProfileThread* thread = &profiler->threads[t];
+        if (!thread->os_thread_id.load(std::memory_order_acquire))
+        {
+            continue;
+        }
+        frame->dropped_events += thread->dropped_events.exchange(0, std::memory_order_relaxed);
+
+        int* depth = &profiler->open_depth[t];
+        TraceCapture* capture = trace_recorder.recording;
+        ProfileEvent event;
+        while (spsc_pop(&thread->events, &event))
+        {
+            int name_index = get_profile_name_index(profiler, event.name);
+            if (event.type == PROFILE_EVENT_COUNTER)
+            {
+                if (capture)
+                {
+                    add_trace_event(capture, t, name_index, event.clock, PROFILE_EVENT_COUNTER, event.value);
+                }
+            }
+            else if (event.type == PROFILE_EVENT_BEGIN)
+            {
+                if (*depth == MAX_PROFILE_DEPTH)
+                {
+                    frame->dropped_events++;
+                    continue;
+                }
+                profiler->open_blocks[t][*depth].name_index = name_index;
+                profiler->open_blocks[t][*depth].begin_clock = event.clock;
+                (*depth)++;
+                if (capture)
+                {
+                    add_trace_event(capture, t, name_index, event.clock, PROFILE_EVENT_BEGIN, 0);
+                }
+            }
+            else
+            {
+                // normally the innermost block; if not, events were dropped and the blocks inside it lost their ends
+                int level = *depth - 1;
+                while (level >= 0 && profiler->open_blocks[t][level].name_index != name_index)
+                {
+                    level--;
+                }
+                if (level < 0)
+                {
+                    // its begin was dropped
+                    frame->dropped_events++;
+                    continue;
+                }
+                add_profile_block(profiler, t, level, event.clock - profiler->open_blocks[t][level].begin_clock);
+                if (capture)
+                {
+                    // innermost first, so the trace stays nested
+                    for (int inner = *depth - 1; inner >= level; --inner)
+                    {
+                        add_trace_event(capture, t, profiler->open_blocks[t][inner].name_index, event.clock, PROFILE_EVENT_END, 0);
+                    }
+                }
+                *depth = level;
+            }
+        }
+    }
+}
+
+// Escape just enough for names to be JSON strings
+static void write_trace_string(FILE* file, const char* string)
+{
+    fputc('"', file);
+    for (const char* c = string; *c; ++c)
+    {
+        if (*c == '"' || *c == '\\')
+        {
+            fputc('\\', file);
+        }
+        fputc((unsigned char)*c >= ' ' ? *c : ' ', file);
+    }
+    fputc('"', file);
+}
+
+static int trace_writer_proc(void* data)
+{
+    TraceCapture* capture = (TraceCapture*)data;
+    FILE* file = fopen(capture->path, "w");
+    if (!file)
+    {
+        DEBUG_PRINTF("Couldn't open trace file %s\n", capture->path);
+    }
+    else
+    {
+        fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+        fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"game\"}}");
+        for (int t = 0; t < MAX_PROFILE_THREADS; ++t)
+        {
+            if (capture->thread_names[t][0])
+            {
+                fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":", t);
+                write_trace_string(file, capture->thread_names[t]);
+                fprintf(file, "}}");
+            }
+        }
+
+        static const char PHASES[] = {'B', 'E', 'C'};
+        for (int i = 0; i < capture->num_events; ++i)
+        {
+            TraceEvent* event = &capture->events[i];
+            // microseconds since the capture started
+            double ts = (double)(int64_t)(event->clock - capture->begin_clock) * 1000.0 / capture->clocks_per_ms;
+            const char* name = event->name_index >= 0 && event->name_index < capture->num_names ? capture->names[event->name_index].name : "?";
+            fprintf(file, ",\n{\"name\":");
+            write_trace_string(file, name);
+            fprintf(file, ",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%d", PHASES[event->type], ts, event->thread_index);
+            if (event->type == PROFILE_EVENT_COUNTER)
+            {
+                fprintf(file, ",\"args\":{\"value\":%lld}", (long long)event->value);
+            }
+            fputc('}', file);
+        }
+        fprintf(file, "\n]}\n");
+        fclose(file);
+        DEBUG_PRINTF("Wrote %d trace events to %s (%u dropped)\n", capture->num_events, capture->path, capture->dropped_events);
+    }
+
+    free(capture->events);
+    free(capture);
+    trace_recorder.written.store(true, std::memory_order_release);
+    return 0;
+}
+
+// Blocks still open when recording starts begin where they really began, so every end has a begin
+static void start_trace_capture(Profiler* profiler, uint64_t now)
+{
+    if (trace_recorder.writer)
+    {
+        if (!trace_recorder.written.load(std::memory_order_acquire))
+        {
+            // try again next frame
+            return;
+        }
+        SDL_WaitThread(trace_recorder.writer, NULL);
+        trace_recorder.writer = NULL;
+    }
+
+    TraceCapture* capture = (TraceCapture*)calloc(1, sizeof(TraceCapture));
+    TraceEvent* events = (TraceEvent*)malloc(sizeof(TraceEvent) * MAX_TRACE_EVENTS);
+    if (!capture || !events)
+    {
+        DEBUG_PRINTF("Couldn't allocate trace capture\n");
+        free(capture);
+        free(events);
+        trace_recorder.requested_frames = 0;
+        return;
+    }
+    SDL_strlcpy(capture->path, trace_recorder.requested_path, MAX_PATH_LENGTH);
+    capture->frames_left = trace_recorder.requested_frames;
+    capture->begin_clock = now;
+    capture->clocks_per_ms = profiler->clocks_per_ms;
+    capture->events = events;
+    trace_recorder.requested_frames = 0;
+    trace_recorder.recording = capture;
+
+    for (int t = 0; t < MAX_PROFILE_THREADS; ++t)
+    {
+        for (int level = 0; level < profiler->open_depth[t]; ++level)
+        {
+            ProfileOpenBlock* block = &profiler->open_blocks[t][level];
+            add_trace_event(capture, t, block->name_index, MIN(block->begin_clock, now), PROFILE_EVENT_BEGIN, 0);
+        }
+    }
+    DEBUG_PRINTF("Capturing a trace of %d frames\n", capture->frames_left);
+}
+
+// Blocks still open are ended here, then the capture is written on its own thread
+static void finish_trace_capture(Profiler* profiler, uint64_t now)
+{
+    TraceCapture* capture = trace_recorder.recording;
+    trace_recorder.recording = NULL;
+
+    for (int t = 0; t < MAX_PROFILE_THREADS; ++t)
+    {
+        for (int level = profiler->open_depth[t] - 1; level >= 0; --level)
+        {
+            add_trace_event(capture, t, profiler->open_blocks[t][level].name_index, now, PROFILE_EVENT_END, 0);
+        }
+        if (profiler->threads[t].named.load(std::memory_order_acquire))
+        {
+            memcpy(capture->thread_names[t], profiler->threads[t].name, PROFILE_NAME_LENGTH);
+        }
+    }
+    capture->names = profiler->names;
+    capture->num_names = profiler->num_names;
+
+    trace_recorder.written.store(false, std::memory_order_relaxed);
+    trace_recorder.writer = SDL_CreateThread(trace_writer_proc, "trace writer", capture);
+    if (!trace_recorder.writer)
+    {
+        DEBUG_PRINTF("Couldn't create trace writer thread - SDL_Error: %s\n", SDL_GetError());
+        free(capture->events);
+        free(capture);
+    }
+}
+
+// At shutdown: write whatever was captured, and wait for it
+static void stop_trace_capture(Profiler* profiler)
+{
+    trace_recorder.requested_frames = 0;
+    if (trace_recorder.recording)
+    {
+        collate_profile_events(profiler);
+        finish_trace_capture(profiler, read_profile_clock());
+    }
+    if (trace_recorder.writer)
+    {
+        SDL_WaitThread(trace_recorder.writer, NULL);
+        trace_recorder.writer = NULL;
+    }
+}
+
+// Collate, then start a new frame, overwriting the oldest one in the history
+static void end_profile_frame(Profiler* profiler)
+{
+    collate_profile_events(profiler);
+    uint64_t now = read_profile_clock();
+    current_profile_frame(profiler)->end_clock = now;
+    profiler->frame_count++;
+
+    if (trace_recorder.recording && --trace_recorder.recording->frames_left == 0)
+    {
+        finish_trace_capture(profiler, now);
+    }
+    if (trace_recorder.requested_frames && !trace_recorder.recording)
+    {
+        start_trace_capture(profiler, now);
+    }
+
+    ProfileFrame* frame = current_profile_frame(profiler);
+    frame->begin_clock = now;
+    frame->end_clock = 0;
+    frame->dropped_events = profiler->unregistered_events.exchange(0, std::memory_order_relaxed);
+    frame->num_nodes = 0;
+    memset(frame->thread_roots, -1, sizeof(frame->thread_roots));
+}
+
+static void print_profile_node(Profiler* profiler, ProfileFrame* frame, int node_index, int indent, double frame_clocks)
+{
+    ProfileNode* node = &frame->nodes[node_index];
+    const char* name = node->name_index >= 0 ? profiler->names[node->name_index].name : "?";
+    DEBUG_PRINTF("  %*s%-*s %8.3fms %6.1f%% %6u hits %14llu cycles\n", indent * 2, "", 40 - indent * 2, name,
+                 (double)node->cycles / profiler->clocks_per_ms, 100.0 * (double)node->cycles / frame_clocks,
+                 node->hits, (unsigned long long)node->cycles);
+    for (int child = node->first_child; child >= 0; child = frame->nodes[child].next_sibling)
+    {
+        print_profile_node(profiler, frame, child, indent + 1, frame_clocks);
+    }
+}
+
+static void print_profile_frame(Profiler* profiler, ProfileFrame* frame, const char* title)
+{
+    double frame_clocks = (double)MAX(frame->end_clock - frame->begin_clock, (uint64_t)1);
+    DEBUG_PRINTF("%s: %.3fms, %d nodes, %u dropped events\n", title, frame_clocks / profiler->clocks_per_ms,
+                 frame->num_nodes, frame->dropped_events);
+    for (int t = 0; t < MAX_PROFILE_THREADS; ++t)
+    {
+        if (frame->thread_roots[t] < 0)
+        {
+            continue;
+        }
+        DEBUG_PRINTF("  thread %d\n", t);
+        for (int child = frame->nodes[frame->thread_roots[t]].first_child; child >= 0; child = frame->nodes[child].next_sibling)
+        {
+            print_profile_node(profiler, frame, child, 1, frame_clocks);
+        }
+    }
+}
+
+// The last finished frame, and the slowest one still in the history
+static void print_profile_report(Profiler* profiler)
+{
+    if (!profiler->frame_count)
+    {
+        return;
+    }
+    uint64_t history = MIN(profiler->frame_count, (uint64_t)PROFILE_HISTORY_FRAMES - 1);
+    ProfileFrame* last = &profiler->frames[(profiler->frame_count - 1) % PROFILE_HISTORY_FRAMES];
+    ProfileFrame* slowest = last;
+    for (uint64_t i = 1; i <= history; ++i)
+    {
+        ProfileFrame* frame = &profiler->frames[(profiler->frame_count - i) % PROFILE_HISTORY_FRAMES];
+        if (frame->end_clock - frame->begin_clock > slowest->end_clock - slowest->begin_clock)
+        {
+            slowest = frame;
+        }
+    }
+    print_profile_frame(profiler, last, "Profile, last frame");
+    char title[64];
+    snprintf(title, sizeof(title), "Profile, slowest of the last %llu frames", (unsigned long long)history);
+    print_profile_frame(profiler, slowest, title);
+}
+
+
+// Performance counter and profile clock over the same short wait, for converting cycles to ms
+static double measure_profile_clocks_per_ms()
+{
+    uint64_t frequency = SDL_GetPerformanceFrequency();
+    uint64_t start_counter = SDL_GetPerformanceCounter();
+    uint64_t start_clock = read_profile_clock();
+    SDL_Delay(10);
+    uint64_t elapsed_counter = SDL_GetPerformanceCounter() - start_counter;
+    uint64_t elapsed_clock = read_profile_clock() - start_clock;
+    return (double)elapsed_clock * (double)frequency / ((double)elapsed_counter * 1000.0);
+}
+
+#endif  // PROFILER
+
+
+#define SDL_PROFILER_H
+#endif
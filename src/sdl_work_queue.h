@@ -0,0 +1,324 @@
+#ifndef SDL_WORK_QUEUE_H
+/*
+ * Platform thread pool and work queue
+ *
+ * Each thread (worker threads, plus "lane 0" for any non-worker thread) owns a lane: a bounded lock-free
+ * multi-producer/multi-consumer ring of work entries.
+ * Workers take from their own lane first, then steal from the others, then sleep on a semaphore.
+ * The semaphore is only posted for a worker that has said it's going to sleep, so posts don't pile up while
+ * everyone is busy and wake workers later to find nothing to do.
+ * Non-worker threads spread new work round-robin over the lanes; workers add to their own lane.
+ *
+ * Included by sdl_main.cpp after sdl_main.h
+ */
+
+#include<atomic>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include<immintrin.h>
+#define CPU_RELAX() _mm_pause()
+#else
+#define CPU_RELAX()
+#endif
+
+static const int MAX_WORK_THREADS = 64;
+static const uint32_t WORK_QUEUE_LANE_SIZE = 256;     // must be power of 2
+static const uint32_t WORK_QUEUE_LANE_MASK = WORK_QUEUE_LANE_SIZE - 1;
+
+struct WorkQueueEntry
+{
+    // Tells producers and consumers whose turn it is to use this entry
+    // == position: free for the producer at that position
+    // == position + 1: filled, ready for the consumer at that position
+    std::atomic<uint32_t> sequence;
+    PlatformWorkQueueCallback* callback;
+    void* data;
+};
+
+struct WorkQueueLane
+{
+    alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> write_position;
+    alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> read_position;
+    alignas(CACHE_LINE_SIZE) WorkQueueEntry entries[WORK_QUEUE_LANE_SIZE];
+};
+
+struct PlatformWorkQueue
+{
+    // goal is incremented when work is added, count when it's finished; the queue is idle when they're equal
+    alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> completion_goal;
+    alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> completion_count;
+    alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> next_lane;
+    std::atomic<bool> quit;
+    // workers that found nothing to do and are (about to be) waiting on the semaphore, less those already posted for
+    std::atomic<int> sleeping_workers;
+
+    SDL_sem* semaphore;
+    int num_lanes;                  // num_workers + 1
+    int num_workers;
+    WorkQueueLane* lanes;
+    SDL_Thread* workers[MAX_WORK_THREADS];
+};
+
+struct WorkThreadInfo
+{
+    PlatformWorkQueue* queue;
+    int lane;
+};
+
+// lane owned by the current thread; 0 for the main thread and any other non-worker thread
+static thread_local int work_queue_lane = 0;
+
+
+static bool push_work_entry(WorkQueueLane* lane, PlatformWorkQueueCallback* callback, void* data)
+{
+    uint32_t position = lane->write_position.load(std::memory_order_relaxed);
+    WorkQueueEntry* entry;
+    for (;;)
+    {
+        entry = &lane->entries[position & WORK_QUEUE_LANE_MASK];
+        uint32_t sequence = entry->sequence.load(std::memory_order_acquire);
+        int32_t diff = (int32_t)(sequence - position);
+        if (diff == 0)
+        {
+            if (lane->write_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            return false;   // full
+        }
+        else
+        {
+            position = lane->write_position.load(std::memory_order_relaxed);
+        }
+    }
+
+    entry->callback = callback;
+    entry->data = data;
+    entry->sequence.store(position + 1, std::memory_order_release);
+    return true;
+}
+
+static bool pop_work_entry(WorkQueueLane* lane, PlatformWorkQueueCallback** callback, void** data)
+{
+    uint32_t position = lane->read_position.load(std::memory_order_relaxed);
+    WorkQueueEntry* entry;
+    for (;;)
+    {
+        entry = &lane->entries[position & WORK_QUEUE_LANE_MASK];
+        uint32_t sequence = entry->sequence.load(std::memory_order_acquire);
+        int32_t diff = (int32_t)(sequence - (position + 1));
+        if (diff == 0)
+        {
+            if (lane->read_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            return false;   // empty
+        }
+        else
+        {
+            position = lane->read_position.load(std::memory_order_relaxed);
+        }
+    }
+
+    *callback = entry->callback;
+    *data = entry->data;
+    // free the entry for the producer one lap around the ring from here
+    entry->sequence.store(position + WORK_QUEUE_LANE_SIZE, std::memory_order_release);
+    return true;
+}
+
+static inline void run_work_entry(PlatformWorkQueue* queue, PlatformWorkQueueCallback* callback, void* data)
+{
+    callback(queue, data);
+    // release so whoever sees the count also sees the results
+    queue->completion_count.fetch_add(1, std::memory_order_release);
+}
+
+// run one entry, trying our own lane first, then stealing; returns false if there was nothing to do
+static bool do_next_work_entry(PlatformWorkQueue* queue)
+{
+    for (int i = 0; i < queue->num_lanes; ++i)
+    {
+        int lane = (work_queue_lane + i) % queue->num_lanes;
+        PlatformWorkQueueCallback* callback;
+        void* data;
+        if (pop_work_entry(&queue->lanes[lane], &callback, &data))
+        {
+            run_work_entry(queue, callback, data);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Post for one sleeping worker, if there is one
+static void wake_work_thread(PlatformWorkQueue* queue)
+{
+    // pairs with the fence in wait_for_work: either we see the worker going to sleep, or it sees our entry
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int sleeping = queue->sleeping_workers.load(std::memory_order_relaxed);
+    while (sleeping > 0)
+    {
+        if (queue->sleeping_workers.compare_exchange_weak(sleeping, sleeping - 1, std::memory_order_relaxed))
+        {
+            SDL_SemPost(queue->semaphore);
+            return;
+        }
+    }
+}
+
+// Sleep until there's work, unless some turns up (and gets done) while we're saying we're going to sleep
+static void wait_for_work(PlatformWorkQueue* queue)
+{
+    queue->sleeping_workers.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (do_next_work_entry(queue) || queue->quit.load(std::memory_order_acquire))
+    {
+        // take back our place; if a producer already took it, the post it made is ours to consume
+        int sleeping = queue->sleeping_workers.load(std::memory_order_relaxed);
+        while (sleeping > 0 && !queue->sleeping_workers.compare_exchange_weak(sleeping, sleeping - 1, std::memory_order_relaxed))
+        {
+        }
+        if (sleeping > 0)
+        {
+            return;
+        }
+    }
+    SDL_SemWait(queue->semaphore);
+}
+
+static FUNC_PLATFORM_ADD_WORK_ENTRY(platform_add_work_entry)
+{
+    DEBUG_ASSERT(callback);
+
+    queue->completion_goal.fetch_add(1, std::memory_order_relaxed);
+
+    int start_lane = work_queue_lane;
+    if (start_lane == 0)
+    {
+        start_lane = (int)(queue->next_lane.fetch_add(1, std::memory_order_relaxed) % (uint32_t)queue->num_lanes);
+    }
+
+    for (int i = 0; i < queue->num_lanes; ++i)
+    {
+        if (push_work_entry(&queue->lanes[(start_lane + i) % queue->num_lanes], callback, data))
+        {
+            wake_work_thread(queue);
+            return;
+        }
+    }
+
+    // every lane is full; just do it now
+    run_work_entry(queue, callback, data);
+}
+
+static FUNC_PLATFORM_COMPLETE_ALL_WORK(platform_complete_all_work)
+{
+    while (queue->completion_count.load(std::memory_order_acquire) != queue->completion_goal.load(std::memory_order_relaxed))
+    {
+        if (!do_next_work_entry(queue))
+        {
+            // the last entries are running on other threads
+            CPU_RELAX();
+        }
+    }
+}
+
+static int work_thread_proc(void* data)
+{
+    WorkThreadInfo* info = (WorkThreadInfo*)data;
+    PlatformWorkQueue* queue = info->queue;
+    work_queue_lane = info->lane;
+    NAME_PROFILE_THREAD("worker");
+
+    while (!queue->quit.load(std::memory_order_acquire))
+    {
+        if (!do_next_work_entry(queue))
+        {
+            wait_for_work(queue);
+        }
+    }
+
+    return 0;
+}
+
+static void init_work_queue(PlatformWorkQueue* queue, int num_workers)
+{
+    static WorkThreadInfo thread_infos[MAX_WORK_THREADS];
+
+    num_workers = MIN(MAX(num_workers, 0), MAX_WORK_THREADS);
+
+    queue->completion_goal = 0;
+    queue->completion_count = 0;
+    queue->next_lane = 0;
+    queue->quit = false;
+    queue->sleeping_workers = 0;
+    queue->num_workers = num_workers;
+    queue->num_lanes = num_workers + 1;
+
+    queue->lanes = (WorkQueueLane*)LARGE_ALLOC(sizeof(WorkQueueLane) * queue->num_lanes);
+    if (!queue->lanes)
+    {
+        FATAL_PRINTF("Couldn't allocate work queue\n");
+    }
+    for (int l = 0; l < queue->num_lanes; ++l)
+    {
+        WorkQueueLane* lane = &queue->lanes[l];
+        lane->write_position = 0;
+        lane->read_position = 0;
+        for (uint32_t i = 0; i < WORK_QUEUE_LANE_SIZE; ++i)
+        {
+            lane->entries[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    queue->semaphore = SDL_CreateSemaphore(0);
+    if (!queue->semaphore)
+    {
+        FATAL_PRINTF("Couldn't create work queue semaphore - SDL_Error: %s\n", SDL_GetError());
+    }
+
+    for (int i = 0; i < num_workers; ++i)
+    {
+        thread_infos[i].queue = queue;
+        thread_infos[i].lane = i + 1;
+        queue->workers[i] = SDL_CreateThread(work_thread_proc, "worker", &thread_infos[i]);
+        if (!queue->workers[i])
+        {
+            FATAL_PRINTF("Couldn't create worker thread - SDL_Error: %s\n", SDL_GetError());
+        }
+    }
+
+    DEBUG_PRINTF("Work queue: %d worker threads\n", num_workers);
+}
+
+static void free_work_queue(PlatformWorkQueue* queue)
+{
+    platform_complete_all_work(queue);
+
+    queue->quit.store(true, std::memory_order_release);
+    // whether they're asleep yet or not; any posts left over go with the semaphore
+    for (int i = 0; i < queue->num_workers; ++i)
+    {
+        SDL_SemPost(queue->semaphore);
+    }
+    for (int i = 0; i < queue->num_workers; ++i)
+    {
+        SDL_WaitThread(queue->workers[i], NULL);
+    }
+
+    SDL_DestroySemaphore(queue->semaphore);
+    LARGE_FREE(queue->lanes, sizeof(WorkQueueLane) * queue->num_lanes);
+    queue->lanes = NULL;
+}
+
+
+#define SDL_WORK_QUEUE_H
+#endif
@@ -0,0 +1,69 @@
+#ifndef SPSC_QUEUE_H
+/*
+ * Bounded lock-free queue for passing messages from exactly one producer thread to exactly one consumer thread
+ * Plain data only; the queue can live in game memory (zero-initialized) and survives game code reloads
+ */
+
+#include<atomic>
+
+#include"util.h"
+
+template<typename T, int N>
+struct SPSCQueue
+{
+    static_assert(IS_POWER_OF_2(N), "SPSCQueue size must be a power of 2");
+
+    // positions count items since the start and wrap naturally at 2^32
+    alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> write_position;    // written by the producer only
+    alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> read_position;     // written by the consumer only
+    alignas(CACHE_LINE_SIZE) T items[N];
+};
+
+template<typename T, int N>
+static inline void init_spsc_queue(SPSCQueue<T, N>* queue)
+{
+    queue->write_position.store(0, std::memory_order_relaxed);
+    queue->read_position.store(0, std::memory_order_relaxed);
+}
+
+// Producer only; returns false (and drops the item) if the queue is full
+template<typename T, int N>
+static inline bool spsc_push(SPSCQueue<T, N>* queue, const T* item)
+{
+    uint32_t write_position = queue->write_position.load(std::memory_order_relaxed);
+    uint32_t read_position = queue->read_position.load(std::memory_order_acquire);
+    if (write_position - read_position >= (uint32_t)N)
+    {
+        return false;
+    }
+
+    queue->items[write_position & (N - 1)] = *item;
+    queue->write_position.store(write_position + 1, std::memory_order_release);
+    return true;
+}
+
+// Consumer only; returns false if the queue is empty
+template<typename T, int N>
+static inline bool spsc_pop(SPSCQueue<T, N>* queue, T* item)
+{
+    uint32_t read_position = queue->read_position.load(std::memory_order_relaxed);
+    uint32_t write_position = queue->write_position.load(std::memory_order_acquire);
+    if (read_position == write_position)
+    {
+        return false;
+    }
+
+    *item = queue->items[read_position & (N - 1)];
+    queue->read_position.store(read_position + 1, std::memory_order_release);
+    return true;
+}
+
+template<typename T, int N>
+static inline int spsc_count(SPSCQueue<T, N>* queue)
+{
+    return (int)(queue->write_position.load(std::memory_order_acquire) - queue->read_position.load(std::memory_order_acquire));
+}
+
+
+#define SPSC_QUEUE_H
+#endif
@@ -25,6 +25,11 @@ static_assert(CHAR_BIT == 8, "Char must be 8 bits");
 
 #define BITS_PER_BYTE 8
 
+#define IS_POWER_OF_2(X) ((X) > 0 && ((X) & ((X) - 1)) == 0)
+
+// for keeping data written by different threads on separate cache lines
+static const int CACHE_LINE_SIZE = 64;
+
 // Technically correct...the best kind of correct!
 // Except when it comes to naming things
 #define KIBIBYTES(X) (((uint64_t)X) * 1024)